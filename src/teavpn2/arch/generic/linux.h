@@ -6,6 +6,7 @@
 #ifndef TEAVPN2__ARCH__GENERIC__LINUX_H
 #define TEAVPN2__ARCH__GENERIC__LINUX_H
 
+#include <time.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -55,6 +56,30 @@ static inline ssize_t __sys_sendto(int sockfd, const void *buf, size_t len,
 	return unlikely(ret == -1) ? (ssize_t) -errno : ret;
 }
 
+static inline ssize_t __sys_recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	ssize_t ret;
+	ret = recvmsg(sockfd, msg, flags);
+	return unlikely(ret == -1) ? (ssize_t) -errno : ret;
+}
+
+static inline int __sys_recvmmsg(int sockfd, struct mmsghdr *msgvec,
+				 unsigned int vlen, int flags,
+				 struct timespec *timeout)
+{
+	int ret;
+	ret = recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+	return unlikely(ret == -1) ? -errno : ret;
+}
+
+static inline int __sys_sendmmsg(int sockfd, struct mmsghdr *msgvec,
+				 unsigned int vlen, int flags)
+{
+	int ret;
+	ret = sendmmsg(sockfd, msgvec, vlen, flags);
+	return unlikely(ret == -1) ? -errno : ret;
+}
+
 static inline int __sys_close(int fd)
 {
 	int ret;
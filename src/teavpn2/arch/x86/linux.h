@@ -6,6 +6,7 @@
 #ifndef TEAVPN2__ARCH__X86__LINUX_H
 #define TEAVPN2__ARCH__X86__LINUX_H
 
+#include <time.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/epoll.h>
@@ -126,6 +127,63 @@ static inline ssize_t __sys_sendto(int sockfd, const void *buf, size_t len,
 	return rax;
 }
 
+static inline ssize_t __sys_recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	ssize_t rax;
+
+	__asm__ volatile(
+		"syscall"
+		: "=a"(rax)		/* %rax */
+		: "a"(__NR_recvmsg),	/* %rax */
+		  "D"(sockfd),		/* %rdi */
+		  "S"(msg),		/* %rsi */
+		  "d"(flags)		/* %rdx */
+		: "rcx", "r11", "memory"
+	);
+	return rax;
+}
+
+static inline int __sys_recvmmsg(int sockfd, struct mmsghdr *msgvec,
+				 unsigned int vlen, int flags,
+				 struct timespec *timeout)
+{
+	int rax;
+	register int r10 __asm__("r10") = flags;
+	register struct timespec *r8 __asm__("r8") = timeout;
+
+	__asm__ volatile(
+		"syscall"
+		: "=a"(rax)		/* %rax */
+		: "a"(__NR_recvmmsg),	/* %rax */
+		  "D"(sockfd),		/* %rdi */
+		  "S"(msgvec),		/* %rsi */
+		  "d"(vlen),		/* %rdx */
+		  "r"(r10),		/* %r10 */
+		  "r"(r8)		/* %r8  */
+		: "rcx", "r11", "memory"
+	);
+	return rax;
+}
+
+static inline int __sys_sendmmsg(int sockfd, struct mmsghdr *msgvec,
+				 unsigned int vlen, int flags)
+{
+	int rax;
+	register int r10 __asm__("r10") = flags;
+
+	__asm__ volatile(
+		"syscall"
+		: "=a"(rax)		/* %rax */
+		: "a"(__NR_sendmmsg),	/* %rax */
+		  "D"(sockfd),		/* %rdi */
+		  "S"(msgvec),		/* %rsi */
+		  "d"(vlen),		/* %rdx */
+		  "r"(r10)		/* %r10 */
+		: "rcx", "r11", "memory"
+	);
+	return rax;
+}
+
 static inline ssize_t __sys_close(int fd)
 {
 	int rax;
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <arpa/inet.h>
 #include <inih/inih.h>
 #include <teavpn2/common.h>
 
@@ -17,6 +18,7 @@ struct user_parse_ctx {
 	char		fuser[0x100];
 	char		fpass[0x100];
 	struct if_info	iff;
+	struct auth_routes routes;
 };
 
 static inline bool validate_username_char(unsigned char c)
@@ -88,6 +90,54 @@ static int userfile_parse_iface(struct user_parse_ctx *ctx, const char *name,
 }
 
 
+static int userfile_parse_route(struct user_parse_ctx *ctx, const char *name,
+				const char *val, int lineno)
+{
+	char buf[IPV4_L + 4], *slash, *end;
+	struct auth_route *route;
+	struct in_addr addr;
+	unsigned long prefix;
+
+	if (strcmp(name, "ipv4")) {
+		pr_warn("Invalid name \"%s\" in section route in %s:%d", name,
+			ctx->userfile, lineno);
+		return 1;
+	}
+
+	strncpy(buf, val, sizeof(buf));
+	buf[sizeof(buf) - 1] = '\0';
+	slash = strchr(buf, '/');
+	if (!slash)
+		goto invalid;
+
+	*slash++ = '\0';
+	prefix = strtoul(slash, &end, 10);
+	if (end == slash || *end != '\0' || prefix > 32)
+		goto invalid;
+
+	if (inet_pton(AF_INET, buf, &addr) != 1)
+		goto invalid;
+
+	if (ctx->routes.nr >= AUTH_MAX_ROUTES) {
+		pr_warn("Too many routes in %s:%d (max: %u), ignoring %s",
+			ctx->userfile, lineno, AUTH_MAX_ROUTES, val);
+		return 1;
+	}
+
+	route = &ctx->routes.arr[ctx->routes.nr++];
+	route->prefix = (uint8_t)prefix;
+	route->addr = ntohl(addr.s_addr);
+	if (prefix < 32)
+		route->addr &= prefix ? ~0u << (32u - prefix) : 0u;
+	return 1;
+
+invalid:
+	pr_warn("Invalid route \"%s\" in %s:%d (expected: a.b.c.d/len)", val,
+		ctx->userfile, lineno);
+	return 1;
+}
+
+
 /*
  * If success, returns 1.
  * If failure, returns 0.
@@ -101,6 +151,8 @@ static int userfile_parser(void *user, const char *section, const char *name,
 		userfile_parse_auth(ctx, name, val, lineno);
 	} else if (!strcmp(section, "iface")) {
 		userfile_parse_iface(ctx, name, val, lineno);
+	} else if (!strcmp(section, "route")) {
+		userfile_parse_route(ctx, name, val, lineno);
 	} else {
 		pr_warn("Invalid section \"%s\" in %s:%d", section,
 			ctx->userfile, lineno);
@@ -111,7 +163,7 @@ static int userfile_parser(void *user, const char *section, const char *name,
 
 static int _teavpn2_auth(FILE *handle, const char *userfile,
 			 const char *username, const char *password, 
-			 struct if_info *iff)
+			 struct if_info *iff, struct auth_routes *routes)
 {
 	int ret = 0;
 	struct user_parse_ctx ctx;
@@ -138,6 +190,8 @@ static int _teavpn2_auth(FILE *handle, const char *userfile,
 	}
 
 	*iff = ctx.iff;
+	if (routes)
+		*routes = ctx.routes;
 out:
 	memset(&ctx, 0, sizeof(ctx));
 	__asm__ volatile("":"+m"(ctx)::"memory");
@@ -146,7 +200,7 @@ out:
 
 
 bool teavpn2_auth(const char *username, const char *password,
-		  struct if_info *iff)
+		  struct if_info *iff, struct auth_routes *routes)
 {
 	int err = 0;
 	FILE *handle;
@@ -173,7 +227,8 @@ bool teavpn2_auth(const char *username, const char *password,
 		return false;
 	}
 
-	err = _teavpn2_auth(handle, userfile, username, password, iff);
+	err = _teavpn2_auth(handle, userfile, username, password, iff,
+			    routes);
 	if (err) {
 		errno = -err;
 		ret = false;
@@ -18,6 +18,8 @@ struct cli_cfg_sys {
 
 struct cli_cfg_sock {
 	bool			use_encryption;
+	bool			udp_gso;
+	bool			udp_gro;
 	sock_type		type;
 	char			server_addr[64];
 	uint16_t		server_port;
@@ -27,6 +29,7 @@ struct cli_cfg_sock {
 
 struct cli_cfg_iface {
 	bool			override_default;
+	bool			tun_offload;
 	char			dev[IFACENAMESIZ];
 
 	/*
@@ -36,6 +36,8 @@ static void set_default_config(struct cli_cfg *cfg)
 	strncpy2(iface->iff.dev, d_cli_dev, sizeof(iface->iff.dev));
 
 	sock->server_port = d_cli_server_port;
+	sock->udp_gso = true;
+	sock->udp_gro = true;
 }
 
 
@@ -102,11 +104,15 @@ static void dump_client_cfg(struct cli_cfg *cfg)
 	printf("   cfg->sock.type = %s\n",
 		(cfg->sock.type == SOCK_TCP) ? "SOCK_TCP" :
 		((cfg->sock.type == SOCK_UDP) ? "SOCK_UDP" : "unknown"));
+	printf("   cfg->sock.udp_gso = %hhu\n", (uint8_t)cfg->sock.udp_gso);
+	printf("   cfg->sock.udp_gro = %hhu\n", (uint8_t)cfg->sock.udp_gro);
 	PR_CFG(cfg->sock.server_addr, "%s");
 	PR_CFG(cfg->sock.server_port, "%hu");
 	PR_CFG(cfg->sock.event_loop, "%s");
 	putchar('\n');
 	PR_CFG(cfg->iface.dev, "%s");
+	printf("   cfg->iface.tun_offload = %hhu\n",
+		(uint8_t)cfg->iface.tun_offload);
 	puts("=============================================");
 }
 
@@ -271,6 +277,10 @@ static int cfg_parse_section_socket(struct cfg_parse_ctx *ctx, const char *name,
 	struct cli_cfg *cfg = ctx->cfg;
 	if (!strcmp(name, "use_encryption")) {
 		cfg->sock.use_encryption = atoi(val) ? true : false;
+	} else if (!strcmp(name, "udp_gso")) {
+		cfg->sock.udp_gso = atoi(val) ? true : false;
+	} else if (!strcmp(name, "udp_gro")) {
+		cfg->sock.udp_gro = atoi(val) ? true : false;
 	} else if (!strcmp(name, "event_loop")) {
 		strncpy(cfg->sock.event_loop, val, sizeof(cfg->sock.event_loop));
 		cfg->sock.event_loop[sizeof(cfg->sock.event_loop) - 1] = '\0';
@@ -316,6 +326,8 @@ static int cfg_parse_section_iface(struct cfg_parse_ctx *ctx, const char *name,
 		cfg->iface.dev[sizeof(cfg->iface.dev) - 1] = '\0';
 	} else if (!strcmp(name, "override_default")) {
 		cfg->iface.override_default = atoi(val) ? true : false;
+	} else if (!strcmp(name, "tun_offload")) {
+		cfg->iface.tun_offload = atoi(val) ? true : false;
 	} else {
 		pr_err("Unknown name \"%s\" in section \"%s\" at %s:%d\n", name,
 			"iface", cfg->sys.cfg_file, lineno);
@@ -75,8 +75,14 @@ static int select_event_loop(struct cli_udp_state *state)
 		state->epl_threads = NULL;
 		break;
 	case EVTL_IO_URING:
+#ifdef CONFIG_IO_URING
+		state->epl_threads = NULL;
 		state->iou_threads = NULL;
 		break;
+#else
+		pr_err("TeaVPN2 is built without io_uring support");
+		return -EOPNOTSUPP;
+#endif
 	case EVTL_NOP:
 	default:
 		panic("Aiee... invalid event loop value (%u)", state->evt_loop);
@@ -246,6 +252,32 @@ static int init_socket(struct cli_udp_state *state)
 	}
 
 
+	state->udp_gso = false;
+	if (sock->udp_gso) {
+		state->udp_gso = udp_gso_supported(udp_fd);
+		if (state->udp_gso)
+			prl_notice(2, "UDP GSO is enabled");
+		else
+			prl_notice(2, "UDP GSO is not supported by the kernel");
+	}
+
+	/*
+	 * The io_uring event loop receives into packet sized
+	 * buffers, it can't take the coalesced datagrams.
+	 */
+	state->udp_gro = false;
+	if (sock->udp_gro && state->evt_loop != EVTL_IO_URING) {
+		ret = udp_gro_enable(udp_fd);
+		if (!ret) {
+			state->udp_gro = true;
+			prl_notice(2, "UDP GRO is enabled");
+		} else {
+			prl_notice(2, "Cannot enable UDP GRO: " PRERF,
+				   PREAR(-ret));
+		}
+	}
+
+
 	state->udp_fd = udp_fd;
 	return 0;
 
@@ -302,6 +334,16 @@ static int init_iface(struct cli_udp_state *state)
 
 	prl_notice(2, "Initializing virtual network interface (%s)...", dev);
 
+	state->tun_offload = state->cfg->iface.tun_offload;
+	if (state->tun_offload && state->evt_loop == EVTL_IO_URING) {
+		pr_warn("tun_offload is not supported with io_uring, "
+			"disabling it");
+		state->tun_offload = false;
+	}
+
+	if (state->tun_offload)
+		flags |= IFF_VNET_HDR;
+
 
 	tun_fds = state->tun_fds;
 	nn = state->cfg->sys.thread_num;
@@ -316,6 +358,14 @@ static int init_iface(struct cli_udp_state *state)
 			goto err;
 		}
 
+		if (state->tun_offload) {
+			ret = tun_set_offload(tun_fd);
+			if (unlikely(ret < 0)) {
+				__sys_close(tun_fd);
+				goto err;
+			}
+		}
+
 		if (state->evt_loop != EVTL_IO_URING) {
 			ret = fd_set_nonblock(tun_fd);
 			if (unlikely(ret < 0)) {
@@ -636,9 +686,11 @@ static int run_client_event_loop(struct cli_udp_state *state)
 	case EVTL_EPOLL:
 		return teavpn2_udp_client_epoll(state);
 	case EVTL_IO_URING:
-		pr_err("run_client_event_loop() with io_uring: " PRERF,
-			PREAR(EOPNOTSUPP));
+#ifdef CONFIG_IO_URING
+		return teavpn2_udp_client_io_uring(state);
+#else
 		return -EOPNOTSUPP;
+#endif
 	case EVTL_NOP:
 	default:
 		panic("Aiee... invalid event loop value (%u)", state->evt_loop);
@@ -8,18 +8,29 @@
 
 #include <time.h>
 #include <pthread.h>
-#include <sys/time.h>
 #include <sys/epoll.h>
 #include <stdatomic.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <teavpn2/mutex.h>
 #include <teavpn2/stack.h>
+#include <teavpn2/clock.h>
 #include <teavpn2/packet.h>
 #include <teavpn2/client/common.h>
+#include <teavpn2/net/linux/udp_offload.h>
+#include <teavpn2/net/linux/tun_offload.h>
 
+#ifdef CONFIG_IO_URING
+#  include <liburing.h>
+#endif
 
 #define EPOLL_EVT_ARR_NUM 	3u
+
+/*
+ * The maximum number of packets we read from the TUN fd
+ * before sending them to the server at once.
+ */
+#define TUN_READ_BURST		32u
 #define UDP_LOOP_C_DEADLINE	64
 #define UDP_SESS_TIMEOUT	180
 
@@ -47,8 +58,97 @@ struct epl_thread {
 	_Atomic(bool)				is_online;
 
 	uint16_t				idx;
+
+	/*
+	 * The TUN queue this thread writes the server packets to
+	 * (@state->tun_fds[idx]).
+	 */
+	int					tun_fd;
 	struct sc_pkt				*pkt;
+
+	/*
+	 * Burst of packets read from the TUN fd. They are sent
+	 * with a single sendmmsg() call. With UDP GSO, the
+	 * consecutive packets are coalesced into one message
+	 * (with @tx_cmsg carrying the UDP_SEGMENT size), so a
+	 * message may span several @tx_iovs elements.
+	 */
+	struct sc_pkt				*tx_pkts;
+	struct iovec				tx_iovs[TUN_READ_BURST];
+	struct mmsghdr				tx_msgs[TUN_READ_BURST];
+	union udp_gso_cmsg			tx_cmsg[TUN_READ_BURST];
+
+	/*
+	 * Set while a burst the kernel refused to segment is sent
+	 * again without UDP_SEGMENT.
+	 */
+	bool					tx_no_gso;
+
+	/*
+	 * With UDP GRO, a single received datagram may carry
+	 * several coalesced packets. It is received into
+	 * @rx_gro_buf (UDP_GRO_BUF_SIZE bytes) and @rx_cmsg gets
+	 * the segment size. Each segment is copied to @pkt before
+	 * dispatching. @rx_gro_buf is NULL if GRO is not enabled.
+	 */
+	char					*rx_gro_buf;
+	union udp_gro_cmsg			rx_cmsg;
+
+	/*
+	 * TUN offload buffers (only used with @state->tun_offload).
+	 * @tun_rx_buf holds a frame read from the TUN fd before it
+	 * is segmented into @tx_pkts. @tun_gro coalesces the TCP
+	 * segments that are going to be written to the TUN fd.
+	 */
+	uint8_t					*tun_rx_buf;
+	struct tun_gro				tun_gro;
+};
+
+
+#ifdef CONFIG_IO_URING
+/*
+ * The number of buffers in flight per direction per fd
+ * for the io_uring event loop.
+ */
+#define IOU_INFLIGHT		16u
+
+/*
+ * An io_uring buffer slot. A slot is either in the TUN to
+ * server direction (read(TUN) -> send(UDP)) or in the server
+ * to TUN direction (recv(UDP) -> write(TUN)). @fd is the fd
+ * the slot reads from.
+ */
+struct iou_slot {
+	int					fd;
+	bool					is_rx;
+};
+
+
+/*
+ * This is a struct for event loop which uses io_uring.
+ *
+ * The completed packets are processed on the paired @thread
+ * (struct epl_thread), the thread setup and teardown are
+ * shared with the epoll event loop.
+ */
+struct iou_thread {
+	/*
+	 * Pointer to the UDP state struct.
+	 */
+	struct cli_udp_state			*state;
+	struct epl_thread			*thread;
+
+	struct io_uring				ring;
+	bool					ring_init;
+
+	/*
+	 * @bufs[i] is the packet buffer of @slots[i].
+	 */
+	uint16_t				nr_slots;
+	struct sc_pkt				*bufs;
+	struct iou_slot				*slots;
 };
+#endif
 
 
 struct timer_thread {
@@ -98,6 +198,29 @@ struct cli_udp_state {
 	 */
 	bool					need_remove_iff;
 
+	/*
+	 * @udp_gso is true when we coalesce packets with
+	 * UDP_SEGMENT. It is turned off at runtime if the
+	 * kernel keeps rejecting GSO sends, @udp_gso_fails
+	 * counts the failures in a row.
+	 */
+	volatile bool				udp_gso;
+	_Atomic(uint32_t)			udp_gso_fails;
+
+	/*
+	 * @udp_gro is true when UDP_GRO is enabled on the
+	 * socket, the receive path must then be ready to get
+	 * several datagrams coalesced into one.
+	 */
+	bool					udp_gro;
+
+	/*
+	 * @tun_offload is true when the TUN fds are opened with
+	 * IFF_VNET_HDR, every frame on them is then prefixed with
+	 * a virtio_net_hdr and may be a TSO super-packet.
+	 */
+	bool					tun_offload;
+
 
 	/*
 	 * For timeout timer.
@@ -133,27 +256,33 @@ struct cli_udp_state {
 
 	struct sc_pkt				*pkt;
 
-	union {
-		/*
-		 * For epoll event loop.
-		 */
-		struct {
-			struct epl_thread	*epl_threads;
-		};
-
-
-		/*
-		 * For io_uring event loop.
-		 */
-		struct {
-			struct iou_thread	*iou_threads;
-		};
-	};
+	/*
+	 * The packet processing contexts, one per thread. The
+	 * io_uring event loop uses them too.
+	 */
+	struct epl_thread			*epl_threads;
+
+#ifdef CONFIG_IO_URING
+	/*
+	 * For io_uring event loop, @iou_threads[i] is paired
+	 * with @epl_threads[i].
+	 */
+	struct iou_thread			*iou_threads;
+#endif
 };
 
 
 extern int teavpn2_udp_client_epoll(struct cli_udp_state *state);
 extern int teavpn2_udp_client_io_uring(struct cli_udp_state *state);
+extern int cli_iou_run_event_loop(struct epl_thread *thread);
+
+/*
+ * Defined in udp_epoll.c, shared with the io_uring event loop.
+ */
+extern int cli_udp_init_threads(struct cli_udp_state *state);
+extern int cli_udp_run_threads(struct cli_udp_state *state);
+extern void cli_udp_destroy_threads(struct cli_udp_state *state);
+extern int cli_udp_handle_pkt(struct epl_thread *thread);
 extern int teavpn2_cli_udp_send_close_packet(struct cli_udp_state *state);
 
 
@@ -202,19 +331,4 @@ static inline size_t cli_pprep_auth(struct cli_pkt *cli_pkt, const char *user,
 }
 
 
-static __always_inline int get_unix_time(time_t *tm)
-{
-	int ret;
-	struct timeval tv;
-	ret = gettimeofday(&tv, NULL);
-	if (unlikely(ret)) {
-		ret = errno;
-		pr_err("gettimeofday(): " PRERF, PREAR(ret));
-		return -ret;
-	}
-	*tm = tv.tv_sec;
-	return ret;
-}
-
-
 #endif /* #ifndef TEAVPN2__CLIENT__LINUX__UDP_H */
@@ -118,12 +118,20 @@ static __cold int init_epoll_thread(struct cli_udp_state *state,
 {
 	int ret;
 
+	thread->epoll_timeout = 10000;
+
+	/*
+	 * The io_uring event loop only uses the packet
+	 * processing part of the thread.
+	 */
+	if (state->evt_loop == EVTL_IO_URING)
+		return 0;
+
 	ret = create_epoll_fd();
 	if (unlikely(ret < 0))
 		return ret;
 
 	thread->epoll_fd = ret;
-	thread->epoll_timeout = 10000;
 
 	ret = do_epoll_fd_registration(state, thread);
 	if (unlikely(ret))
@@ -155,6 +163,7 @@ static __cold int init_epoll_thread_array(struct cli_udp_state *state)
 		threads[i].idx = i;
 		threads[i].state = state;
 		threads[i].epoll_fd = -1;
+		threads[i].tun_fd = state->tun_fds[i];
 	}
 
 	for (i = 0; i < nn; i++) {
@@ -169,6 +178,35 @@ static __cold int init_epoll_thread_array(struct cli_udp_state *state)
 			return -errno;
 
 		threads[i].pkt = pkt;
+
+		pkt = al4096_malloc_mmap(TUN_READ_BURST * sizeof(*pkt));
+		if (unlikely(!pkt))
+			return -errno;
+
+		threads[i].tx_pkts = pkt;
+
+		if (state->udp_gro) {
+			char *buf = al4096_malloc_mmap(UDP_GRO_BUF_SIZE);
+			if (unlikely(!buf))
+				return -errno;
+
+			threads[i].rx_gro_buf = buf;
+		}
+
+		if (state->tun_offload) {
+			uint8_t *obuf;
+
+			obuf = al4096_malloc_mmap(TUN_OFFLOAD_BUF_SIZE);
+			if (unlikely(!obuf))
+				return -errno;
+			threads[i].tun_rx_buf = obuf;
+
+			obuf = al4096_malloc_mmap(TUN_OFFLOAD_BUF_SIZE);
+			if (unlikely(!obuf))
+				return -errno;
+			threads[i].tun_gro.buf = obuf;
+			tun_gro_reset(&threads[i].tun_gro);
+		}
 	}
 
 	return ret;
@@ -253,13 +291,64 @@ static __hot ssize_t recv_from_server(struct epl_thread *thread, int udp_fd)
 }
 
 
+static __hot int flush_tun_gro(struct epl_thread *thread)
+{
+	size_t len;
+	ssize_t write_ret;
+	struct tun_gro *gro = &thread->tun_gro;
+	int tun_fd = thread->tun_fd;
+
+	len = tun_gro_finish(gro);
+	if (len == 0)
+		return 0;
+
+	write_ret = __sys_write(tun_fd, gro->buf, len);
+	pr_debug("[thread=%hu] write(tun_fd=%d) %zd bytes (%hu segment(s))",
+		 thread->idx, tun_fd, write_ret, gro->nr_segs);
+
+	tun_gro_reset(gro);
+	return (write_ret < 0) ? (int) write_ret : 0;
+}
+
+
+/*
+ * With TUN offload, the packet is queued to @thread->tun_gro
+ * and written by flush_tun_gro() once the received datagram
+ * has been fully processed.
+ */
+static __hot int queue_tun_data(struct epl_thread *thread)
+{
+	int ret;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+	uint16_t data_len = ntohs(srv_pkt->len);
+
+	if (unlikely(!data_len ||
+		     (size_t)data_len + PKT_MIN_LEN > thread->pkt->len))
+		/* Empty or truncated, drop it. */
+		return 0;
+
+	if (tun_gro_add(&thread->tun_gro, srv_pkt->__raw, data_len))
+		return 0;
+
+	ret = flush_tun_gro(thread);
+	if (unlikely(ret))
+		return ret;
+
+	tun_gro_add(&thread->tun_gro, srv_pkt->__raw, data_len);
+	return 0;
+}
+
+
 static __hot int handle_tun_data(struct epl_thread *thread)
 {
 	uint16_t data_len;
 	ssize_t write_ret;
-	int tun_fd = thread->state->tun_fds[0];
+	int tun_fd = thread->tun_fd;
 	struct srv_pkt *srv_pkt = &thread->pkt->srv;
 
+	if (thread->state->tun_offload)
+		return queue_tun_data(thread);
+
 	data_len  = ntohs(srv_pkt->len);
 	write_ret = __sys_write(tun_fd, srv_pkt->__raw, data_len);
 	pr_debug("[thread=%hu] write(tun_fd=%d) %zd bytes", thread->idx, tun_fd,
@@ -297,7 +386,7 @@ static __hot int _handle_event_udp(struct epl_thread *thread,
 		ret = handle_req_sync(thread);
 		fallthrough;
 	case TSRV_PKT_SYNC:
-		get_unix_time(&thread->state->last_t);
+		thread->state->last_t = coarse_now();
 		return ret;
 	case TSRV_PKT_CLOSE:
 		state->stop = true;
@@ -309,44 +398,370 @@ static __hot int _handle_event_udp(struct epl_thread *thread,
 }
 
 
+/*
+ * Receive a possibly GRO coalesced datagram into @thread->rx_gro_buf,
+ * @seg is filled with the segment size (0 if not coalesced).
+ */
+static __hot ssize_t recv_gro_from_server(struct epl_thread *thread,
+					   int udp_fd, size_t *seg)
+{
+	ssize_t recv_ret;
+	struct msghdr hdr;
+	struct iovec iov;
+
+	iov.iov_base = thread->rx_gro_buf;
+	iov.iov_len  = UDP_GRO_BUF_SIZE;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov        = &iov;
+	hdr.msg_iovlen     = 1;
+	hdr.msg_control    = thread->rx_cmsg.buf;
+	hdr.msg_controllen = sizeof(thread->rx_cmsg.buf);
+
+	recv_ret = __sys_recvmsg(udp_fd, &hdr, 0);
+	pr_debug("[thread=%hu] recvmsg(udp_fd=%d) %zd bytes", thread->idx,
+		 udp_fd, recv_ret);
+	if (unlikely(recv_ret <= 0)) {
+
+		if (recv_ret == 0) {
+			pr_err("UDP socket disconnected!");
+			return -ENETDOWN;
+		}
+
+		if (recv_ret == -EAGAIN)
+			return 0;
+
+		pr_err("recvmsg(udp_fd) (fd=%d): " PRERF, udp_fd,
+		       PREAR((int)-recv_ret));
+		return recv_ret;
+	}
+
+	*seg = (size_t)udp_gro_seg_size(&hdr);
+	return recv_ret;
+}
+
+
+/*
+ * Split a GRO coalesced datagram back into the original packets
+ * and dispatch them one by one. Only the last segment can be
+ * shorter than the segment size.
+ */
+static __hot int handle_event_udp_gro(struct epl_thread *thread,
+				      struct cli_udp_state *state, int udp_fd)
+{
+	int ret = 0;
+	size_t len, off, seg = 0;
+	ssize_t recv_ret;
+	struct sc_pkt *pkt = thread->pkt;
+	const char *buf = thread->rx_gro_buf;
+
+	recv_ret = recv_gro_from_server(thread, udp_fd, &seg);
+	if (unlikely(recv_ret <= 0))
+		return (int)recv_ret;
+
+	len = (size_t)recv_ret;
+	if (seg == 0)
+		seg = len;
+
+	for (off = 0; off < len; off += seg) {
+		size_t cur = len - off;
+
+		if (cur > seg)
+			cur = seg;
+
+		/*
+		 * A valid TeaVPN2 packet always fits in @pkt,
+		 * truncate the garbage like recvfrom() would do.
+		 */
+		if (unlikely(cur > sizeof(pkt->cli.__raw)))
+			cur = sizeof(pkt->cli.__raw);
+
+		memcpy(pkt->__raw, &buf[off], cur);
+		pkt->len = cur;
+		ret = _handle_event_udp(thread, state);
+		if (unlikely(ret))
+			break;
+	}
+
+	if (state->tun_offload) {
+		int tmp = flush_tun_gro(thread);
+		if (!ret)
+			ret = tmp;
+	}
+
+	return ret;
+}
+
+
 static __hot int handle_event_udp(struct epl_thread *thread,
 				  struct cli_udp_state *state, int udp_fd)
 {
+	int ret;
 	ssize_t recv_ret;
 
+	if (thread->rx_gro_buf)
+		return handle_event_udp_gro(thread, state, udp_fd);
+
 	recv_ret = recv_from_server(thread, udp_fd);
 	if (unlikely(recv_ret <= 0))
 		return (int)recv_ret;
 
-	return _handle_event_udp(thread, state);
+	ret = _handle_event_udp(thread, state);
+	if (state->tun_offload) {
+		int tmp = flush_tun_gro(thread);
+		if (!ret)
+			ret = tmp;
+	}
+
+	return ret;
 }
 
 
+/*
+ * Build the sendmmsg() vector from the burst buffers in
+ * [@i, @nr). Returns the number of built messages.
+ */
+static __hot uint16_t tx_build_msgs(struct epl_thread *thread, uint16_t i,
+				    uint16_t nr)
+{
+	uint16_t n = 0;
+	const bool gso = thread->state->udp_gso && !thread->tx_no_gso;
+
+	while (i < nr) {
+		uint16_t cnt = 1;
+		struct msghdr *hdr = &thread->tx_msgs[n].msg_hdr;
+
+		if (gso)
+			cnt = udp_gso_count_segs(&thread->tx_iovs[i], nr - i);
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_iov    = &thread->tx_iovs[i];
+		hdr->msg_iovlen = cnt;
+
+		if (cnt > 1) {
+			uint16_t seg = (uint16_t)thread->tx_iovs[i].iov_len;
+			udp_gso_set_cmsg(hdr, &thread->tx_cmsg[n], seg);
+		}
+
+		i = (uint16_t)(i + cnt);
+		n++;
+	}
+
+	return n;
+}
+
+
+/*
+ * The kernel refused a GSO send. It may be one bad train (too
+ * many segments, odd size), so the batch is sent again without
+ * UDP_SEGMENT first. GSO is turned off only when it keeps
+ * failing.
+ */
+static __cold void udp_gso_fallback(struct epl_thread *thread, int err)
+{
+	struct cli_udp_state *state = thread->state;
+	uint32_t fails;
+
+	thread->tx_no_gso = true;
+	fails = atomic_fetch_add(&state->udp_gso_fails, 1u) + 1u;
+	pr_debug("[thread=%hu] UDP GSO send failed (%u in a row): " PRERF,
+		 thread->idx, fails, PREAR(-err));
+	if (fails < UDP_GSO_MAX_FAILS || !state->udp_gso)
+		return;
+
+	state->udp_gso = false;
+	pr_warn("[thread=%hu] UDP GSO send is rejected by the kernel: " PRERF,
+		thread->idx, PREAR(-err));
+	pr_warn("Disabling UDP GSO, falling back to plain sendmmsg()...");
+}
+
+
+/*
+ * A GSO send went through, the failures are not in a row
+ * anymore.
+ */
+static __hot void udp_gso_ok(struct epl_thread *thread,
+			     const struct mmsghdr *msgs, int nr)
+{
+	struct cli_udp_state *state = thread->state;
+	int i;
+
+	if (likely(!atomic_load_explicit(&state->udp_gso_fails,
+					 memory_order_relaxed)))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		if (udp_gso_msg_has_cmsg(&msgs[i].msg_hdr)) {
+			atomic_store(&state->udp_gso_fails, 0u);
+			return;
+		}
+	}
+}
+
+
+static __hot int send_tun_burst(struct epl_thread *thread, uint16_t nr)
+{
+	int ret;
+	uint16_t i = 0;
+	int udp_fd = thread->state->udp_fd;
+	struct mmsghdr *msgs = thread->tx_msgs;
+
+	while (i < nr) {
+		uint16_t j, n_msgs;
+
+		n_msgs = tx_build_msgs(thread, i, nr);
+		ret = __sys_sendmmsg(udp_fd, msgs, n_msgs, 0);
+		if (likely(ret > 0)) {
+			pr_debug("[thread=%hu] sendmmsg(udp_fd=%d) %d message(s)",
+				 thread->idx, udp_fd, ret);
+			udp_gso_ok(thread, msgs, ret);
+			for (j = 0; j < (uint16_t)ret; j++)
+				i = (uint16_t)(i + msgs[j].msg_hdr.msg_iovlen);
+			continue;
+		}
+
+		if ((ret == -EIO || ret == -EINVAL) &&
+		    udp_gso_msg_has_cmsg(&msgs[0].msg_hdr)) {
+			/*
+			 * The kernel (or the NIC) can't segment it.
+			 * Rebuild the rest without coalescing and
+			 * send again.
+			 */
+			udp_gso_fallback(thread, ret);
+			continue;
+		}
+
+		pr_err("sendmmsg(): " PRERF, PREAR(-ret));
+		thread->tx_no_gso = false;
+		return ret;
+	}
+
+	thread->tx_no_gso = false;
+	return 0;
+}
+
+
+/*
+ * TUN offload variant of handle_event_tun(). Each frame may be
+ * a TSO super-packet, it is segmented into @thread->tx_pkts.
+ * The burst is sent whenever we run out of @thread->tx_pkts.
+ */
+static __hot int handle_event_tun_offload(struct epl_thread *thread,
+					  int tun_fd)
+{
+	int ret = 0;
+	uint16_t n, nr = 0;
+
+	for (n = 0; n < TUN_READ_BURST; n++) {
+		ssize_t read_ret;
+		struct tun_gso_iter it;
+
+		read_ret = __sys_read(tun_fd, thread->tun_rx_buf,
+				      TUN_OFFLOAD_BUF_SIZE);
+		if (unlikely(read_ret < 0)) {
+
+			if (read_ret == -EAGAIN)
+				break;
+
+			pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
+			       PREAR((int)-read_ret));
+			ret = (int)read_ret;
+			break;
+		}
+
+		pr_debug("[thread=%hu] read(tun_fd=%d) %zd bytes", thread->idx,
+			 tun_fd, read_ret);
+
+		ret = tun_gso_init(&it, thread->tun_rx_buf, (size_t)read_ret);
+		if (unlikely(ret)) {
+			pr_debug("[thread=%hu] dropping bad TUN frame: " PRERF,
+				 thread->idx, PREAR(-ret));
+			ret = 0;
+			continue;
+		}
+
+		while (true) {
+			size_t send_len;
+			ssize_t seg_len;
+			struct cli_pkt *cli_pkt;
+
+			if (nr == TUN_READ_BURST) {
+				ret = send_tun_burst(thread, nr);
+				if (unlikely(ret))
+					return ret;
+				nr = 0;
+			}
+
+			cli_pkt = &thread->tx_pkts[nr].cli;
+			seg_len = tun_gso_next(&it, cli_pkt->__raw,
+					       sizeof(cli_pkt->__raw));
+			if (seg_len <= 0)
+				break;
+
+			send_len = cli_pprep(cli_pkt, TCLI_PKT_TUN_DATA,
+					     (uint16_t)seg_len, 0);
+			thread->tx_iovs[nr].iov_base = cli_pkt;
+			thread->tx_iovs[nr].iov_len  = send_len;
+			nr++;
+		}
+	}
+
+	if (nr > 0) {
+		int tmp = send_tun_burst(thread, nr);
+		if (!ret)
+			ret = tmp;
+	}
+
+	return ret;
+}
+
+
+/*
+ * Read a burst of up to TUN_READ_BURST packets from the TUN
+ * fd and send them to the server at once.
+ */
 static __hot int handle_event_tun(struct epl_thread *thread, int tun_fd)
 {
-	size_t send_len;
-	ssize_t read_ret;
-	ssize_t send_ret;
-	struct cli_pkt *cli_pkt = &thread->pkt->cli;
-	const size_t read_size = sizeof(thread->pkt->cli.__raw);
+	int ret = 0;
+	uint16_t nr;
 
-	read_ret = __sys_read(tun_fd, cli_pkt->__raw, read_size);
-	if (unlikely(read_ret < 0)) {
+	if (thread->state->tun_offload)
+		return handle_event_tun_offload(thread, tun_fd);
 
-		if (read_ret == -EAGAIN)
-			return 0;
+	for (nr = 0; nr < TUN_READ_BURST; nr++) {
+		size_t send_len;
+		ssize_t read_ret;
+		struct cli_pkt *cli_pkt = &thread->tx_pkts[nr].cli;
+		const size_t read_size = sizeof(cli_pkt->__raw);
 
-		pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
-		       PREAR((int)-read_ret));
-		return (int) read_ret;
+		read_ret = __sys_read(tun_fd, cli_pkt->__raw, read_size);
+		if (unlikely(read_ret < 0)) {
+
+			if (read_ret == -EAGAIN)
+				break;
+
+			pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
+			       PREAR((int)-read_ret));
+			ret = (int)read_ret;
+			break;
+		}
+
+		pr_debug("[thread=%hu] read(tun_fd=%d) %zd bytes", thread->idx,
+			 tun_fd, read_ret);
+
+		send_len = cli_pprep(cli_pkt, TCLI_PKT_TUN_DATA,
+				     (uint16_t)read_ret, 0);
+		thread->tx_iovs[nr].iov_base = cli_pkt;
+		thread->tx_iovs[nr].iov_len  = send_len;
 	}
 
-	pr_debug("[thread=%hu] read(tun_fd=%d) %zd bytes", thread->idx, tun_fd,
-		 read_ret);
+	if (nr > 0) {
+		int tmp = send_tun_burst(thread, nr);
+		if (!ret)
+			ret = tmp;
+	}
 
-	send_len = cli_pprep(cli_pkt, TCLI_PKT_TUN_DATA, (uint16_t)read_ret, 0);
-	send_ret = do_send_to(thread, cli_pkt, send_len);
-	return (send_ret < 0) ? (int) send_ret : 0;
+	return ret;
 }
 
 
@@ -363,7 +778,7 @@ static __hot int handle_event(struct epl_thread *thread,
 		ret = handle_event_tun(thread, fd);
 
 	if ((state->loop_c++ % UDP_LOOP_C_DEADLINE) == 0)
-		get_unix_time(&state->last_t);
+		state->last_t = coarse_now();
 
 	return ret;
 }
@@ -390,6 +805,7 @@ static __hot int _do_epoll_wait(struct epl_thread *thread)
 		return ret;
 	}
 
+	coarse_clock_update();
 	return ret;
 }
 
@@ -476,7 +892,13 @@ static __cold noinline void *client_udp_epoll_run_event_loop(void *thread_p)
 	thread_wait(thread, state);
 
 	while (likely(!state->stop)) {
-		ret = do_epoll_wait(thread, state);
+#ifdef CONFIG_IO_URING
+		if (state->evt_loop == EVTL_IO_URING)
+			ret = cli_iou_run_event_loop(thread);
+		else
+#endif
+			ret = do_epoll_wait(thread, state);
+
 		if (unlikely(ret)) {
 			state->stop = true;
 			break;
@@ -532,11 +954,11 @@ static __cold void tt_send_reqsync(struct cli_udp_state *state)
 static __cold void _run_timer_thread(struct cli_udp_state *state)
 {
 	int i = 0;
-	time_t time_diff = 0;
+	time_t time_diff;
 	const time_t max_diff = UDP_SESS_TIMEOUT;
 
-	get_unix_time(&time_diff);
-	time_diff -= state->last_t;
+	coarse_clock_update();
+	time_diff = coarse_now() - state->last_t;
 
 	if (time_diff > max_diff) {
 		prl_notice(2, "UDP timer timedout");
@@ -748,13 +1170,52 @@ static __cold void destroy_epoll(struct cli_udp_state *state)
 	threads = state->epl_threads;
 	if (threads) {
 		close_epoll_fds(threads, nn);
-		for (i = 0; i < nn; i++)
+		for (i = 0; i < nn; i++) {
 			al4096_free_munmap(threads[i].pkt, sizeof(*threads[i].pkt));
+			al4096_free_munmap(threads[i].tx_pkts, TUN_READ_BURST *
+					   sizeof(*threads[i].tx_pkts));
+			if (threads[i].rx_gro_buf)
+				al4096_free_munmap(threads[i].rx_gro_buf,
+						   UDP_GRO_BUF_SIZE);
+			if (threads[i].tun_rx_buf)
+				al4096_free_munmap(threads[i].tun_rx_buf,
+						   TUN_OFFLOAD_BUF_SIZE);
+			if (threads[i].tun_gro.buf)
+				al4096_free_munmap(threads[i].tun_gro.buf,
+						   TUN_OFFLOAD_BUF_SIZE);
+		}
 	}
 	al64_free(threads);
 }
 
 
+int cli_udp_handle_pkt(struct epl_thread *thread)
+{
+	return _handle_event_udp(thread, thread->state);
+}
+
+
+__cold int cli_udp_init_threads(struct cli_udp_state *state)
+{
+	return init_epoll_thread_array(state);
+}
+
+
+__cold int cli_udp_run_threads(struct cli_udp_state *state)
+{
+	state->stop = false;
+	coarse_clock_update();
+	state->last_t = coarse_now();
+	return run_event_loop(state);
+}
+
+
+__cold void cli_udp_destroy_threads(struct cli_udp_state *state)
+{
+	destroy_epoll(state);
+}
+
+
 int teavpn2_udp_client_epoll(struct cli_udp_state *state)
 {
 	int ret;
@@ -764,7 +1225,8 @@ int teavpn2_udp_client_epoll(struct cli_udp_state *state)
 		goto out;
 
 	state->stop = false;
-	get_unix_time(&state->last_t);
+	coarse_clock_update();
+	state->last_t = coarse_now();
 	ret = run_event_loop(state);
 out:
 	destroy_epoll(state);
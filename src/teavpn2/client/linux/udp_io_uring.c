@@ -0,0 +1,416 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <unistd.h>
+#include <teavpn2/client/common.h>
+#include <teavpn2/client/linux/udp.h>
+
+
+/*
+ * The operations of a slot. The SQE user_data is the slot
+ * index with the operation in the upper 32 bits.
+ */
+enum {
+	IOU_OP_RECV	= 1,	/* recv(UDP)   */
+	IOU_OP_WRITE	= 2,	/* write(TUN)  */
+	IOU_OP_READ	= 3,	/* read(TUN)   */
+	IOU_OP_SEND	= 4,	/* send(UDP)   */
+};
+
+#define IOU_UD(OP, I)	(((uint64_t)(OP) << 32u) | (uint64_t)(I))
+#define IOU_UD_OP(UD)	((uint8_t)((UD) >> 32u))
+#define IOU_UD_IDX(UD)	((uint16_t)(UD))
+
+
+/*
+ * The fds serviced by a thread are the same as the epoll
+ * event loop ones, see do_epoll_fd_registration() in
+ * udp_epoll.c.
+ */
+static __cold uint8_t iou_get_tun_fds(struct cli_udp_state *state,
+				      uint16_t idx, int fds[2])
+{
+	uint8_t nn = state->cfg->sys.thread_num;
+
+	if (idx == 0) {
+		if (nn == 1) {
+			fds[0] = state->tun_fds[0];
+			return 1;
+		}
+		return 0;
+	}
+
+	fds[0] = state->tun_fds[idx];
+	if (idx == 1) {
+		fds[1] = state->tun_fds[0];
+		return 2;
+	}
+	return 1;
+}
+
+
+static __hot struct io_uring_sqe *iou_get_sqe(struct iou_thread *iou)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&iou->ring);
+	if (unlikely(!sqe)) {
+		/*
+		 * The SQ ring has room for two SQEs per slot, this
+		 * should never happen.
+		 */
+		pr_err("[thread=%hu] io_uring SQ ring is full",
+		       iou->thread->idx);
+	}
+	return sqe;
+}
+
+
+/*
+ * Arm the read side of slot @i: recv() from the server or
+ * read() from the TUN fd.
+ */
+static __hot int iou_arm_read(struct iou_thread *iou, uint16_t i)
+{
+	struct io_uring_sqe *sqe;
+	struct iou_slot *slot = &iou->slots[i];
+	struct sc_pkt *pkt = &iou->bufs[i];
+
+	sqe = iou_get_sqe(iou);
+	if (unlikely(!sqe))
+		return -EAGAIN;
+
+	if (slot->is_rx) {
+		io_uring_prep_recv(sqe, slot->fd, pkt->__raw,
+				   sizeof(pkt->cli.__raw), 0);
+		sqe->user_data = IOU_UD(IOU_OP_RECV, i);
+	} else {
+		io_uring_prep_read(sqe, slot->fd, pkt->cli.__raw,
+				   sizeof(pkt->cli.__raw), 0);
+		sqe->user_data = IOU_UD(IOU_OP_READ, i);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write the packet of slot @i to the other side and read
+ * the next packet into the same buffer once the write is
+ * done. The two SQEs are linked, so the buffer is never
+ * overwritten while it is still being written.
+ */
+static __hot int iou_arm_chain(struct iou_thread *iou, uint16_t i,
+			       const void *buf, unsigned len)
+{
+	struct io_uring_sqe *sqe;
+	struct iou_slot *slot = &iou->slots[i];
+	struct cli_udp_state *state = iou->state;
+
+	sqe = iou_get_sqe(iou);
+	if (unlikely(!sqe))
+		return -EAGAIN;
+
+	if (slot->is_rx) {
+		io_uring_prep_write(sqe, iou->thread->tun_fd, buf, len, 0);
+		sqe->user_data = IOU_UD(IOU_OP_WRITE, i);
+	} else {
+		io_uring_prep_send(sqe, state->udp_fd, buf, len, 0);
+		sqe->user_data = IOU_UD(IOU_OP_SEND, i);
+	}
+
+	sqe->flags |= IOSQE_IO_LINK;
+	return iou_arm_read(iou, i);
+}
+
+
+static __cold int init_iou_thread(struct cli_udp_state *state,
+				  struct iou_thread *iou,
+				  struct epl_thread *thread)
+{
+	int ret;
+	int tun_fds[2];
+	uint8_t j, nr_tun;
+	uint16_t i, k, n;
+	unsigned entries = 32;
+
+	iou->state  = state;
+	iou->thread = thread;
+
+	nr_tun = iou_get_tun_fds(state, thread->idx, tun_fds);
+	n = (uint16_t)(IOU_INFLIGHT * nr_tun);
+	if (thread->idx == 0)
+		n = (uint16_t)(n + IOU_INFLIGHT);
+
+	iou->nr_slots = n;
+	iou->bufs = al4096_malloc_mmap((size_t)n * sizeof(*iou->bufs));
+	if (unlikely(!iou->bufs))
+		return -errno;
+
+	iou->slots = calloc_wrp((size_t)n, sizeof(*iou->slots));
+	if (unlikely(!iou->slots))
+		return -errno;
+
+	i = 0;
+	if (thread->idx == 0) {
+		for (k = 0; k < IOU_INFLIGHT; k++) {
+			iou->slots[i].fd    = state->udp_fd;
+			iou->slots[i].is_rx = true;
+			i++;
+		}
+	}
+
+	for (j = 0; j < nr_tun; j++) {
+		for (k = 0; k < IOU_INFLIGHT; k++) {
+			iou->slots[i].fd    = tun_fds[j];
+			iou->slots[i].is_rx = false;
+			i++;
+		}
+	}
+
+	while (entries < 2u * n)
+		entries <<= 1u;
+
+	ret = io_uring_queue_init(entries, &iou->ring, 0);
+	if (unlikely(ret)) {
+		pr_err("io_uring_queue_init(): " PRERF, PREAR(-ret));
+		return ret;
+	}
+	iou->ring_init = true;
+
+	for (i = 0; i < n; i++) {
+		ret = iou_arm_read(iou, i);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	prl_notice(4, "[thread=%hu] io_uring is ready with %hu slot(s)",
+		   thread->idx, n);
+	return 0;
+}
+
+
+static __cold int init_iou_thread_array(struct cli_udp_state *state)
+{
+	int ret;
+	struct iou_thread *iou;
+	uint8_t i, nn = state->cfg->sys.thread_num;
+
+	iou = calloc_wrp((size_t)nn, sizeof(*iou));
+	if (unlikely(!iou))
+		return -errno;
+
+	state->iou_threads = iou;
+	for (i = 0; i < nn; i++) {
+		ret = init_iou_thread(state, &iou[i], &state->epl_threads[i]);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
+
+
+static __hot int iou_handle_recv(struct iou_thread *iou, uint16_t i, int res)
+{
+	int ret;
+	uint16_t data_len;
+	struct sc_pkt *pkt = &iou->bufs[i];
+	struct srv_pkt *srv_pkt = &pkt->srv;
+	struct epl_thread *thread = iou->thread;
+
+	if (unlikely(res <= 0)) {
+
+		if (res == 0) {
+			pr_err("UDP socket disconnected!");
+			return -ENETDOWN;
+		}
+
+		if (res == -EAGAIN || res == -EINTR || res == -ECANCELED)
+			return iou_arm_read(iou, i);
+
+		pr_err("recv(udp_fd) (fd=%d): " PRERF, iou->slots[i].fd,
+		       PREAR(-res));
+		return res;
+	}
+
+	pr_debug("[thread=%hu] recv(udp_fd=%d) %d bytes", thread->idx,
+		 iou->slots[i].fd, res);
+
+	pkt->len = (size_t)res;
+	if (srv_pkt->type != TSRV_PKT_TUN_DATA) {
+		struct sc_pkt *tmp = thread->pkt;
+
+		thread->pkt = pkt;
+		ret = cli_udp_handle_pkt(thread);
+		thread->pkt = tmp;
+		if (unlikely(ret))
+			return ret;
+
+		return iou_arm_read(iou, i);
+	}
+
+	data_len = ntohs(srv_pkt->len);
+	if (unlikely(!data_len || (size_t)data_len + PKT_MIN_LEN > pkt->len))
+		/* Empty or truncated, drop it. */
+		return iou_arm_read(iou, i);
+
+	return iou_arm_chain(iou, i, srv_pkt->__raw, data_len);
+}
+
+
+static __hot int iou_handle_read(struct iou_thread *iou, uint16_t i, int res)
+{
+	size_t send_len;
+	struct cli_pkt *cli_pkt = &iou->bufs[i].cli;
+
+	if (unlikely(res <= 0)) {
+
+		if (res == 0 || res == -EAGAIN || res == -EINTR ||
+		    res == -ECANCELED)
+			return iou_arm_read(iou, i);
+
+		pr_err("read(tun_fd) (fd=%d): " PRERF, iou->slots[i].fd,
+		       PREAR(-res));
+		return res;
+	}
+
+	pr_debug("[thread=%hu] read(tun_fd=%d) %d bytes", iou->thread->idx,
+		 iou->slots[i].fd, res);
+
+	send_len = cli_pprep(cli_pkt, TCLI_PKT_TUN_DATA, (uint16_t)res, 0);
+	return iou_arm_chain(iou, i, cli_pkt, (unsigned)send_len);
+}
+
+
+static __hot int iou_handle_cqe(struct iou_thread *iou,
+				struct io_uring_cqe *cqe)
+{
+	int res = cqe->res;
+	uint16_t i = IOU_UD_IDX(cqe->user_data);
+
+	switch (IOU_UD_OP(cqe->user_data)) {
+	case IOU_OP_RECV:
+		return iou_handle_recv(iou, i, res);
+	case IOU_OP_READ:
+		return iou_handle_read(iou, i, res);
+	case IOU_OP_WRITE:
+		/*
+		 * A failed write or send only loses this packet. The
+		 * linked read is completed with -ECANCELED, and
+		 * iou_handle_recv() or iou_handle_read() arms it
+		 * again, so don't stop the loop here.
+		 */
+		if (unlikely(res < 0))
+			pr_err("write(tun_fd): " PRERF, PREAR(-res));
+		return 0;
+	case IOU_OP_SEND:
+		if (unlikely(res < 0))
+			pr_err("send(udp_fd): " PRERF, PREAR(-res));
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+
+__hot int cli_iou_run_event_loop(struct epl_thread *thread)
+{
+	int ret;
+	unsigned head, n = 0;
+	struct io_uring_cqe *cqe;
+	struct cli_udp_state *state = thread->state;
+	struct iou_thread *iou = &state->iou_threads[thread->idx];
+	struct __kernel_timespec ts = {
+		.tv_sec  = thread->epoll_timeout / 1000,
+		.tv_nsec = 0
+	};
+
+	ret = io_uring_submit(&iou->ring);
+	if (unlikely(ret < 0)) {
+		if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY)
+			return 0;
+
+		pr_err("[thread=%hu] io_uring_submit(): " PRERF, thread->idx,
+		       PREAR(-ret));
+		return ret;
+	}
+
+	ret = io_uring_wait_cqe_timeout(&iou->ring, &cqe, &ts);
+	if (unlikely(ret)) {
+		if (ret == -ETIME || ret == -EAGAIN)
+			return 0;
+
+		if (ret == -EINTR) {
+			prl_notice(2, "[thread=%hu] Interrupted!", thread->idx);
+			return 0;
+		}
+
+		pr_err("[thread=%hu] io_uring_wait_cqe_timeout(): " PRERF,
+		       thread->idx, PREAR(-ret));
+		return ret;
+	}
+
+	coarse_clock_update();
+
+	ret = 0;
+	io_uring_for_each_cqe(&iou->ring, head, cqe) {
+		n++;
+		ret = iou_handle_cqe(iou, cqe);
+		if (unlikely(ret))
+			break;
+	}
+	io_uring_cq_advance(&iou->ring, n);
+
+	if ((state->loop_c++ % UDP_LOOP_C_DEADLINE) == 0)
+		state->last_t = coarse_now();
+
+	return ret;
+}
+
+
+static __cold void destroy_iou_thread_array(struct cli_udp_state *state)
+{
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct iou_thread *iou = state->iou_threads;
+
+	if (unlikely(!iou))
+		return;
+
+	for (i = 0; i < nn; i++) {
+		if (iou[i].ring_init)
+			io_uring_queue_exit(&iou[i].ring);
+
+		if (iou[i].bufs)
+			al4096_free_munmap(iou[i].bufs, (size_t)iou[i].nr_slots *
+					   sizeof(*iou[i].bufs));
+
+		al64_free(iou[i].slots);
+	}
+
+	al64_free(iou);
+	state->iou_threads = NULL;
+}
+
+
+int teavpn2_udp_client_io_uring(struct cli_udp_state *state)
+{
+	int ret;
+
+	ret = cli_udp_init_threads(state);
+	if (unlikely(ret))
+		goto out;
+
+	ret = init_iou_thread_array(state);
+	if (unlikely(ret))
+		goto out;
+
+	ret = cli_udp_run_threads(state);
+out:
+	cli_udp_destroy_threads(state);
+	if (!state->threads_wont_exit)
+		destroy_iou_thread_array(state);
+	return ret;
+}
@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <teavpn2/clock.h>
+
+_Atomic(time_t) __coarse_now;
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  Copyright (C) 2021  Ammar Faizi
+ */
+
+#ifndef TEAVPN2__CLOCK_H
+#define TEAVPN2__CLOCK_H
+
+#include <time.h>
+#include <stdatomic.h>
+#include <teavpn2/common.h>
+
+/*
+ * A process wide coarse clock in seconds, taken from
+ * CLOCK_MONOTONIC_COARSE, so it doesn't jump when the wall
+ * clock is stepped.
+ *
+ * The event loops refresh it once per iteration with
+ * coarse_clock_update(), the hot paths read it with
+ * coarse_now(), which is a plain load.
+ */
+extern _Atomic(time_t) __coarse_now;
+
+
+static __always_inline time_t coarse_now(void)
+{
+	return atomic_load_explicit(&__coarse_now, memory_order_relaxed);
+}
+
+
+static __always_inline void coarse_clock_update(void)
+{
+	struct timespec ts;
+
+	if (unlikely(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts)))
+		return;
+
+	/*
+	 * Only write when the second changes, so the threads
+	 * don't keep bouncing the cache line between them.
+	 */
+	if (coarse_now() != ts.tv_sec)
+		atomic_store_explicit(&__coarse_now, ts.tv_sec,
+				      memory_order_relaxed);
+}
+
+#endif /* #ifndef TEAVPN2__CLOCK_H */
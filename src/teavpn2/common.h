@@ -183,10 +183,26 @@ static_assert(sizeof(struct if_info) == 16 + (IPV4_L * 4) + sizeof(uint16_t),
 
 #endif  /* #ifdef TEAVPN_IPV6_SUPPORT */
 
+/*
+ * Client side subnets announced in the [route] section of the
+ * user file, routed to the client by the server.
+ */
+#define AUTH_MAX_ROUTES 16u
+
+struct auth_route {
+	uint32_t	addr;	/* Host byte order, host bits cleared. */
+	uint8_t		prefix;
+};
+
+struct auth_routes {
+	uint8_t			nr;
+	struct auth_route	arr[AUTH_MAX_ROUTES];
+};
+
 extern const char *data_dir;
 extern void show_version(void);
 extern bool teavpn2_auth(const char *username, const char *password,
-			 struct if_info *iff);
+			 struct if_info *iff, struct auth_routes *routes);
 
 static inline void *calloc_wrp(size_t nmemb, size_t size)
 {
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__IOU_COMPAT_H
+#define TEAVPN2__IOU_COMPAT_H
+
+#ifdef CONFIG_IO_URING
+
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <liburing.h>
+#include <teavpn2/common.h>
+
+/*
+ * The vendored liburing (2.1) predates provided buffer rings
+ * (Linux 5.19) and multishot recvmsg() (Linux 6.0). These are
+ * the uapi bits we need, prefixed so they won't clash with a
+ * newer liburing.
+ */
+#define IOU_REGISTER_PBUF_RING		22u
+#define IOU_UNREGISTER_PBUF_RING	23u
+#define IOU_RECV_MULTISHOT		(1U << 1)
+
+
+struct iou_buf {
+	uint64_t				addr;
+	uint32_t				len;
+	uint16_t				bid;
+	uint16_t				resv;
+};
+
+
+/*
+ * The ring tail overlaps the resv field of the first buffer.
+ */
+struct iou_buf_ring {
+	union {
+		struct {
+			uint64_t		resv1;
+			uint32_t		resv2;
+			uint16_t		resv3;
+			_Atomic(uint16_t)	tail;
+		};
+		struct iou_buf			bufs[0];
+	};
+};
+
+
+struct iou_buf_reg {
+	uint64_t				ring_addr;
+	uint32_t				ring_entries;
+	uint16_t				bgid;
+	uint16_t				flags;
+	uint64_t				resv[3];
+};
+
+
+/*
+ * Multishot recvmsg() puts this header at the start of the
+ * selected buffer, followed by the source address (msg_namelen
+ * bytes), the control data (msg_controllen bytes) and the
+ * payload.
+ */
+struct iou_recvmsg_out {
+	uint32_t				namelen;
+	uint32_t				controllen;
+	uint32_t				payloadlen;
+	uint32_t				flags;
+};
+
+
+static inline int iou_register_buf_ring(struct io_uring *ring,
+					struct iou_buf_ring *br,
+					uint32_t entries, uint16_t bgid)
+{
+	long ret;
+	struct iou_buf_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t)(uintptr_t)br;
+	reg.ring_entries = entries;
+	reg.bgid         = bgid;
+
+	ret = syscall(__NR_io_uring_register, ring->ring_fd,
+		      IOU_REGISTER_PBUF_RING, &reg, 1);
+	return (ret < 0) ? -errno : 0;
+}
+
+
+static inline void iou_buf_ring_add(struct iou_buf_ring *br, uint16_t mask,
+				    uint16_t idx, void *addr, uint32_t len,
+				    uint16_t bid)
+{
+	struct iou_buf *buf = &br->bufs[idx & mask];
+
+	buf->addr = (uint64_t)(uintptr_t)addr;
+	buf->len  = len;
+	buf->bid  = bid;
+}
+
+
+/*
+ * Make the buffers added up to @tail visible to the kernel.
+ */
+static inline void iou_buf_ring_advance(struct iou_buf_ring *br, uint16_t tail)
+{
+	atomic_store_explicit(&br->tail, tail, memory_order_release);
+}
+
+#endif /* #ifdef CONFIG_IO_URING */
+
+#endif /* #ifndef TEAVPN2__IOU_COMPAT_H */
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <string.h>
+#include <teavpn2/lpm.h>
+#include <teavpn2/allocator.h>
+
+#define LPM4_TBL16_NR		(1u << 16u)
+#define LPM4_GRP_NR		(1u << 8u)
+#define LPM4_MIN_RULES		64u
+
+
+static __always_inline uint32_t lpm4_mask(uint8_t len)
+{
+	return len ? ~0u << (32u - len) : 0u;
+}
+
+
+static __always_inline uint32_t lpm4_leaf(uint32_t val, uint8_t len)
+{
+	return ((uint32_t)len << LPM4_DEPTH_SHIFT) | (val + 1u);
+}
+
+
+static __always_inline uint8_t lpm4_depth(uint32_t e)
+{
+	return (uint8_t)(e >> LPM4_DEPTH_SHIFT);
+}
+
+
+static __always_inline uint32_t *lpm4_group(struct lpm4 *t, uint32_t e)
+{
+	return &t->groups[(size_t)(e & ~LPM4_GRP) << 8u];
+}
+
+
+static __always_inline void lpm4_store(uint32_t *e, uint32_t val)
+{
+	__atomic_store_n(e, val, __ATOMIC_RELEASE);
+}
+
+
+static __always_inline uint64_t lpm4_rule_key(uint32_t addr, uint8_t len)
+{
+	return ((uint64_t)addr << 8u) | (uint64_t)len;
+}
+
+
+static __always_inline uint32_t lpm4_rule_home(struct lpm4 *t, uint64_t key)
+{
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32u) & t->rules_mask;
+}
+
+
+/*
+ * Returns the rule slot of @key, or the empty slot it would be
+ * inserted at.
+ */
+static struct lpm4_rule *lpm4_rule_find(struct lpm4 *t, uint64_t key)
+{
+	uint32_t pos = lpm4_rule_home(t, key);
+
+	while (t->rules[pos].val && t->rules[pos].key != key)
+		pos = (pos + 1u) & t->rules_mask;
+
+	return &t->rules[pos];
+}
+
+
+static int lpm4_rules_grow(struct lpm4 *t)
+{
+	uint32_t i, old_nr = t->rules_mask + 1u;
+	struct lpm4_rule *old = t->rules, *rules;
+
+	rules = calloc_wrp((size_t)old_nr * 2u, sizeof(*rules));
+	if (unlikely(!rules))
+		return -errno;
+
+	t->rules      = rules;
+	t->rules_mask = old_nr * 2u - 1u;
+	for (i = 0; i < old_nr; i++) {
+		if (old[i].val)
+			*lpm4_rule_find(t, old[i].key) = old[i];
+	}
+
+	al64_free(old);
+	return 0;
+}
+
+
+/*
+ * Linear probing delete, pull the following entries back so
+ * that no probe sequence gets broken.
+ */
+static void lpm4_rule_remove(struct lpm4 *t, struct lpm4_rule *rule)
+{
+	uint32_t pos = (uint32_t)(rule - t->rules);
+	uint32_t next = pos;
+
+	while (true) {
+		uint32_t home;
+
+		next = (next + 1u) & t->rules_mask;
+		if (!t->rules[next].val)
+			break;
+
+		/*
+		 * Can the entry at @next move to @pos? Only if its
+		 * home is not in (@pos, @next].
+		 */
+		home = lpm4_rule_home(t, t->rules[next].key);
+		if (((next - home) & t->rules_mask) <
+		    ((next - pos) & t->rules_mask))
+			continue;
+
+		t->rules[pos] = t->rules[next];
+		pos = next;
+	}
+
+	t->rules[pos].val = 0;
+	t->nr_rules--;
+}
+
+
+/*
+ * Returns the entries covered by the prefix at the level it
+ * ends on, creating the groups on the way if @create is true.
+ * Returns NULL if we run out of groups.
+ */
+static uint32_t *lpm4_walk(struct lpm4 *t, uint32_t addr, uint8_t len,
+			   bool create, uint32_t *nr)
+{
+	uint8_t shift = 16;
+	uint32_t *tbl = t->tbl16;
+	uint32_t idx = addr >> 16u;
+
+	while (len > 32u - shift) {
+		uint32_t e = tbl[idx];
+
+		if (!(e & LPM4_GRP)) {
+			uint32_t i, *grp;
+
+			if (unlikely(!create || t->nr_groups == t->max_groups))
+				return NULL;
+
+			/*
+			 * The new group inherits the leaf it replaces,
+			 * it must be complete before it's visible.
+			 */
+			grp = &t->groups[(size_t)t->nr_groups << 8u];
+			for (i = 0; i < LPM4_GRP_NR; i++)
+				grp[i] = e;
+
+			e = LPM4_GRP | t->nr_groups++;
+			lpm4_store(&tbl[idx], e);
+		}
+
+		tbl    = lpm4_group(t, e);
+		shift -= 8u;
+		idx    = (addr >> shift) & 0xffu;
+	}
+
+	*nr = 1u << (32u - shift - len);
+	return &tbl[idx];
+}
+
+
+/*
+ * Overwrite the leaves that come from a prefix not longer
+ * than @len.
+ */
+static void lpm4_fill(struct lpm4 *t, uint32_t *tbl, uint32_t nr,
+		      uint32_t leaf, uint8_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		uint32_t e = tbl[i];
+
+		if (e & LPM4_GRP)
+			lpm4_fill(t, lpm4_group(t, e), LPM4_GRP_NR, leaf, len);
+		else if (lpm4_depth(e) <= len)
+			lpm4_store(&tbl[i], leaf);
+	}
+}
+
+
+/*
+ * Replace the leaves that come from the prefix of length @len
+ * with @leaf. Within the range of the prefix, those are exactly
+ * the leaves with depth @len.
+ */
+static void lpm4_unfill(struct lpm4 *t, uint32_t *tbl, uint32_t nr,
+			uint32_t leaf, uint8_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		uint32_t e = tbl[i];
+
+		if (e & LPM4_GRP)
+			lpm4_unfill(t, lpm4_group(t, e), LPM4_GRP_NR, leaf, len);
+		else if (e && lpm4_depth(e) == len)
+			lpm4_store(&tbl[i], leaf);
+	}
+}
+
+
+/*
+ * Add @addr/@len with the value @val. Returns -EEXIST if the
+ * prefix is already loaded, -ENOSPC if we run out of groups.
+ */
+int lpm4_add(struct lpm4 *t, uint32_t addr, uint8_t len, uint32_t val)
+{
+	int ret;
+	uint32_t nr, *tbl;
+	struct lpm4_rule *rule;
+
+	if (unlikely(len > 32u || val > LPM4_VAL_MAX))
+		return -EINVAL;
+
+	/*
+	 * Keep the rule table at most half full, so a probe
+	 * always ends on an empty slot.
+	 */
+	if ((t->nr_rules + 1u) * 2u > t->rules_mask + 1u) {
+		ret = lpm4_rules_grow(t);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	addr &= lpm4_mask(len);
+	rule = lpm4_rule_find(t, lpm4_rule_key(addr, len));
+	if (unlikely(rule->val))
+		return -EEXIST;
+
+	tbl = lpm4_walk(t, addr, len, true, &nr);
+	if (unlikely(!tbl))
+		return -ENOSPC;
+
+	lpm4_fill(t, tbl, nr, lpm4_leaf(val, len), len);
+	rule->key = lpm4_rule_key(addr, len);
+	rule->val = val + 1u;
+	t->nr_rules++;
+	return 0;
+}
+
+
+/*
+ * Delete @addr/@len, the addresses it covered fall back to the
+ * next shorter prefix covering it (if any).
+ */
+int lpm4_del(struct lpm4 *t, uint32_t addr, uint8_t len)
+{
+	uint8_t plen;
+	uint32_t nr, *tbl, leaf = 0;
+	struct lpm4_rule *rule;
+
+	if (unlikely(len > 32u))
+		return -EINVAL;
+
+	addr &= lpm4_mask(len);
+	rule = lpm4_rule_find(t, lpm4_rule_key(addr, len));
+	if (unlikely(!rule->val))
+		return -ENOENT;
+
+	for (plen = len; plen--;) {
+		struct lpm4_rule *p;
+
+		p = lpm4_rule_find(t, lpm4_rule_key(addr & lpm4_mask(plen),
+						    plen));
+		if (p->val) {
+			leaf = lpm4_leaf(p->val - 1u, plen);
+			break;
+		}
+	}
+
+	tbl = lpm4_walk(t, addr, len, false, &nr);
+	BUG_ON(!tbl);
+	lpm4_unfill(t, tbl, nr, leaf, len);
+	lpm4_rule_remove(t, rule);
+	return 0;
+}
+
+
+int lpm4_init(struct lpm4 *t, uint32_t max_groups)
+{
+	memset(t, 0, sizeof(*t));
+	t->max_groups = max_groups;
+	t->tbl16 = al4096_malloc_mmap(LPM4_TBL16_NR * sizeof(*t->tbl16));
+	if (unlikely(!t->tbl16))
+		goto out_err;
+
+	/*
+	 * Anonymous mapping, only the groups in use take memory.
+	 */
+	t->groups = al4096_malloc_mmap((size_t)max_groups * LPM4_GRP_NR *
+				       sizeof(*t->groups));
+	if (unlikely(!t->groups))
+		goto out_err;
+
+	t->rules = calloc_wrp(LPM4_MIN_RULES, sizeof(*t->rules));
+	if (unlikely(!t->rules))
+		goto out_err;
+
+	t->rules_mask = LPM4_MIN_RULES - 1u;
+	return 0;
+
+out_err:
+	lpm4_destroy(t);
+	return -ENOMEM;
+}
+
+
+void lpm4_destroy(struct lpm4 *t)
+{
+	al4096_free_munmap(t->tbl16, LPM4_TBL16_NR * sizeof(*t->tbl16));
+	al4096_free_munmap(t->groups, (size_t)t->max_groups * LPM4_GRP_NR *
+			   sizeof(*t->groups));
+	if (t->rules)
+		al64_free(t->rules);
+	memset(t, 0, sizeof(*t));
+}
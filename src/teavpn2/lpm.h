@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__LPM_H
+#define TEAVPN2__LPM_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <teavpn2/common.h>
+
+/*
+ * IPv4 longest prefix match table, DIR-16-8-8 style.
+ *
+ * @tbl16 is indexed by the top 16 bits of the address. An entry
+ * is either a leaf (the value and the prefix length it comes
+ * from) or points to a group of 256 entries for the next 8 bits.
+ * A lookup is at most three loads, no matter how many prefixes
+ * are loaded.
+ *
+ * Lookups don't take any lock. Every entry is a single 32-bit
+ * word, and a group is filled before it gets published. Groups
+ * are never freed while the table is alive, so a reader never
+ * walks into freed memory.
+ *
+ * lpm4_add() and lpm4_del() must be serialized by the caller.
+ */
+#define LPM4_GRP		(1u << 31u)
+#define LPM4_DEPTH_SHIFT	25u
+#define LPM4_VAL_MASK		((1u << LPM4_DEPTH_SHIFT) - 1u)
+
+/*
+ * The largest value that can be stored.
+ */
+#define LPM4_VAL_MAX		(LPM4_VAL_MASK - 1u)
+
+
+/*
+ * A prefix loaded in the table, to find the covering prefix
+ * when a prefix is deleted.
+ */
+struct lpm4_rule {
+	uint64_t				key;
+	uint32_t				val;
+};
+
+
+struct lpm4 {
+	uint32_t				*tbl16;
+	uint32_t				*groups;
+	uint32_t				nr_groups;
+	uint32_t				max_groups;
+
+	/*
+	 * Hash table of the loaded prefixes, only used by the
+	 * writer. @rules_mask + 1 is a power of two.
+	 */
+	struct lpm4_rule			*rules;
+	uint32_t				rules_mask;
+	uint32_t				nr_rules;
+};
+
+
+/*
+ * Returns the value of the longest prefix matching @addr (host
+ * byte order), or -ENOENT if no prefix matches.
+ */
+static __always_inline int32_t lpm4_lookup(const struct lpm4 *t,
+					   uint32_t addr)
+{
+	uint32_t e;
+
+	e = __atomic_load_n(&t->tbl16[addr >> 16u], __ATOMIC_ACQUIRE);
+	if (e & LPM4_GRP) {
+		size_t i = ((size_t)(e & ~LPM4_GRP) << 8u) | ((addr >> 8u) & 0xffu);
+
+		e = __atomic_load_n(&t->groups[i], __ATOMIC_ACQUIRE);
+		if (e & LPM4_GRP) {
+			i = ((size_t)(e & ~LPM4_GRP) << 8u) | (addr & 0xffu);
+			e = __atomic_load_n(&t->groups[i], __ATOMIC_ACQUIRE);
+		}
+	}
+
+	e &= LPM4_VAL_MASK;
+	if (!e)
+		return -ENOENT;
+
+	return (int32_t)(e - 1u);
+}
+
+
+extern int lpm4_init(struct lpm4 *t, uint32_t max_groups);
+extern void lpm4_destroy(struct lpm4 *t);
+extern int lpm4_add(struct lpm4 *t, uint32_t addr, uint8_t len, uint32_t val);
+extern int lpm4_del(struct lpm4 *t, uint32_t addr, uint8_t len);
+
+#endif /* #ifndef TEAVPN2__LPM_H */
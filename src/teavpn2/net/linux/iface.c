@@ -15,6 +15,7 @@
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include <teavpn2/common.h>
 #include <teavpn2/net/linux/iface.h>
@@ -172,6 +173,7 @@ __cold static noinline char *escapeshellarg(char *alloc, const char *str,
  *
  *        IFF_NO_PI - Do not provide packet information
  *        IFF_MULTI_QUEUE - Create a queue of multiqueue device
+ *        IFF_VNET_HDR - Prefix each frame with a virtio_net_hdr
  */
 __cold int tun_alloc(const char *dev, short flags)
 {
@@ -248,6 +250,32 @@ __cold int fd_set_nonblock(int fd)
 }
 
 
+/*
+ * Let the kernel hand us TSO super-packets and packets without
+ * checksum. The fd must have been created with IFF_VNET_HDR.
+ */
+__cold int tun_set_offload(int fd)
+{
+	int err;
+	int hdr_sz = (int)sizeof(struct virtio_net_hdr);
+	unsigned int offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+
+	if (unlikely(ioctl(fd, TUNSETVNETHDRSZ, &hdr_sz) < 0)) {
+		err = errno;
+		pr_err("ioctl(%d, TUNSETVNETHDRSZ, %d): " PRERF, fd, hdr_sz,
+		       PREAR(err));
+		return -err;
+	}
+
+	if (unlikely(ioctl(fd, TUNSETOFFLOAD, offload) < 0)) {
+		err = errno;
+		pr_err("ioctl(%d, TUNSETOFFLOAD, %#x): " PRERF, fd, offload,
+		       PREAR(err));
+		return -err;
+	}
+
+	return 0;
+}
 
 
 static __cold char *shell_exec(const char *cmd, char *buf, size_t buflen,
@@ -13,6 +13,7 @@
 
 extern int fd_set_nonblock(int fd);
 extern int tun_alloc(const char *dev, short flags);
+extern int tun_set_offload(int fd);
 extern bool teavpn_iface_up(struct if_info *iface);
 extern bool teavpn_iface_down(struct if_info *iface);
 
@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  TUN offload (IFF_VNET_HDR) helpers.
+ *
+ *  Segment the TSO super-packets read from the TUN fd into
+ *  tunnel-sized packets, and coalesce the TCP segments going
+ *  to the TUN fd into super-packets.
+ *
+ *  Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <teavpn2/net/linux/tun_offload.h>
+
+/*
+ * All header fields are accessed with byte offsets, the IP
+ * packet that follows the virtio_net_hdr is not aligned.
+ */
+#define IP4_TOT_LEN	2u
+#define IP4_ID		4u
+#define IP4_FRAG_OFF	6u
+#define IP4_TTL		8u
+#define IP4_PROTO	9u
+#define IP4_CHECK	10u
+#define IP4_ADDRS	12u
+#define IP6_PLEN	4u
+#define IP6_ADDRS	8u
+#define IP6_HDR_LEN	40u
+
+#define TCP_SEQ		4u
+#define TCP_ACK_SEQ	8u
+#define TCP_DOFF	12u
+#define TCP_FLAGS	13u
+#define TCP_WINDOW	14u
+#define TCP_CHECK	16u
+#define TCP_HDR_LEN	20u
+
+#define TCP_F_FIN	0x01u
+#define TCP_F_PSH	0x08u
+#define TCP_F_ACK	0x10u
+#define TCP_F_CWR	0x80u
+
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8u) | p[1]);
+}
+
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24u) | ((uint32_t)p[1] << 16u) |
+	       ((uint32_t)p[2] << 8u) | (uint32_t)p[3];
+}
+
+
+static inline void put_be16(uint8_t *p, uint16_t val)
+{
+	p[0] = (uint8_t)(val >> 8u);
+	p[1] = (uint8_t)val;
+}
+
+
+static inline void put_be32(uint8_t *p, uint32_t val)
+{
+	p[0] = (uint8_t)(val >> 24u);
+	p[1] = (uint8_t)(val >> 16u);
+	p[2] = (uint8_t)(val >> 8u);
+	p[3] = (uint8_t)val;
+}
+
+
+/*
+ * One's complement sum (RFC 1071). The words are summed in
+ * memory order, so the folded result can be stored back with
+ * memcpy() without byte swapping.
+ */
+static __hot uint64_t csum_partial(const void *buf, size_t len, uint64_t sum)
+{
+	const uint8_t *p = buf;
+
+	while (len >= 4) {
+		uint32_t w;
+
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+		p   += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		uint16_t w;
+
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+		p   += 2;
+		len -= 2;
+	}
+
+	if (len) {
+		uint16_t w = 0;
+
+		memcpy(&w, p, 1);
+		sum += w;
+	}
+
+	return sum;
+}
+
+
+static __hot uint16_t csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffffu) + (sum >> 32u);
+	sum = (sum & 0xffffffffu) + (sum >> 32u);
+	sum = (sum & 0xffffu) + (sum >> 16u);
+	sum = (sum & 0xffffu) + (sum >> 16u);
+	return (uint16_t)sum;
+}
+
+
+static __hot uint64_t tcp_pseudo_hdr_sum(const uint8_t *pkt, bool ipv6,
+					 size_t l4_len)
+{
+	uint64_t sum;
+
+	if (ipv6)
+		sum = csum_partial(&pkt[IP6_ADDRS], 32, 0);
+	else
+		sum = csum_partial(&pkt[IP4_ADDRS], 8, 0);
+
+	sum += htons(IPPROTO_TCP);
+	sum += htons((uint16_t)l4_len);
+	return sum;
+}
+
+
+static __hot void ip4_fix_csum(uint8_t *pkt)
+{
+	uint16_t csum;
+	size_t ihl = (pkt[0] & 0xfu) * 4u;
+
+	pkt[IP4_CHECK] = pkt[IP4_CHECK + 1] = 0;
+	csum = (uint16_t)~csum_fold(csum_partial(pkt, ihl, 0));
+	memcpy(&pkt[IP4_CHECK], &csum, sizeof(csum));
+}
+
+
+/*
+ * Complete a CHECKSUM_PARTIAL packet, the checksum field
+ * already contains the pseudo header sum.
+ */
+static __hot void csum_complete(uint8_t *pkt, size_t len, uint16_t start,
+				uint16_t offset)
+{
+	uint16_t csum;
+
+	csum = (uint16_t)~csum_fold(csum_partial(&pkt[start], len - start, 0));
+	if (csum == 0)
+		csum = 0xffffu;
+
+	memcpy(&pkt[start + offset], &csum, sizeof(csum));
+}
+
+
+/*
+ * @frame is a frame read from the TUN fd (virtio_net_hdr and
+ * the IP packet). It must stay valid until the iteration ends.
+ */
+__hot int tun_gso_init(struct tun_gso_iter *it, const void *frame, size_t len)
+{
+	size_t doff;
+	uint8_t ver;
+	struct virtio_net_hdr hdr;
+	const uint8_t *pkt = (const uint8_t *)frame + TUN_VNET_HDR_LEN;
+
+	if (unlikely(len <= TUN_VNET_HDR_LEN))
+		return -EINVAL;
+
+	memcpy(&hdr, frame, sizeof(hdr));
+	it->pkt       = pkt;
+	it->len       = len - TUN_VNET_HDR_LEN;
+	it->idx       = 0;
+	it->done      = false;
+	it->l4_off    = hdr.csum_start;
+	it->csum_off  = hdr.csum_offset;
+	it->gso_type  = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	it->need_csum = !!(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM);
+
+	if (it->need_csum &&
+	    ((size_t)it->l4_off + it->csum_off + 2u > it->len))
+		return -EINVAL;
+
+	if (it->gso_type == VIRTIO_NET_HDR_GSO_NONE)
+		return 0;
+
+	ver = pkt[0] >> 4u;
+	if (it->gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+		if (unlikely(ver != 4))
+			return -EINVAL;
+	} else if (it->gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+		if (unlikely(ver != 6 || it->l4_off < IP6_HDR_LEN))
+			return -EINVAL;
+	} else {
+		return -EOPNOTSUPP;
+	}
+
+	if (unlikely(!it->need_csum || hdr.gso_size == 0))
+		return -EINVAL;
+
+	if (unlikely((size_t)it->l4_off + TCP_HDR_LEN > it->len))
+		return -EINVAL;
+
+	doff = (pkt[it->l4_off + TCP_DOFF] >> 4u) * 4u;
+	if (unlikely(doff < TCP_HDR_LEN || it->l4_off + doff > it->len))
+		return -EINVAL;
+
+	it->hdr_len  = (uint16_t)(it->l4_off + doff);
+	it->gso_size = hdr.gso_size;
+	it->off      = it->hdr_len;
+	return 0;
+}
+
+
+/*
+ * Write the next packet to @dst (which has @size bytes).
+ *
+ * Returns the packet length, 0 if there are no more packets,
+ * or -EMSGSIZE if the packet doesn't fit in @dst.
+ */
+__hot ssize_t tun_gso_next(struct tun_gso_iter *it, void *dst, size_t size)
+{
+	bool last;
+	uint8_t flags;
+	uint16_t csum;
+	uint64_t sum;
+	uint8_t *d = dst, *th;
+	size_t payload, seg_len, l4 = it->l4_off;
+	const bool ipv6 = (it->gso_type == VIRTIO_NET_HDR_GSO_TCPV6);
+
+	if (it->done)
+		return 0;
+
+	if (it->gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (unlikely(it->len > size))
+			return -EMSGSIZE;
+
+		memcpy(d, it->pkt, it->len);
+		if (it->need_csum)
+			csum_complete(d, it->len, it->l4_off, it->csum_off);
+
+		it->done = true;
+		return (ssize_t)it->len;
+	}
+
+	payload = it->len - it->off;
+	if (payload > it->gso_size)
+		payload = it->gso_size;
+
+	seg_len = it->hdr_len + payload;
+	if (unlikely(seg_len > size))
+		return -EMSGSIZE;
+
+	memcpy(d, it->pkt, it->hdr_len);
+	memcpy(&d[it->hdr_len], &it->pkt[it->off], payload);
+	last = (it->off + payload == it->len);
+
+	if (ipv6) {
+		put_be16(&d[IP6_PLEN], (uint16_t)(seg_len - IP6_HDR_LEN));
+	} else {
+		put_be16(&d[IP4_TOT_LEN], (uint16_t)seg_len);
+		put_be16(&d[IP4_ID], (uint16_t)(get_be16(&it->pkt[IP4_ID]) +
+						 it->idx));
+		ip4_fix_csum(d);
+	}
+
+	th = &d[l4];
+	put_be32(&th[TCP_SEQ], get_be32(&it->pkt[l4 + TCP_SEQ]) +
+			       (uint32_t)(it->off - it->hdr_len));
+
+	/*
+	 * FIN and PSH only belong to the last segment, CWR only
+	 * belongs to the first one.
+	 */
+	flags = th[TCP_FLAGS];
+	if (!last)
+		flags &= (uint8_t)~(TCP_F_FIN | TCP_F_PSH);
+	if (it->idx)
+		flags &= (uint8_t)~TCP_F_CWR;
+	th[TCP_FLAGS] = flags;
+
+	th[TCP_CHECK] = th[TCP_CHECK + 1] = 0;
+	sum  = tcp_pseudo_hdr_sum(d, ipv6, seg_len - l4);
+	sum  = csum_partial(th, seg_len - l4, sum);
+	csum = (uint16_t)~csum_fold(sum);
+	memcpy(&th[TCP_CHECK], &csum, sizeof(csum));
+
+	it->off += payload;
+	it->idx++;
+	it->done = last;
+	return (ssize_t)seg_len;
+}
+
+
+/*
+ * Only plain IPv4 TCP data segments (ACK, optionally PSH, no IP
+ * options, not fragmented) are coalesced.
+ */
+static __hot bool tcp4_gro_candidate(const uint8_t *pkt, size_t len,
+				     uint16_t *hdr_len, uint16_t *payload)
+{
+	size_t doff;
+	uint8_t flags;
+	const uint8_t *th = &pkt[20];
+
+	if (len < 20u + TCP_HDR_LEN || (pkt[0] >> 4u) != 4)
+		return false;
+
+	if ((pkt[0] & 0xfu) != 5 || pkt[IP4_PROTO] != IPPROTO_TCP)
+		return false;
+
+	if ((get_be16(&pkt[IP4_FRAG_OFF]) & 0x3fffu) ||
+	    get_be16(&pkt[IP4_TOT_LEN]) != len)
+		return false;
+
+	doff = (th[TCP_DOFF] >> 4u) * 4u;
+	if (doff < TCP_HDR_LEN || 20u + doff >= len)
+		return false;
+
+	flags = th[TCP_FLAGS];
+	if ((flags & ~(TCP_F_ACK | TCP_F_PSH)) || !(flags & TCP_F_ACK))
+		return false;
+
+	*hdr_len = (uint16_t)(20u + doff);
+	*payload = (uint16_t)(len - *hdr_len);
+	return true;
+}
+
+
+/*
+ * Can @pkt be appended to the current super-packet @cur? Like
+ * the kernel's GRO, all header fields except the sequence
+ * number and PSH must be identical, including TCP options.
+ */
+static __hot bool tcp4_gro_match(const struct tun_gro *gro, const uint8_t *cur,
+				 const uint8_t *pkt, uint16_t hdr_len,
+				 uint16_t payload)
+{
+	const uint8_t *th = &pkt[20], *cth = &cur[20];
+
+	if (hdr_len != gro->hdr_len || payload > gro->gso_size)
+		return false;
+
+	if (gro->len + payload > 65535u)
+		return false;
+
+	if (cur[1] != pkt[1] || cur[IP4_TTL] != pkt[IP4_TTL] ||
+	    cur[IP4_FRAG_OFF] != pkt[IP4_FRAG_OFF])
+		return false;
+
+	/* Addresses and ports. */
+	if (memcmp(&cur[IP4_ADDRS], &pkt[IP4_ADDRS], 8) ||
+	    memcmp(cth, th, 4))
+		return false;
+
+	if (get_be32(&th[TCP_SEQ]) != gro->next_seq)
+		return false;
+
+	if (memcmp(&cth[TCP_ACK_SEQ], &th[TCP_ACK_SEQ], 4) ||
+	    cth[TCP_DOFF] != th[TCP_DOFF] ||
+	    memcmp(&cth[TCP_WINDOW], &th[TCP_WINDOW], 2) ||
+	    ((cth[TCP_FLAGS] ^ th[TCP_FLAGS]) & ~TCP_F_PSH))
+		return false;
+
+	return !memcmp(&cth[TCP_HDR_LEN], &th[TCP_HDR_LEN],
+		       hdr_len - 20u - TCP_HDR_LEN);
+}
+
+
+/*
+ * Queue @pkt (an IP packet) to be written to the TUN fd.
+ *
+ * Returns true if @pkt has been queued. Returns false if it
+ * can't be coalesced with the queued packet, the caller must
+ * then write out the queued packet (see tun_gro_finish()),
+ * reset @gro and call this again. Queuing to an empty @gro
+ * always succeeds.
+ */
+__hot bool tun_gro_add(struct tun_gro *gro, const void *pkt, size_t len)
+{
+	uint16_t hdr_len, payload;
+	const uint8_t *p = pkt;
+	uint8_t *cur = &gro->buf[TUN_VNET_HDR_LEN];
+
+	if (tun_gro_empty(gro)) {
+		memcpy(cur, p, len);
+		gro->len       = len;
+		gro->nr_segs   = 1;
+		gro->can_merge = tcp4_gro_candidate(p, len, &hdr_len, &payload);
+		if (gro->can_merge) {
+			gro->hdr_len  = hdr_len;
+			gro->gso_size = payload;
+			gro->next_seq = get_be32(&p[20 + TCP_SEQ]) + payload;
+			if (p[20 + TCP_FLAGS] & TCP_F_PSH)
+				gro->can_merge = false;
+		}
+		return true;
+	}
+
+	if (!gro->can_merge)
+		return false;
+
+	if (!tcp4_gro_candidate(p, len, &hdr_len, &payload))
+		return false;
+
+	if (!tcp4_gro_match(gro, cur, p, hdr_len, payload))
+		return false;
+
+	memcpy(&cur[gro->len], &p[hdr_len], payload);
+	gro->len      += payload;
+	gro->next_seq += payload;
+	gro->nr_segs++;
+
+	/*
+	 * A short segment or PSH terminates the train.
+	 */
+	if (payload < gro->gso_size || (p[20 + TCP_FLAGS] & TCP_F_PSH)) {
+		cur[20 + TCP_FLAGS] |= p[20 + TCP_FLAGS] & TCP_F_PSH;
+		gro->can_merge = false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Fill the virtio_net_hdr and fix up the headers of the
+ * queued packet. Returns the number of bytes to write from
+ * @gro->buf, or 0 if nothing is queued.
+ */
+__hot size_t tun_gro_finish(struct tun_gro *gro)
+{
+	struct virtio_net_hdr hdr;
+	uint8_t *pkt = &gro->buf[TUN_VNET_HDR_LEN];
+
+	if (tun_gro_empty(gro))
+		return 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (gro->nr_segs > 1) {
+		uint16_t csum;
+
+		hdr.flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr.gso_type    = VIRTIO_NET_HDR_GSO_TCPV4;
+		hdr.hdr_len     = gro->hdr_len;
+		hdr.gso_size    = gro->gso_size;
+		hdr.csum_start  = 20;
+		hdr.csum_offset = TCP_CHECK;
+
+		put_be16(&pkt[IP4_TOT_LEN], (uint16_t)gro->len);
+		ip4_fix_csum(pkt);
+
+		/*
+		 * CHECKSUM_PARTIAL, the kernel expects the pseudo
+		 * header sum in the TCP checksum field.
+		 */
+		csum = csum_fold(tcp_pseudo_hdr_sum(pkt, false, gro->len - 20));
+		memcpy(&pkt[20 + TCP_CHECK], &csum, sizeof(csum));
+	}
+
+	memcpy(gro->buf, &hdr, sizeof(hdr));
+	return TUN_VNET_HDR_LEN + gro->len;
+}
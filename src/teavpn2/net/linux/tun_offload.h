@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  TUN offload (IFF_VNET_HDR) helpers.
+ *
+ *  Copyright (C) 2021  Ammar Faizi
+ */
+
+#ifndef TEAVPN2__NET__LINUX__TUN_OFFLOAD_H
+#define TEAVPN2__NET__LINUX__TUN_OFFLOAD_H
+
+#include <sys/types.h>
+#include <linux/virtio_net.h>
+#include <teavpn2/common.h>
+
+/*
+ * With IFF_VNET_HDR, every frame read from or written to the
+ * TUN fd is prefixed with a struct virtio_net_hdr.
+ */
+#define TUN_VNET_HDR_LEN	sizeof(struct virtio_net_hdr)
+
+/*
+ * Enough to hold the biggest TSO super-packet (the IP total
+ * length field is 16 bits).
+ */
+#define TUN_OFFLOAD_BUF_SIZE	(TUN_VNET_HDR_LEN + 65535u)
+
+
+/*
+ * Iterator to split a frame read from the TUN fd into
+ * tunnel-sized IP packets.
+ */
+struct tun_gso_iter {
+	const uint8_t		*pkt;
+	size_t			len;
+	size_t			off;
+	uint16_t		l4_off;
+	uint16_t		hdr_len;
+	uint16_t		gso_size;
+	uint16_t		csum_off;
+	uint16_t		idx;
+	uint8_t			gso_type;
+	bool			need_csum;
+	bool			done;
+};
+
+
+/*
+ * Coalescing buffer for the TCP segments that are going to
+ * be written to the TUN fd. @buf holds the virtio_net_hdr
+ * followed by the coalesced IP packet, @len is the length
+ * of the IP packet.
+ */
+struct tun_gro {
+	uint8_t			*buf;
+	size_t			len;
+	uint32_t		next_seq;
+	uint16_t		hdr_len;
+	uint16_t		gso_size;
+	uint16_t		nr_segs;
+	bool			can_merge;
+};
+
+
+extern int tun_gso_init(struct tun_gso_iter *it, const void *frame,
+			size_t len);
+extern ssize_t tun_gso_next(struct tun_gso_iter *it, void *dst, size_t size);
+extern bool tun_gro_add(struct tun_gro *gro, const void *pkt, size_t len);
+extern size_t tun_gro_finish(struct tun_gro *gro);
+
+
+static inline void tun_gro_reset(struct tun_gro *gro)
+{
+	gro->len = 0;
+}
+
+
+static inline bool tun_gro_empty(const struct tun_gro *gro)
+{
+	return gro->len == 0;
+}
+
+#endif /* #ifndef TEAVPN2__NET__LINUX__TUN_OFFLOAD_H */
@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  UDP segmentation and receive offload helpers.
+ *
+ *  Copyright (C) 2021  Ammar Faizi
+ */
+
+#ifndef TEAVPN2__NET__LINUX__UDP_OFFLOAD_H
+#define TEAVPN2__NET__LINUX__UDP_OFFLOAD_H
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <teavpn2/common.h>
+
+#ifndef SOL_UDP
+#  define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#  define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#  define UDP_GRO 104
+#endif
+
+/*
+ * The kernel refuses to split a single send into more than
+ * this number of datagrams.
+ */
+#define UDP_GSO_MAX_SEGS	64u
+
+/*
+ * Maximum UDP payload length over IPv4.
+ */
+#define UDP_GSO_MAX_BYTES	65507u
+
+/*
+ * A GSO send that fails is retried without UDP_SEGMENT, GSO is
+ * only turned off after this many failures in a row.
+ */
+#define UDP_GSO_MAX_FAILS	8u
+
+
+union udp_gso_cmsg {
+	char			buf[CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr		__align;
+};
+
+
+/*
+ * Old kernels don't know UDP_SEGMENT and return ENOPROTOOPT.
+ */
+static inline bool udp_gso_supported(int udp_fd)
+{
+	int val = 0;
+	socklen_t len = sizeof(val);
+
+	return getsockopt(udp_fd, SOL_UDP, UDP_SEGMENT, &val, &len) == 0;
+}
+
+
+static inline void udp_gso_set_cmsg(struct msghdr *hdr, union udp_gso_cmsg *cm,
+				    uint16_t gso_size)
+{
+	struct cmsghdr *cmsg;
+
+	hdr->msg_control    = cm->buf;
+	hdr->msg_controllen = sizeof(cm->buf);
+
+	cmsg = CMSG_FIRSTHDR(hdr);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type  = UDP_SEGMENT;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(gso_size));
+	memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+}
+
+
+static inline bool udp_gso_msg_has_cmsg(const struct msghdr *hdr)
+{
+	return hdr->msg_control != NULL;
+}
+
+
+/*
+ * Count how many buffers from @iov (which has @nr elements)
+ * can be sent as a single GSO datagram train. The kernel
+ * splits the payload every @iov[0].iov_len bytes, so all
+ * buffers except the last one must be exactly that long,
+ * the last one may be shorter.
+ *
+ * Always returns at least 1 when @nr > 0.
+ */
+static inline uint16_t udp_gso_count_segs(const struct iovec *iov, uint16_t nr)
+{
+	uint16_t i;
+	size_t seg = iov[0].iov_len, total = seg;
+
+	if (nr > UDP_GSO_MAX_SEGS)
+		nr = UDP_GSO_MAX_SEGS;
+
+	for (i = 1; i < nr; i++) {
+		size_t len = iov[i].iov_len;
+
+		if (len > seg || total + len > UDP_GSO_MAX_BYTES)
+			break;
+
+		total += len;
+		if (len < seg) {
+			/* A shorter buffer terminates the train. */
+			i++;
+			break;
+		}
+	}
+
+	return i;
+}
+
+
+/*
+ * Receive buffer size for a coalesced (GRO) datagram.
+ */
+#define UDP_GRO_BUF_SIZE	65536u
+
+
+union udp_gro_cmsg {
+	char			buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr		__align;
+};
+
+
+static inline int udp_gro_enable(int udp_fd)
+{
+	int y = 1;
+
+	if (setsockopt(udp_fd, SOL_UDP, UDP_GRO, &y, sizeof(y)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+
+/*
+ * Get the segment size of a coalesced datagram from the
+ * UDP_GRO cmsg. Returns 0 if the datagram is not coalesced.
+ */
+static inline uint16_t udp_gro_seg_size(struct msghdr *hdr)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		int seg;
+
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+
+		memcpy(&seg, CMSG_DATA(cmsg), sizeof(seg));
+		return (seg > 0) ? (uint16_t)seg : 0;
+	}
+
+	return 0;
+}
+
+#endif /* #ifndef TEAVPN2__NET__LINUX__UDP_OFFLOAD_H */
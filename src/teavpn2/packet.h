@@ -135,8 +135,15 @@ OFFSET_ASSERT(struct cli_pkt, __raw, 4);
 SIZE_ASSERT(struct cli_pkt, 2 + 1 + 1 + 4096);
 
 
+/*
+ * Room right in front of the wire bytes, so a header (e.g. a
+ * crypto nonce) can be prepended without moving the payload.
+ */
+#define PKT_HEADROOM	24u
+
 struct sc_pkt {
 	size_t					len;
+	uint8_t					headroom[PKT_HEADROOM];
 	union {
 		struct cli_pkt			cli;
 		struct srv_pkt			srv;
@@ -150,4 +157,8 @@ struct sc_pkt {
 static_assert(sizeof(struct cli_pkt) == sizeof(struct srv_pkt),
 	      "Fail to assert sizeof(struct cli_pkt) == sizeof(struct srv_pkt)");
 
+static_assert(offsetof(struct sc_pkt, __raw) ==
+	      offsetof(struct sc_pkt, headroom) + PKT_HEADROOM,
+	      "Fail to assert the headroom is right before __raw");
+
 #endif /* #ifndef TEAVPN2__PACKET_H */
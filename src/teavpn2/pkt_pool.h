@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+#ifndef TEAVPN2__PKT_POOL_H
+#define TEAVPN2__PKT_POOL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+#include <teavpn2/common.h>
+#include <teavpn2/packet.h>
+
+/*
+ * Room reserved behind every packet, so a tag can be appended
+ * to a full sized payload. The headroom is struct sc_pkt's own
+ * (see PKT_HEADROOM), it sits right before the wire bytes.
+ */
+#define PKT_POOL_TAILROOM	32u
+
+
+struct pkt_pool;
+
+
+struct pkt_buf {
+	/*
+	 * Free list link while the buffer is in the pool. The
+	 * holder may use it to queue the buffer elsewhere.
+	 */
+	struct pkt_buf				*next;
+
+	/*
+	 * The pool this buffer must be returned to.
+	 */
+	struct pkt_pool				*pool;
+
+	/*
+	 * Destination of a queued packet. It's a copy, the
+	 * session it was queued for may be gone by the time
+	 * the packet is written.
+	 */
+	struct sockaddr_in			dst;
+
+	struct sc_pkt				pkt;
+	uint8_t					tailroom[PKT_POOL_TAILROOM];
+};
+
+
+/*
+ * A fixed size pool of packet buffers owned by one thread.
+ *
+ * pkt_pool_get() and pkt_pool_put() are O(1) and must only be
+ * called by the owner thread. Other threads return the buffers
+ * with pkt_pool_put_remote(), the owner takes them back in one
+ * go when its local free list runs dry.
+ */
+struct pkt_pool {
+	struct pkt_buf				*free;
+	uint32_t				nr_free;
+	uint32_t				nr;
+
+	/*
+	 * Buffers returned by the other threads. Only the owner
+	 * detaches the list (all at once), so there is no ABA.
+	 */
+	_Atomic(struct pkt_buf *)		remote;
+
+	struct pkt_buf				*bufs;
+};
+
+
+static inline struct pkt_buf *pkt_to_buf(struct sc_pkt *pkt)
+{
+	return (struct pkt_buf *)((char *)pkt - offsetof(struct pkt_buf, pkt));
+}
+
+
+static inline void pkt_pool_put(struct pkt_pool *pool, struct sc_pkt *pkt)
+{
+	struct pkt_buf *buf = pkt_to_buf(pkt);
+
+	buf->next  = pool->free;
+	pool->free = buf;
+	pool->nr_free++;
+}
+
+
+/*
+ * Return @pkt to its owner pool from any thread.
+ */
+static inline void pkt_pool_put_remote(struct sc_pkt *pkt)
+{
+	struct pkt_buf *buf = pkt_to_buf(pkt);
+	struct pkt_pool *pool = buf->pool;
+	struct pkt_buf *head = atomic_load_explicit(&pool->remote,
+						    memory_order_relaxed);
+
+	do {
+		buf->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&pool->remote, &head,
+							buf,
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+
+static inline void pkt_pool_reclaim(struct pkt_pool *pool)
+{
+	struct pkt_buf *buf;
+
+	buf = atomic_exchange_explicit(&pool->remote, NULL,
+				       memory_order_acquire);
+	while (buf) {
+		struct pkt_buf *next = buf->next;
+
+		buf->next  = pool->free;
+		pool->free = buf;
+		pool->nr_free++;
+		buf = next;
+	}
+}
+
+
+/*
+ * Returns NULL if the pool is exhausted.
+ */
+static inline struct sc_pkt *pkt_pool_get(struct pkt_pool *pool)
+{
+	struct pkt_buf *buf = pool->free;
+
+	if (unlikely(!buf)) {
+		pkt_pool_reclaim(pool);
+		buf = pool->free;
+		if (unlikely(!buf))
+			return NULL;
+	}
+
+	pool->free = buf->next;
+	pool->nr_free--;
+	return &buf->pkt;
+}
+
+
+static inline int pkt_pool_init(struct pkt_pool *pool, uint32_t nr)
+{
+	uint32_t i;
+	struct pkt_buf *bufs;
+
+	bufs = al4096_malloc_mmap((size_t)nr * sizeof(*bufs));
+	if (unlikely(!bufs))
+		return -errno;
+
+	pool->free    = NULL;
+	pool->nr_free = 0;
+	pool->nr      = nr;
+	pool->bufs    = bufs;
+	atomic_init(&pool->remote, NULL);
+
+	/*
+	 * Push in reverse, so pkt_pool_get() hands out the
+	 * buffers in address order.
+	 */
+	for (i = nr; i--;) {
+		bufs[i].pool = pool;
+		pkt_pool_put(pool, &bufs[i].pkt);
+	}
+
+	return 0;
+}
+
+
+static inline void pkt_pool_destroy(struct pkt_pool *pool)
+{
+	if (!pool->bufs)
+		return;
+
+	al4096_free_munmap(pool->bufs, (size_t)pool->nr * sizeof(*pool->bufs));
+	pool->bufs = NULL;
+}
+
+#endif /* #ifndef TEAVPN2__PKT_POOL_H */
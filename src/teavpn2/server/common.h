@@ -18,11 +18,21 @@ struct srv_cfg_sys {
 
 struct srv_cfg_sock {
 	bool			use_encryption;
+	bool			udp_gso;
+	bool			udp_gro;
+	bool			reuseport;
+	bool			epoll_exclusive;
+	bool			iouring_sqpoll;
+	uint32_t		iouring_sqpoll_idle;
 	int			backlog;
 	sock_type		type;
 	char			bind_addr[64];
 	uint16_t		bind_port;
-	uint16_t		max_conn;
+	uint32_t		max_conn;
+	uint16_t		recv_batch;
+	uint16_t		event_budget;
+	uint16_t		txq_len;
+	bool			txq_drop_head;
 	char			event_loop[64];
 	char			ssl_cert[256];
 	char			ssl_priv_key[256];
@@ -32,6 +42,7 @@ struct srv_cfg_sock {
 struct srv_cfg_iface {
 	char			dev[IFACENAMESIZ];
 	uint16_t		mtu;
+	bool			tun_offload;
 	struct if_info		iff;
 };
 
@@ -24,7 +24,11 @@ static const char d_srv_ipv4[] = "10.5.5.1";
 static const char d_srv_ipv4_netmask[] = "255.255.255.0";
 static const char d_srv_cfg_file[] = "/etc/teavpn2/server.ini";
 static const uint8_t d_num_of_threads = 2;
-static const uint16_t d_srv_max_conn = 32;
+static const uint32_t d_srv_max_conn = 32;
+static const uint16_t d_srv_recv_batch = 32;
+static const uint16_t d_srv_event_budget = 128;
+static const uint16_t d_srv_txq_len = 128;
+static const uint32_t d_srv_iouring_sqpoll_idle = 1000;
 
 
 static __cold void set_default_config(struct srv_cfg *cfg)
@@ -48,6 +52,12 @@ static __cold void set_default_config(struct srv_cfg *cfg)
 	sock->bind_port = d_srv_bind_port;
 	sock->backlog = d_srv_backlog;
 	sock->max_conn = d_srv_max_conn;
+	sock->recv_batch = d_srv_recv_batch;
+	sock->event_budget = d_srv_event_budget;
+	sock->txq_len = d_srv_txq_len;
+	sock->udp_gso = true;
+	sock->udp_gro = true;
+	sock->iouring_sqpoll_idle = d_srv_iouring_sqpoll_idle;
 }
 
 
@@ -91,7 +101,7 @@ static __cold void teavpn_server_show_help(const char *app)
 	printf("  -H, --bind-addr=IP\t\tSet bind address (default 0.0.0.0).\n");
 	printf("  -P, --bind-port=PORT\t\tSet bind port (default: %d).\n",
 	       d_srv_bind_port);
-	printf("  -k, --max-conn=N\t\tSet max connections (default: %d).\n",
+	printf("  -k, --max-conn=N\t\tSet max connections (default: %u).\n",
 	       d_srv_max_conn);
 	printf("  -B, --backlog=N\t\tSet socket listen backlog (default: %d)"
 	       ".\n", d_srv_backlog);
@@ -126,15 +136,30 @@ static __maybe_unused void dump_server_cfg(struct srv_cfg *cfg)
 	printf("   cfg->sock.type = %s\n",
 		(cfg->sock.type == SOCK_TCP) ? "SOCK_TCP" :
 		((cfg->sock.type == SOCK_UDP) ? "SOCK_UDP" : "unknown"));
+	printf("   cfg->sock.udp_gso = %hhu\n", (uint8_t)cfg->sock.udp_gso);
+	printf("   cfg->sock.udp_gro = %hhu\n", (uint8_t)cfg->sock.udp_gro);
+	printf("   cfg->sock.reuseport = %hhu\n", (uint8_t)cfg->sock.reuseport);
+	printf("   cfg->sock.epoll_exclusive = %hhu\n",
+		(uint8_t)cfg->sock.epoll_exclusive);
+	printf("   cfg->sock.iouring_sqpoll = %hhu\n",
+		(uint8_t)cfg->sock.iouring_sqpoll);
+	PR_CFG(cfg->sock.iouring_sqpoll_idle, "%u");
 	PR_CFG(cfg->sock.bind_addr, "%s");
 	PR_CFG(cfg->sock.bind_port, "%hu");
 	PR_CFG(cfg->sock.event_loop, "%s");
-	PR_CFG(cfg->sock.max_conn, "%hu");
+	PR_CFG(cfg->sock.max_conn, "%u");
+	PR_CFG(cfg->sock.recv_batch, "%hu");
+	PR_CFG(cfg->sock.event_budget, "%hu");
+	PR_CFG(cfg->sock.txq_len, "%hu");
+	printf("   cfg->sock.txq_drop = %s\n",
+		cfg->sock.txq_drop_head ? "head" : "tail");
 	PR_CFG(cfg->sock.ssl_cert, "%s");
 	PR_CFG(cfg->sock.ssl_priv_key, "%s");
 	putchar('\n');
 	PR_CFG(cfg->iface.dev, "%s");
 	PR_CFG(cfg->iface.mtu, "%hu");
+	printf("   cfg->iface.tun_offload = %hhu\n",
+		(uint8_t)cfg->iface.tun_offload);
 	PR_CFG(cfg->iface.iff.ipv4, "%s");
 	PR_CFG(cfg->iface.iff.ipv4_netmask, "%s");
 	puts("=============================================");
@@ -309,6 +334,18 @@ static int cfg_parse_section_socket(struct cfg_parse_ctx *ctx, const char *name,
 	struct srv_cfg *cfg = ctx->cfg;
 	if (!strcmp(name, "use_encryption")) {
 		cfg->sock.use_encryption = atoi(val) ? true : false;
+	} else if (!strcmp(name, "udp_gso")) {
+		cfg->sock.udp_gso = atoi(val) ? true : false;
+	} else if (!strcmp(name, "udp_gro")) {
+		cfg->sock.udp_gro = atoi(val) ? true : false;
+	} else if (!strcmp(name, "reuseport")) {
+		cfg->sock.reuseport = atoi(val) ? true : false;
+	} else if (!strcmp(name, "epoll_exclusive")) {
+		cfg->sock.epoll_exclusive = atoi(val) ? true : false;
+	} else if (!strcmp(name, "iouring_sqpoll")) {
+		cfg->sock.iouring_sqpoll = atoi(val) ? true : false;
+	} else if (!strcmp(name, "iouring_sqpoll_idle")) {
+		cfg->sock.iouring_sqpoll_idle = (uint32_t)strtoul(val, NULL, 10);
 	} else if (!strcmp(name, "event_loop")) {
 		strncpy2(cfg->sock.event_loop, val, sizeof(cfg->sock.event_loop));
 	} else if (!strcmp(name, "sock_type")) {
@@ -335,7 +372,24 @@ static int cfg_parse_section_socket(struct cfg_parse_ctx *ctx, const char *name,
 	} else if (!strcmp(name, "backlog")) {
 		cfg->sock.backlog = atoi(val);
 	} else if (!strcmp(name, "max_conn")) {
-		cfg->sock.max_conn = (uint16_t)strtoul(val, NULL, 10);
+		cfg->sock.max_conn = (uint32_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "recv_batch")) {
+		cfg->sock.recv_batch = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "event_budget")) {
+		cfg->sock.event_budget = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "txq_len")) {
+		cfg->sock.txq_len = (uint16_t)strtoul(val, NULL, 10);
+	} else if (!strcmp(name, "txq_drop")) {
+		if (!strcmp(val, "head")) {
+			cfg->sock.txq_drop_head = true;
+		} else if (!strcmp(val, "tail")) {
+			cfg->sock.txq_drop_head = false;
+		} else {
+			pr_err("Invalid txq_drop \"%s\" at %s:%d (expected "
+			       "\"head\" or \"tail\")\n", val,
+			       cfg->sys.cfg_file, lineno);
+			return 0;
+		}
 	} else if (!strcmp(name, "ssl_cert")) {
 		strncpy2(cfg->sock.ssl_cert, val, sizeof(cfg->sock.ssl_cert));
 	} else if (!strcmp(name, "ssl_priv_key")) {
@@ -361,6 +415,8 @@ static int cfg_parse_section_iface(struct cfg_parse_ctx *ctx, const char *name,
 	} else if (!strcmp(name, "mtu")) {
 		cfg->iface.mtu = (uint16_t)strtoul(val, NULL, 10);
 		cfg->iface.iff.ipv4_mtu = cfg->iface.mtu;
+	} else if (!strcmp(name, "tun_offload")) {
+		cfg->iface.tun_offload = atoi(val) ? true : false;
 	} else if (!strcmp(name, "ipv4")) {
 		strncpy2(cfg->iface.iff.ipv4, val, sizeof(cfg->iface.iff.ipv4));
 		cfg->iface.iff.ipv4[sizeof(cfg->iface.iff.ipv4) - 1] = '\0';
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
+#include <linux/filter.h>
 #include <teavpn2/net/linux/iface.h>
 #include <teavpn2/server/linux/udp.h>
 
@@ -49,6 +50,24 @@ static int alloc_tun_fds_array(struct srv_udp_state *state)
 }
 
 
+static int alloc_udp_fds_array(struct srv_udp_state *state)
+{
+	int *udp_fds;
+	uint8_t i, nn;
+
+	nn      = state->cfg->sys.thread_num;
+	udp_fds = calloc_wrp(nn, sizeof(*udp_fds));
+	if (unlikely(!udp_fds))
+		return -errno;
+
+	for (i = 0; i < nn; i++)
+		udp_fds[i] = -1;
+
+	state->udp_fds = udp_fds;
+	return 0;
+}
+
+
 static int select_event_loop(struct srv_udp_state *state)
 {
 	struct srv_cfg_sock *sock = &state->cfg->sock;
@@ -71,8 +90,14 @@ static int select_event_loop(struct srv_udp_state *state)
 		state->epl_threads = NULL;
 		break;
 	case EVTL_IO_URING:
+#ifdef CONFIG_IO_URING
+		state->epl_threads = NULL;
 		state->iou_threads = NULL;
 		break;
+#else
+		pr_err("TeaVPN2 is built without io_uring support");
+		return -EOPNOTSUPP;
+#endif
 	case EVTL_NOP:
 	default:
 		panic("Aiee... invalid event loop value (%u)", state->evt_loop);
@@ -97,6 +122,10 @@ static int init_state(struct srv_udp_state *state)
 	if (unlikely(ret))
 		return ret;
 
+	ret = alloc_udp_fds_array(state);
+	if (unlikely(ret))
+		return ret;
+
 	ret = select_event_loop(state);
 	if (unlikely(ret))
 		return ret;
@@ -185,7 +214,7 @@ out_err:
 }
 
 
-static int init_socket(struct srv_udp_state *state)
+static int open_udp_socket(struct srv_udp_state *state, uint8_t idx)
 {
 	int ret;
 	int type;
@@ -215,6 +244,19 @@ static int init_socket(struct srv_udp_state *state)
 	if (unlikely(ret))
 		goto out_err;
 
+	if (state->reuseport) {
+		int y = 1;
+
+		ret = setsockopt(udp_fd, SOL_SOCKET, SO_REUSEPORT, &y,
+				 sizeof(y));
+		if (unlikely(ret)) {
+			ret = errno;
+			pr_err("setsockopt(udp_fd, SOL_SOCKET, SO_REUSEPORT): "
+			       PRERF, PREAR(ret));
+			goto out_err;
+		}
+	}
+
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -232,7 +274,7 @@ static int init_socket(struct srv_udp_state *state)
 	}
 
 
-	state->udp_fd = udp_fd;
+	state->udp_fds[idx] = udp_fd;
 	return 0;
 
 
@@ -242,6 +284,151 @@ out_err:
 }
 
 
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/*
+ * Multiplier of the steering hash (2^32 / golden ratio).
+ */
+#define STEER_HASH_MUL	0x9e3779b1u
+
+/*
+ * Steer every packet (handshake, auth, sync, close and TUN data
+ * alike) to the socket, and so the thread, picked from a hash
+ * of the client's outer source address and port. All packets
+ * of a session are then handled by the same thread.
+ *
+ * The hash is computed here from the IP and UDP headers. The
+ * skb->hash is read raw by a classic BPF program, it's 0 when
+ * the NIC gives no RSS hash and RPS is off (e.g. virtio-net),
+ * which would send everything to udp_fds[0].
+ *
+ * A client whose NAT mapping changes its source port is a new
+ * session anyway (sessions are keyed on the address and port),
+ * so keying on the address alone would not keep it on its
+ * thread, it would only pile all the clients behind one NAT
+ * address onto one thread.
+ */
+static int attach_reuseport_steering(struct srv_udp_state *state, uint8_t nr)
+{
+	int ret;
+	struct sock_filter code[] = {
+		/* X = iph->ihl * 4; A = udph->source; */
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SKF_NET_OFF),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+
+		/* A = iph->saddr ^ udph->source; */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)SKF_NET_OFF +
+			 (uint32_t)offsetof(struct iphdr, saddr)),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+
+		/* return ((A * STEER_HASH_MUL) >> 16) % nr; */
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, STEER_HASH_MUL),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nr),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len    = (unsigned short)(sizeof(code) / sizeof(code[0])),
+		.filter = code,
+	};
+
+	/*
+	 * The program is shared by the whole reuseport group, the
+	 * returned index is the bind order, i.e. udp_fds[index].
+	 */
+	ret = setsockopt(state->udp_fds[0], SOL_SOCKET,
+			 SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+	if (unlikely(ret)) {
+		ret = errno;
+		pr_warn("setsockopt(udp_fd, SOL_SOCKET, "
+			"SO_ATTACH_REUSEPORT_CBPF): " PRERF, PREAR(ret));
+		pr_warn("Falling back to the 4-tuple hash steering");
+		return -ret;
+	}
+
+	prl_notice(2, "Attached SO_REUSEPORT session steering program");
+	return 0;
+}
+
+
+static int init_socket(struct srv_udp_state *state)
+{
+	int ret;
+	uint8_t i, nr = 1;
+	struct srv_cfg_sock *sock = &state->cfg->sock;
+
+	state->reuseport = sock->reuseport;
+	if (state->reuseport) {
+		nr = state->cfg->sys.thread_num;
+		prl_notice(2, "Using SO_REUSEPORT, one UDP socket per thread");
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = open_udp_socket(state, i);
+		if (unlikely(ret))
+			return ret;
+	}
+	state->udp_fd = state->udp_fds[0];
+
+	if (nr > 1)
+		attach_reuseport_steering(state, nr);
+
+	state->udp_excl = false;
+	if (sock->epoll_exclusive) {
+		if (state->reuseport) {
+			prl_notice(2, "epoll_exclusive is ignored with "
+				      "reuseport");
+		} else if (state->evt_loop != EVTL_EPOLL) {
+			prl_notice(2, "epoll_exclusive is ignored without "
+				      "the epoll event loop");
+		} else if (state->cfg->sys.thread_num > 1) {
+			state->udp_excl = true;
+			prl_notice(2, "Using EPOLLEXCLUSIVE, every thread "
+				      "receives from the UDP socket");
+		}
+	}
+
+	/*
+	 * The io_uring event loop sends every packet from its own
+	 * pool buffer, there is no train to coalesce.
+	 */
+	state->udp_gso = false;
+	if (sock->udp_gso && state->evt_loop == EVTL_IO_URING) {
+		prl_notice(2, "UDP GSO is not used with io_uring");
+	} else if (sock->udp_gso) {
+		state->udp_gso = udp_gso_supported(state->udp_fd);
+		if (state->udp_gso)
+			prl_notice(2, "UDP GSO is enabled");
+		else
+			prl_notice(2, "UDP GSO is not supported by the kernel");
+	}
+
+	/*
+	 * The io_uring event loop receives into packet sized
+	 * buffers, it can't take the coalesced datagrams.
+	 */
+	state->udp_gro = false;
+	if (!sock->udp_gro || state->evt_loop == EVTL_IO_URING)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		ret = udp_gro_enable(state->udp_fds[i]);
+		if (ret) {
+			prl_notice(2, "Cannot enable UDP GRO: " PRERF,
+				   PREAR(-ret));
+			return 0;
+		}
+	}
+
+	state->udp_gro = true;
+	prl_notice(2, "UDP GRO is enabled");
+	return 0;
+}
+
+
 static int init_iface(struct srv_udp_state *state)
 {
 	uint8_t i, nn;
@@ -258,6 +445,16 @@ static int init_iface(struct srv_udp_state *state)
 
 	prl_notice(2, "Initializing virtual network interface (%s)...", dev);
 
+	state->tun_offload = state->cfg->iface.tun_offload;
+	if (state->tun_offload && state->evt_loop == EVTL_IO_URING) {
+		pr_warn("tun_offload is not supported with io_uring, "
+			"disabling it");
+		state->tun_offload = false;
+	}
+
+	if (state->tun_offload)
+		flags |= IFF_VNET_HDR;
+
 
 	tun_fds = state->tun_fds;
 	nn = state->cfg->sys.thread_num;
@@ -272,6 +469,14 @@ static int init_iface(struct srv_udp_state *state)
 			goto err;
 		}
 
+		if (state->tun_offload) {
+			ret = tun_set_offload(tun_fd);
+			if (unlikely(ret < 0)) {
+				__sys_close(tun_fd);
+				goto err;
+			}
+		}
+
 		if (state->evt_loop != EVTL_IO_URING) {
 			ret = fd_set_nonblock(tun_fd);
 			if (unlikely(ret < 0)) {
@@ -308,7 +513,13 @@ static int init_udp_session_array(struct srv_udp_state *state)
 {
 	int ret = 0;
 	struct udp_sess *sess_arr;
-	uint16_t i, max_conn = state->cfg->sock.max_conn;
+	struct udp_sess_info *sess_info;
+	uint32_t i, max_conn = state->cfg->sock.max_conn;
+
+	if (unlikely(max_conn == 0 || max_conn > UDP_SESS_MAX_CONN)) {
+		pr_err("max_conn must be between 1 and %u", UDP_SESS_MAX_CONN);
+		return -EINVAL;
+	}
 
 	prl_notice(4, "Initializing UDP session array...");
 	sess_arr = calloc_wrp((size_t)max_conn, sizeof(*sess_arr));
@@ -316,8 +527,20 @@ static int init_udp_session_array(struct srv_udp_state *state)
 		return -errno;
 
 	state->sess_arr = sess_arr;
-	for (i = 0; i < max_conn; i++)
+	sess_info = calloc_wrp((size_t)max_conn, sizeof(*sess_info));
+	if (unlikely(!sess_info))
+		return -errno;
+
+	state->sess_info = sess_info;
+	state->auth_list = calloc_wrp((size_t)max_conn,
+				      sizeof(*state->auth_list));
+	if (unlikely(!state->auth_list))
+		return -errno;
+
+	for (i = 0; i < max_conn; i++) {
+		sess_arr[i].info = &sess_info[i];
 		reset_udp_session(&sess_arr[i], i);
+	}
 
 	return ret;
 }
@@ -326,11 +549,16 @@ static int init_udp_session_array(struct srv_udp_state *state)
 static int init_udp_session_map(struct srv_udp_state *state)
 {
 	int ret;
-	size_t len = 0x100u * 0x100u;
-	struct udp_map_bucket (*sess_map)[0x100u];
+	uint8_t bits = 4;
+	struct udp_map_slot *sess_map;
+	size_t len = 2u * (size_t)state->cfg->sock.max_conn;
+
+	while (((size_t)1u << bits) < len)
+		bits++;
 
-	prl_notice(4, "Initializing UDP session map...");
-	sess_map = calloc_wrp(len, sizeof(struct udp_map_bucket));
+	len = (size_t)1u << bits;
+	prl_notice(4, "Initializing UDP session map (%zu slots)...", len);
+	sess_map = calloc_wrp(len, sizeof(*sess_map));
 	if (unlikely(!sess_map))
 		return -errno;
 
@@ -338,7 +566,9 @@ static int init_udp_session_map(struct srv_udp_state *state)
 	if (unlikely(ret))
 		return -ret;
 
-	state->sess_map = sess_map;
+	state->sess_map       = sess_map;
+	state->sess_map_mask  = (uint32_t)(len - 1u);
+	state->sess_map_shift = (uint8_t)(64u - bits);
 	return ret;
 }
 
@@ -346,7 +576,7 @@ static int init_udp_session_map(struct srv_udp_state *state)
 static int init_udp_session_stack(struct srv_udp_state *state)
 {
 	int ret;
-	uint16_t i, max_conn = state->cfg->sock.max_conn;
+	uint32_t i, max_conn = state->cfg->sock.max_conn;
 
 	prl_notice(4, "Initializing UDP session stack...");
 	if (unlikely(!bt_stack_init(&state->sess_stk, max_conn)))
@@ -362,7 +592,7 @@ static int init_udp_session_stack(struct srv_udp_state *state)
 #endif
 
 	for (i = max_conn; i--;) {
-		int32_t tmp = bt_stack_push(&state->sess_stk, (uint16_t)i);
+		int32_t tmp = bt_stack_push(&state->sess_stk, i);
 		if (unlikely(tmp == -1)) {
 			panic("Fatal bug in init_udp_session_stack!");
 			__builtin_unreachable();
@@ -373,15 +603,61 @@ static int init_udp_session_stack(struct srv_udp_state *state)
 }
 
 
-static int init_ipv4_map(struct srv_udp_state *state)
+static int init_udp_session_timer(struct srv_udp_state *state)
 {
-	uint16_t (*ipv4_map)[0x100];
+	int ret;
 
-	ipv4_map = calloc_wrp(0x100ul * 0x100ul, sizeof(uint16_t));
-	if (unlikely(!ipv4_map))
-		return -errno;
+	prl_notice(4, "Initializing UDP session timer wheel...");
+	ret = mutex_init(&state->zr.tw_lock, NULL);
+	if (unlikely(ret))
+		return -ret;
+
+	coarse_clock_update();
+	memset(&state->zr.tw, 0, sizeof(state->zr.tw));
+	state->zr.tw.now = (uint32_t)coarse_now();
+	return 0;
+}
+
+
+/*
+ * Every session takes a /32 route and may announce a few client
+ * subnets, each of them needs at most two groups of the table.
+ * The groups are an anonymous mapping, so the unused ones don't
+ * take memory.
+ */
+static int init_ipv4_routes(struct srv_udp_state *state)
+{
+	int ret;
+	uint64_t max_groups;
+	struct in_addr addr, mask;
+	struct if_info *iff = &state->cfg->iface.iff;
+
+	if (unlikely(inet_pton(AF_INET, iff->ipv4, &addr) != 1 ||
+		     inet_pton(AF_INET, iff->ipv4_netmask, &mask) != 1)) {
+		pr_err("Invalid interface address %s/%s", iff->ipv4,
+		       iff->ipv4_netmask);
+		return -EINVAL;
+	}
+
+	state->ipv4_addr  = ntohl(addr.s_addr);
+	state->ipv4_bcast = state->ipv4_addr | ~ntohl(mask.s_addr);
+
+	max_groups = 2ull * state->cfg->sock.max_conn + 1024u;
+	if (max_groups > (1u << 20u))
+		max_groups = (1u << 20u);
+
+	prl_notice(4, "Initializing IPv4 route table (%" PRIu64 " groups)...",
+		   max_groups);
+	ret = lpm4_init(&state->ipv4_routes, (uint32_t)max_groups);
+	if (unlikely(ret)) {
+		pr_err("lpm4_init(): " PRERF, PREAR(-ret));
+		return ret;
+	}
+
+	ret = mutex_init(&state->route_lock, NULL);
+	if (unlikely(ret))
+		return -ret;
 
-	state->ipv4_map = ipv4_map;
 	return 0;
 }
 
@@ -392,9 +668,11 @@ static int run_server_event_loop(struct srv_udp_state *state)
 	case EVTL_EPOLL:
 		return teavpn2_udp_server_epoll(state);
 	case EVTL_IO_URING:
-		pr_err("run_client_event_loop() with io_uring: " PRERF,
-			PREAR(EOPNOTSUPP));
+#ifdef CONFIG_IO_URING
+		return teavpn2_udp_server_io_uring(state);
+#else
 		return -EOPNOTSUPP;
+#endif
 	case EVTL_NOP:
 	default:
 		panic("Aiee... invalid event loop value (%u)", state->evt_loop);
@@ -405,10 +683,18 @@ static int run_server_event_loop(struct srv_udp_state *state)
 
 static void close_udp_fd(struct srv_udp_state *state)
 {
-	int udp_fd = state->udp_fd;
+	uint8_t i, nn;
+	int *udp_fds = state->udp_fds;
+
+	if (!udp_fds)
+		return;
 
-	if (udp_fd != -1) {
-		prl_notice(2, "Closing udp_fd (fd=%d)...", udp_fd);
+	nn = state->cfg->sys.thread_num;
+	for (i = 0; i < nn; i++) {
+		int udp_fd = udp_fds[i];
+		if (udp_fd == -1)
+			continue;
+		prl_notice(2, "Closing udp_fds[%hhu] (fd=%d)...", i, udp_fd);
 		__sys_close(udp_fd);
 	}
 }
@@ -457,9 +743,13 @@ static void destroy_state(struct srv_udp_state *state)
 	close_fds_state(state);
 	bt_stack_destroy(&state->sess_stk);
 	al64_free(state->sess_arr);
+	al64_free(state->sess_info);
+	al64_free(state->auth_list);
 	al64_free(state->sess_map);
-	al64_free(state->ipv4_map);
+	lpm4_destroy(&state->ipv4_routes);
+	destroy_udp_mcast(state);
 	al64_free(state->tun_fds);
+	al64_free(state->udp_fds);
 	al64_free(state);
 }
 
@@ -492,7 +782,13 @@ int teavpn2_server_udp_run(struct srv_cfg *cfg)
 	ret = init_udp_session_stack(state);
 	if (unlikely(ret))
 		goto out;
-	ret = init_ipv4_map(state);
+	ret = init_udp_session_timer(state);
+	if (unlikely(ret))
+		goto out;
+	ret = init_ipv4_routes(state);
+	if (unlikely(ret))
+		goto out;
+	ret = init_udp_mcast(state);
 	if (unlikely(ret))
 		goto out;
 	ret = run_server_event_loop(state);
@@ -8,15 +8,25 @@
 
 #include <time.h>
 #include <pthread.h>
-#include <sys/time.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <stdatomic.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <teavpn2/lpm.h>
 #include <teavpn2/mutex.h>
 #include <teavpn2/stack.h>
+#include <teavpn2/clock.h>
 #include <teavpn2/packet.h>
+#include <teavpn2/pkt_pool.h>
 #include <teavpn2/server/common.h>
+#include <teavpn2/net/linux/udp_offload.h>
+#include <teavpn2/net/linux/tun_offload.h>
+
+#ifdef CONFIG_IO_URING
+#  include <liburing.h>
+#  include <teavpn2/iou_compat.h>
+#endif
 
 
 /*
@@ -24,28 +34,122 @@
  */
 #define EPOLL_EVT_ARR_NUM	3u
 
+/*
+ * The maximum number of datagrams we can pull from the UDP
+ * socket with a single recvmmsg() call (the actual number is
+ * taken from the "recv_batch" config, capped at this value).
+ */
+#define UDP_RECV_BATCH_MAX	64u
+
 /*
  * Tolerance number of errors per session.
  */
 #define UDP_SESS_MAX_ERR	5u
 
+/*
+ * Max per destination send errors logged per thread per
+ * second, the rest are only counted.
+ */
+#define UDP_TX_ERR_LOG		8u
+
 
 #define EPOLL_TIMEOUT		10000
 
 
+/*
+ * Upper bound of max_conn. Sessions are indexed with uint32_t
+ * and the free index stack hands out int32_t.
+ */
+#define UDP_SESS_MAX_CONN	(1u << 24u)
+
+
 #define UDP_SESS_TIMEOUT_NO_AUTH	30
 #define UDP_SESS_TIMEOUT_AUTH		180
 
+/*
+ * How often an idle authenticated session gets REQSYNC packets
+ * once it has been idle for a fifth of UDP_SESS_TIMEOUT_AUTH.
+ */
+#define UDP_SESS_REQSYNC_IVAL		5
+
+/*
+ * IGMP snooping. The server is the querier of the tunnel, a
+ * membership that is not refreshed by a report within
+ * MCAST_MEMBER_TTL seconds expires (RFC 3376, section 8.4).
+ */
+#define MCAST_MAX_GROUPS	256u
+#define MCAST_QUERY_IVAL	125
+#define MCAST_MEMBER_TTL	(2 * MCAST_QUERY_IVAL + 10)
+
+/*
+ * Max ICMP host unreachable messages per thread per second.
+ */
+#define UDP_ICMP_RATE		64u
+
+/*
+ * The session timer wheel, see struct timer_wheel.
+ */
+#define TW_BITS		6u
+#define TW_SIZE		(1u << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1u)
+#define TW_LEVELS	2u
+
+
+
+/*
+ * Cold part of a UDP session, only used on auth and for
+ * logging. It lives in @state->sess_info at the same index
+ * as the session.
+ */
+struct udp_sess_info {
+	/*
+	 * Session username.
+	 */
+	char					username[0x100];
+
+	/*
+	 * Human readable of @src_addr.
+	 */
+	char					str_src_addr[IPV4_L];
+
+	/*
+	 * Timer wheel node. @tw_next and @tw_prev are session
+	 * indexes plus one (0 is nil), @tw_expire is the deadline
+	 * in coarse clock seconds and @tw_lvl/@tw_slot tell which
+	 * list the session is on. Only touched with
+	 * @state->zr.tw_lock held.
+	 */
+	uint32_t				tw_next;
+	uint32_t				tw_prev;
+	uint32_t				tw_expire;
+	uint8_t					tw_lvl;
+	uint8_t					tw_slot;
+	bool					tw_armed;
+
+	/*
+	 * The client subnets loaded in @state->ipv4_routes for
+	 * this session (not including the /32 of @ipv4_iff).
+	 */
+	struct auth_routes			routes;
+
+	/*
+	 * Position in @state->auth_list while authenticated.
+	 */
+	uint32_t				auth_pos;
+};
 
 
 /*
  * UDP session struct.
  *
- * Each client has its own UDP session struct.
+ * Each client has its own UDP session struct. It only holds
+ * the fields the data path and the zombie reaper touch, so a
+ * session fits in a single cache line.
  */
 struct udp_sess {
 	/*
-	 * Private IP address (virtual network interface).
+	 * Private IP address (virtual network interface), it's
+	 * only set while its /32 route is loaded.
 	 */
 	uint32_t				ipv4_iff;
 
@@ -61,7 +165,7 @@ struct udp_sess {
 	 * @idx contains the index position of each
 	 * instance.
 	 */
-	uint16_t				idx;
+	uint32_t				idx;
 
 	/*
 	 * UDP is stateless, we may not know whether the
@@ -77,15 +181,9 @@ struct udp_sess {
 	struct sockaddr_in			addr;
 
 	/*
-	 * Session username.
+	 * The cold part of this session.
 	 */
-	char					username[0x100];
-
-	/*
-	 * Human readable of @src_addr.
-	 */
-	char					str_src_addr[IPV4_L];
-
+	struct udp_sess_info			*info;
 
 	/*
 	 * Loop counter.
@@ -99,26 +197,83 @@ struct udp_sess {
 
 	bool					is_authenticated;
 	_Atomic(bool)				is_connected;
-};
+
+	/*
+	 * Generation of this slot. It's bumped when the session is
+	 * created and again when it's deleted, so it's odd while
+	 * the session is live. A thread that got the session
+	 * without the lock passes it back to delete_udp_session(),
+	 * which then can't delete the session a second time or
+	 * delete another client that reused the slot.
+	 */
+	_Atomic(uint32_t)			gen;
+} __aligned(64);
+
+SIZE_ASSERT(struct udp_sess, 64);
 
 
 /*
- * Bucket for session map.
+ * Slot of the session map.
  *
- * This is a very simple hash table to handle multiple
- * sessions at once.
+ * The session map is an open addressing (Robin Hood, linear
+ * probing) hash table keyed on the (@addr, @port) tuple. The key
+ * is kept inline, so a probe doesn't touch the session itself.
+ *
+ * Lookups run without the lock, a slot is loaded and stored
+ * through the two words of @raw. A torn load can only happen
+ * while the map is being modified, the seqlock retry catches it.
  */
-struct udp_map_bucket;
-
-struct udp_map_bucket {
-	struct udp_map_bucket			*next;
-	struct udp_sess				*sess;
+struct udp_map_slot {
+	union {
+		struct {
+			uint32_t		addr;
+			uint16_t		port;
+			uint16_t		__pad;
+
+			/*
+			 * Index of the session in @sess_arr plus
+			 * one, 0 means the slot is empty.
+			 */
+			uint32_t		idx;
+			uint32_t		__pad2;
+		};
+		uint64_t			raw[2];
+	};
 };
 
+SIZE_ASSERT(struct udp_map_slot, 2 * sizeof(uint64_t));
+
 
 struct srv_udp_state;
 
 
+/*
+ * Backpressure queue of an fd a thread writes to.
+ *
+ * When a write to @fd gets EAGAIN, the packet (and every packet
+ * after it, to keep the order) is copied into a pool buffer and
+ * parked here instead of blocking the thread. While the queue is
+ * not empty, @wfd (a dup() of @fd) is in the thread's epoll set
+ * with EPOLLOUT, and the queue is flushed when it fires.
+ *
+ * At most @max packets are parked, the rest are dropped
+ * according to the "txq_drop" config and counted in @dropped.
+ */
+struct tx_queue {
+	struct pkt_buf				*head;
+	struct pkt_buf				*tail;
+	uint16_t				nr;
+	uint16_t				max;
+	bool					armed;
+	int					fd;
+	int					wfd;
+	uint64_t				dropped;
+};
+
+
+struct iou_thread;
+
+
 /*
  * Epoll thread.
  *
@@ -152,7 +307,184 @@ struct epl_thread {
 	 */
 	uint16_t				idx;
 
+	/*
+	 * The UDP socket this thread sends with, and receives from
+	 * if srv_thread_recv_udp() says so. It is @state->udp_fd, or
+	 * the thread's own socket with SO_REUSEPORT.
+	 */
+	int					udp_fd;
+
+	/*
+	 * The TUN queue this thread writes the client packets to
+	 * (@state->tun_fds[idx]), so the threads don't contend on
+	 * the same queue.
+	 */
+	int					tun_fd;
+
+	/*
+	 * @pkt points to the packet buffer that is currently being
+	 * processed. It is one of the @pkts elements.
+	 */
 	struct sc_pkt				*pkt;
+
+	/*
+	 * Generation of the session @pkt belongs to, as returned
+	 * by lookup_udp_sess() or create_udp_sess().
+	 */
+	uint32_t				sess_gen;
+
+	/*
+	 * Batched receive buffers for recvmmsg(). Each element
+	 * of @pkts is paired with @rx_msgs, @rx_iovs and @rx_saddrs
+	 * at the same index. Only the first @recv_batch elements
+	 * are used.
+	 *
+	 * The same @pkts are also used to hold a burst of packets
+	 * read from the TUN fd, @recv_batch is the burst length.
+	 *
+	 * All of them come from @pool. A holder may swap an element
+	 * for a fresh pool buffer to keep the packet around.
+	 */
+	struct sc_pkt				*pkts[UDP_RECV_BATCH_MAX];
+	struct pkt_pool				pool;
+	uint16_t				recv_batch;
+
+	/*
+	 * The maximum number of packets (UDP datagrams or TUN
+	 * frames) a single readiness event may consume before we
+	 * go back to epoll_wait(). An fd that still has data after
+	 * its budget is reported again by the next epoll_wait(),
+	 * so a busy fd can't starve the others.
+	 */
+	uint16_t				event_budget;
+	struct mmsghdr				rx_msgs[UDP_RECV_BATCH_MAX];
+	struct iovec				rx_iovs[UDP_RECV_BATCH_MAX];
+	struct sockaddr_in			rx_saddrs[UDP_RECV_BATCH_MAX];
+
+	/*
+	 * With UDP GRO, a single received datagram may carry
+	 * several coalesced TeaVPN2 packets, so @rx_iovs point
+	 * to @rx_gro_buf (UDP_GRO_BUF_SIZE bytes per slot)
+	 * instead of @pkts. @rx_cmsg receives the segment size.
+	 * Each segment is copied to @pkts[0] before dispatching.
+	 */
+	char					*rx_gro_buf;
+	union udp_gro_cmsg			rx_cmsg[UDP_RECV_BATCH_MAX];
+
+	/*
+	 * TUN offload buffers (only used with @state->tun_offload).
+	 * @tun_rx_buf holds a frame read from the TUN fd before it
+	 * is segmented into @pkts. @tun_gro coalesces the TCP
+	 * segments that are going to be written to the TUN fd.
+	 */
+	uint8_t					*tun_rx_buf;
+	struct tun_gro				tun_gro;
+
+	/*
+	 * Pending packets to be sent with sendmmsg(). @tx_iovs
+	 * and @tx_sess hold the queued buffers and their
+	 * destination sessions, @tx_nr is the number of queued
+	 * buffers.
+	 *
+	 * @tx_msgs is built from them right before sending. With
+	 * UDP GSO, consecutive buffers to the same session are
+	 * coalesced into one message (with @tx_cmsg carrying the
+	 * UDP_SEGMENT size), so a message may span several
+	 * @tx_iovs elements.
+	 */
+	uint16_t				tx_nr;
+	struct iovec				tx_iovs[UDP_RECV_BATCH_MAX];
+	struct udp_sess				*tx_sess[UDP_RECV_BATCH_MAX];
+	struct mmsghdr				tx_msgs[UDP_RECV_BATCH_MAX];
+	union udp_gso_cmsg			tx_cmsg[UDP_RECV_BATCH_MAX];
+
+	/*
+	 * Set while a batch the kernel refused to segment is sent
+	 * again without UDP_SEGMENT.
+	 */
+	bool					tx_no_gso;
+
+	/*
+	 * Backpressure queues of @udp_fd and @tun_fd.
+	 */
+	struct tx_queue				udp_txq;
+	struct tx_queue				tun_txq;
+
+#ifdef CONFIG_IO_URING
+	/*
+	 * The paired io_uring context, NULL with the epoll event
+	 * loop. When it's set, the sends go through its ring.
+	 */
+	struct iou_thread			*iou;
+#endif
+
+	/*
+	 * Sends that failed for one destination (e.g. EPERM
+	 * from a firewall rule, ENETUNREACH). @tx_errs is the
+	 * total, @tx_err_log of them were logged in the coarse
+	 * clock second @tx_err_sec.
+	 */
+	uint64_t				tx_errs;
+	time_t					tx_err_sec;
+	uint32_t				tx_err_log;
+
+	/*
+	 * ICMP rate limit, @icmp_tokens are left for the coarse
+	 * clock second @icmp_sec.
+	 */
+	time_t					icmp_sec;
+	uint32_t				icmp_tokens;
+};
+
+
+struct mcast_member {
+	uint32_t				idx;
+	uint32_t				expire;
+};
+
+
+struct mcast_group {
+	uint32_t				addr;
+	uint32_t				nr;
+	uint32_t				cap;
+	struct mcast_member			*mbr;
+};
+
+
+/*
+ * Multicast group membership learned from the IGMP reports of
+ * the clients. Everything is protected by @lock, the reports
+ * and the expiry are rare and a multicast packet only holds
+ * it to copy the member list.
+ *
+ * If a join doesn't fit in @grp, the unknown groups are
+ * flooded until @full_until, so nobody loses traffic.
+ */
+struct mcast_table {
+	struct tmutex				lock;
+	uint32_t				nr;
+	uint32_t				full_until;
+	time_t					next_query;
+	struct mcast_group			grp[MCAST_MAX_GROUPS];
+};
+
+
+/*
+ * Two level timer wheel with one tick per second of the coarse
+ * clock. Level 0 has a slot for each of the next TW_SIZE ticks,
+ * level 1 has a slot for each of the next TW_SIZE blocks of
+ * TW_SIZE ticks, a level 1 slot is moved down to level 0 when
+ * its block starts.
+ *
+ * Each slot is the head of a list of sessions (index plus one,
+ * 0 means empty).
+ */
+struct timer_wheel {
+	/*
+	 * The tick being expired.
+	 */
+	uint32_t				now;
+	uint32_t				slots[TW_LEVELS][TW_SIZE];
 };
 
 
@@ -164,19 +496,167 @@ struct zombie_reaper {
 	_Atomic(bool)				is_online;
 	pthread_t				thread;
 	struct sc_pkt				*pkt;
+
+	/*
+	 * Every live session is armed on @tw with its next
+	 * deadline (timeout or keepalive). The data path only
+	 * bumps @last_act, the reaper re-arms the session when
+	 * the deadline turns out to be stale, so it only ever
+	 * looks at the expired sessions.
+	 */
+	struct timer_wheel			tw;
+	struct tmutex				tw_lock;
+};
+
+
+#ifdef CONFIG_IO_URING
+/*
+ * An io_uring buffer slot and the operation which is in
+ * flight on it (recvmsg() on the UDP fd or read() on a TUN
+ * fd). The slot index is the SQE user_data.
+ */
+struct iou_slot {
+	int					fd;
+	uint8_t					type;
+
+	/*
+	 * Index of @fd in the registered file table.
+	 */
+	uint8_t					fidx;
+	struct msghdr				msg;
+	struct iovec				iov;
+	struct sockaddr_in			saddr;
+};
+
+
+/*
+ * Number of provided buffers for the multishot recvmsg() on
+ * the UDP fd (must be a power of 2).
+ */
+#define IOU_RX_BUFS		256u
+
+/*
+ * Header written by the kernel in front of the payload:
+ * struct iou_recvmsg_out and the source address.
+ */
+#define IOU_RX_HDR_LEN		(sizeof(struct iou_recvmsg_out) + \
+				 sizeof(struct sockaddr_in))
+
+/*
+ * A provided buffer. The kernel writes the header over @pkt.len
+ * and @pkt.headroom, so the payload lands exactly at @pkt.__raw
+ * and can be processed in place like any other struct sc_pkt.
+ */
+struct iou_rx_buf {
+	struct sc_pkt				pkt;
+};
+
+static_assert(offsetof(struct sc_pkt, __raw) >= IOU_RX_HDR_LEN,
+	      "The headroom of struct sc_pkt can't hold IOU_RX_HDR_LEN");
+
+static inline void *iou_rx_buf_hdr(struct iou_rx_buf *buf)
+{
+	return buf->pkt.__raw - IOU_RX_HDR_LEN;
+}
+
+
+/*
+ * A send in flight on the ring, sendmsg() on the UDP fd or
+ * write() on the TUN fd. The payload is a copy in @pb (a buffer
+ * of the thread's packet pool), it's held until the CQE comes.
+ */
+struct iou_tx {
+	struct msghdr				msg;
+	struct iovec				iov;
+	struct sockaddr_in			dst;
+	struct pkt_buf				*pb;
+
+	/*
+	 * Free list link (index in @iou->tx).
+	 */
+	uint32_t				next;
+	uint8_t					type;
 };
 
 
 /*
  * This is a struct for event loop which uses io_uring.
- * (Work in progress...)
+ *
+ * Only the I/O submission and completion live here. The
+ * completed packets are processed on the paired @thread
+ * (struct epl_thread) with the same code as the epoll event
+ * loop, so the session, routing and tx batch logic is shared.
  */
 struct iou_thread {
 	/*
 	 * Pointer to the UDP state struct.
 	 */
 	struct srv_udp_state			*state;
+	struct epl_thread			*thread;
+
+	struct io_uring				ring;
+	bool					ring_init;
+
+	/*
+	 * @fixed_files: the fds are registered, the SQEs refer to
+	 *               them by index (IOSQE_FIXED_FILE).
+	 * @fixed_bufs:  @bufs is registered as buffer index 0 and
+	 *               the thread's packet pool as index 1, the
+	 *               TUN reads and writes use the _fixed() ops.
+	 */
+	bool					fixed_files;
+	bool					fixed_bufs;
+
+	/*
+	 * @bufs[i] is the packet buffer of @slots[i].
+	 */
+	uint16_t				nr_slots;
+	struct sc_pkt				*bufs;
+	struct iou_slot				*slots;
+
+	/*
+	 * Slots which have completed and must be armed again
+	 * after the tx batch is flushed.
+	 */
+	uint16_t				nr_rearm;
+	uint16_t				*rearm;
+
+	/*
+	 * Multishot recvmsg() on the UDP fd with a provided
+	 * buffer ring (thread 0 only). When the kernel doesn't
+	 * support it, @rx_mshot is false and the UDP slots are
+	 * used instead.
+	 *
+	 * @rx_br is shared with the kernel, @rx_bufs[bid] is the
+	 * buffer with ID bid. The used buffers are given back to
+	 * the kernel (@recycle) after the tx batch is flushed.
+	 */
+	bool					rx_mshot;
+	bool					rx_mshot_armed;
+	uint16_t				rx_br_tail;
+	struct iou_buf_ring			*rx_br;
+	struct iou_rx_buf			*rx_bufs;
+	struct msghdr				rx_msg;
+	uint16_t				nr_recycle;
+	uint16_t				recycle[IOU_RX_BUFS];
+
+	/*
+	 * The tx side. @udp_fidx and @tun_fidx are the thread's
+	 * @udp_fd and @tun_fd in the registered file table (added
+	 * to it when the thread doesn't read them).
+	 *
+	 * @tx_free is the head of the free @tx list. @tx_ref[i]
+	 * is the number of @tx using pool buffer i, a broadcast
+	 * sends the same copy to all of its destinations.
+	 */
+	uint8_t					udp_fidx;
+	uint8_t					tun_fidx;
+	uint32_t				nr_tx;
+	uint32_t				tx_free;
+	struct iou_tx				*tx;
+	uint32_t				*tx_ref;
 };
+#endif
 
 
 struct srv_udp_state {
@@ -186,13 +666,6 @@ struct srv_udp_state {
 	 */
 	volatile bool				stop;
 
-	/*
-	 * @in_emergency will be true in case we run out of
-	 * buffer, or when we are in the similar urgent
-	 * situation that needs more attention.
-	 */
-	volatile bool				in_emergency;
-
 	/*
 	 * When we're exiting, the main thread will wait for
 	 * the subthreads to exit for the given timeout. If
@@ -210,6 +683,29 @@ struct srv_udp_state {
 	 */
 	bool					need_remove_iff;
 
+	/*
+	 * @udp_gso is true when we coalesce packets to the same
+	 * client with UDP_SEGMENT. It is turned off at runtime
+	 * if the kernel keeps rejecting GSO sends,
+	 * @udp_gso_fails counts the failures in a row.
+	 */
+	volatile bool				udp_gso;
+	_Atomic(uint32_t)			udp_gso_fails;
+
+	/*
+	 * @udp_gro is true when UDP_GRO is enabled on the
+	 * socket, the receive path must then be ready to get
+	 * several datagrams coalesced into one.
+	 */
+	bool					udp_gro;
+
+	/*
+	 * @tun_offload is true when the TUN fds are opened with
+	 * IFF_VNET_HDR, every frame on them is then prefixed with
+	 * a virtio_net_hdr and may be a TSO super-packet.
+	 */
+	bool					tun_offload;
+
 
 	/*
 	 * @sig should contain signal after signal interrupt
@@ -220,6 +716,22 @@ struct srv_udp_state {
 
 	event_loop_t				evt_loop;
 	int					udp_fd;
+
+	/*
+	 * With @reuseport, every thread has its own UDP socket
+	 * (@udp_fds[i]) bound to the same address and the kernel
+	 * spreads the incoming flows across them. @udp_fds[0] is
+	 * @udp_fd.
+	 */
+	bool					reuseport;
+	int					*udp_fds;
+
+	/*
+	 * With @udp_excl, every epoll thread waits on the single
+	 * @udp_fd with EPOLLEXCLUSIVE, so the kernel wakes one idle
+	 * thread per readiness event.
+	 */
+	bool					udp_excl;
 	struct srv_cfg				*cfg;
 
 	/*
@@ -230,20 +742,44 @@ struct srv_udp_state {
 	struct tmutex				sess_stk_lock;
 
 	/*
-	 * Small hash table for session lookup after recvfrom().
+	 * Hash table for session lookup after recvfrom(). It has
+	 * (@sess_map_mask + 1) slots, a power of two at least twice
+	 * as big as max_conn, so it never gets full.
+	 */
+	struct udp_map_slot			*sess_map;
+	uint32_t				sess_map_mask;
+	uint8_t					sess_map_shift;
+
+	/*
+	 * Inserts and deletes are serialized by @sess_map_lock and
+	 * bump @sess_map_seq (a seqlock, odd while the map is being
+	 * modified). lookup_udp_sess() doesn't take the lock, it
+	 * retries if @sess_map_seq changed under it.
 	 */
-	struct udp_map_bucket			(*sess_map)[0x100];
 	struct tmutex				sess_map_lock;
+	_Atomic(uint32_t)			sess_map_seq;
 
 	/*
 	 * @sess_arr is an array of UDP sessions.
 	 */
 	struct udp_sess				*sess_arr;
+	struct udp_sess_info			*sess_info;
 
 	/*
 	 * Number of active sessions in @sess_arr.
 	 */
-	_Atomic(uint16_t)			n_on_sess;
+	_Atomic(uint32_t)			n_on_sess;
+
+	/*
+	 * Dense list of the authenticated sessions (@sess_arr
+	 * indexes), so a broadcast doesn't have to scan all of
+	 * @sess_arr. Updated with @sess_stk_lock held, a removal
+	 * moves the last entry into the hole. Broadcast reads it
+	 * without the lock, a racing update may make it miss or
+	 * repeat one client for that packet.
+	 */
+	_Atomic(uint32_t)			*auth_list;
+	_Atomic(uint32_t)			nr_auth;
 
 
 	_Atomic(uint16_t)			n_on_threads;
@@ -258,9 +794,22 @@ struct srv_udp_state {
 	int					*tun_fds;
 
 	/*
-	 * Map @ipv4_ff to @sess_arr index.
+	 * Longest prefix match table, maps the private IP address
+	 * of each client (@ipv4_iff, as a /32) and the subnets
+	 * behind it to its @sess_arr index. Lookups are lock-free,
+	 * @route_lock serializes the updates.
 	 */
-	uint16_t				(*ipv4_map)[0x100];
+	struct lpm4				ipv4_routes;
+	struct tmutex				route_lock;
+
+	/*
+	 * Address and broadcast address of the virtual network
+	 * interface (host byte order).
+	 */
+	uint32_t				ipv4_addr;
+	uint32_t				ipv4_bcast;
+
+	struct mcast_table			mcast;
 
 	/*
 	 * Zombie reaper.
@@ -268,46 +817,144 @@ struct srv_udp_state {
 	struct zombie_reaper			zr;
 
 
-	union {
-		/*
-		 * For epoll event loop.
-		 */
-		struct {
-			struct epl_thread	*epl_threads;
-		};
-
+	/*
+	 * The packet processing contexts, one per thread. The
+	 * io_uring event loop uses them too.
+	 */
+	struct epl_thread			*epl_threads;
 
-		/*
-		 * For io_uring event loop.
-		 */
-		struct {
-			struct iou_thread	*iou_threads;
-		};
-	};
+#ifdef CONFIG_IO_URING
+	/*
+	 * For io_uring event loop, @iou_threads[i] is paired
+	 * with @epl_threads[i].
+	 */
+	struct iou_thread			*iou_threads;
+#endif
 };
 
 
-#define W_IP(CLIENT) 	((CLIENT)->str_src_addr), ((CLIENT)->src_port)
-#define W_UN(CLIENT) 	((CLIENT)->username)
+#define W_IP(CLIENT) 	((CLIENT)->info->str_src_addr), ((CLIENT)->src_port)
+#define W_UN(CLIENT) 	((CLIENT)->info->username)
 #define W_IU(CLIENT) 	W_IP(CLIENT), W_UN(CLIENT), ((CLIENT)->idx)
-#define PRWIU 		"%s:%d (%s) (cli_idx=%hu)"
+#define PRWIU 		"%s:%d (%s) (cli_idx=%u)"
 
 
 extern int teavpn2_udp_server_epoll(struct srv_udp_state *state);
 extern int teavpn2_udp_server_io_uring(struct srv_udp_state *state);
+extern int iou_run_event_loop(struct epl_thread *thread);
+extern uint32_t iou_tx_sendto(struct epl_thread *thread, const void *buf,
+			      size_t len, struct udp_sess *const *sess,
+			      uint32_t nr);
+extern int iou_tx_write_tun(struct epl_thread *thread, const void *buf,
+			    size_t len);
+
+/*
+ * Defined in udp_epoll.c, shared with the io_uring event loop.
+ */
+extern int srv_udp_init_threads(struct srv_udp_state *state);
+extern int srv_udp_run_threads(struct srv_udp_state *state);
+extern void srv_udp_destroy_threads(struct srv_udp_state *state);
+extern int srv_udp_handle_pkt(struct epl_thread *thread,
+			      struct sockaddr_in *saddr);
+extern int srv_tun_route_pkt(struct epl_thread *thread, ssize_t len);
+extern int srv_udp_flush(struct epl_thread *thread);
+extern bool srv_tx_err_ratelimit(struct epl_thread *thread);
 extern struct udp_sess *create_udp_sess(struct srv_udp_state *state,
-					uint32_t addr, uint16_t port);
+					uint32_t addr, uint16_t port,
+					uint32_t *gen);
 extern struct udp_sess *lookup_udp_sess(struct srv_udp_state *state,
-					uint32_t addr, uint16_t port);
+					uint32_t addr, uint16_t port,
+					uint32_t *gen);
 extern int delete_udp_session(struct srv_udp_state *state,
-			      struct udp_sess *sess);
+			      struct udp_sess *sess, uint32_t gen);
+extern int udp_sess_set_authenticated(struct srv_udp_state *state,
+				      struct udp_sess *sess, uint32_t gen,
+				      const char *username, uint32_t ipv4_iff,
+				      const struct auth_routes *routes);
+extern int init_udp_mcast(struct srv_udp_state *state);
+extern void destroy_udp_mcast(struct srv_udp_state *state);
+extern void mcast_snoop_igmp(struct srv_udp_state *state,
+			     struct udp_sess *sess, const uint8_t *pkt,
+			     size_t len);
+extern int mcast_get_members(struct srv_udp_state *state, uint32_t group,
+			     uint32_t off, uint32_t *idx, uint32_t max);
+extern void mcast_del_sess(struct srv_udp_state *state, uint32_t idx);
+extern void mcast_expire(struct srv_udp_state *state, uint32_t now);
+extern size_t igmp_query_prep(struct srv_udp_state *state, uint8_t *buf);
+extern void udp_sess_arm_timer(struct srv_udp_state *state,
+			       struct udp_sess *sess, time_t expire);
+extern struct udp_sess *pop_expired_udp_sess(struct srv_udp_state *state,
+					     time_t now, uint32_t *gen);
+
+
+/*
+ * Does the thread @idx receive from the UDP socket? Without
+ * SO_REUSEPORT or EPOLLEXCLUSIVE, only the main thread does.
+ */
+static __always_inline bool srv_thread_recv_udp(struct srv_udp_state *state,
+						uint16_t idx)
+{
+	return state->reuseport || state->udp_excl || idx == 0;
+}
+
+
+/*
+ * Is @err about the UDP socket itself rather than one of the
+ * destinations? Only those are worth stopping the thread for.
+ */
+static __always_inline bool is_udp_fd_err(int err)
+{
+	return err == -EBADF || err == -ENOTSOCK || err == -EFAULT;
+}
+
+
+/*
+ * Is @group in the local network control block (224.0.0.0/24)?
+ * Those groups are always flooded (RFC 4541, 2.1.2), there is
+ * nothing to learn about them, e.g. OSPF and VRRP don't send
+ * IGMP reports.
+ */
+static __always_inline bool mcast_is_local(uint32_t group)
+{
+	return group >= INADDR_UNSPEC_GROUP && group <= INADDR_MAX_LOCAL_GROUP;
+}
 
 
-static __always_inline void reset_udp_session(struct udp_sess *sess, uint16_t idx)
+static __always_inline void reset_udp_session(struct udp_sess *sess, uint32_t idx)
 {
+	struct udp_sess_info *info = sess->info;
+	uint32_t gen = atomic_load_explicit(&sess->gen, memory_order_relaxed);
+
 	memset(sess, 0, sizeof(*sess));
-	sess->username[0] = '_';
+	memset(info, 0, sizeof(*info));
+	info->username[0] = '_';
+	sess->info = info;
 	sess->idx = idx;
+	atomic_store_explicit(&sess->gen, gen, memory_order_relaxed);
+}
+
+
+/*
+ * Internet checksum (RFC 1071) of @len bytes at @buf.
+ */
+static inline uint16_t inet_csum(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t sum = 0;
+
+	while (len > 1) {
+		sum += (uint32_t)((p[0] << 8u) | p[1]);
+		p   += 2;
+		len -= 2;
+	}
+
+	if (len)
+		sum += (uint32_t)(p[0] << 8u);
+
+	while (sum >> 16u)
+		sum = (sum & 0xffffu) + (sum >> 16u);
+
+	return htons((uint16_t)~sum);
 }
 
 
@@ -367,80 +1014,47 @@ static __always_inline size_t srv_pprep_reqsync(struct srv_pkt *srv_pkt)
 }
 
 
-static inline int get_unix_time(time_t *tm)
-{
-	int ret;
-	struct timeval tv;
-	ret = gettimeofday(&tv, NULL);
-	if (unlikely(ret)) {
-		ret = errno;
-		pr_err("gettimeofday(): " PRERF, PREAR(ret));
-		return -ret;
-	}
-	*tm = tv.tv_sec;
-	return ret;
-}
-
-
-static inline int udp_sess_update_last_act(struct udp_sess *sess)
+static inline void udp_sess_update_last_act(struct udp_sess *sess)
 {
-	return get_unix_time(&sess->last_act);
+	sess->last_act = coarse_now();
 }
 
 
 /*
- * The @addr is the private IP address (virtual network interface).
+ * Route @addr/@prefix to the session @idx.
  */
-static inline void add_ipv4_route_map(uint16_t (*ipv4_map)[0x100], uint32_t addr,
-				      uint16_t idx)
+static inline int add_ipv4_route(struct srv_udp_state *state, uint32_t addr,
+				 uint8_t prefix, uint32_t idx)
+	__acquires(&state->route_lock)
+	__releases(&state->route_lock)
 {
-	/*
-	 * IPv4 looks like this:
-	 *     AA.BB.CC.DD
-	 *
-	 * DD is the byte0.
-	 * CC is the byte1.
-	 */
-
-	uint16_t byte0, byte1;
+	int ret;
 
-	byte0 = (addr >> 0u) & 0xffu;
-	byte1 = (addr >> 8u) & 0xffu;
-	ipv4_map[byte0][byte1] = idx + 1u;
+	mutex_lock(&state->route_lock);
+	ret = lpm4_add(&state->ipv4_routes, addr, prefix, idx);
+	mutex_unlock(&state->route_lock);
+	return ret;
 }
 
 
-static inline void del_ipv4_route_map(uint16_t (*ipv4_map)[0x100], uint32_t addr)
+static inline void del_ipv4_route(struct srv_udp_state *state, uint32_t addr,
+				  uint8_t prefix)
+	__acquires(&state->route_lock)
+	__releases(&state->route_lock)
 {
-	/*
-	 * IPv4 looks like this:
-	 *     AA.BB.CC.DD
-	 *
-	 * DD is the byte0
-	 * CC is the byte1
-	 */
-
-	uint16_t byte0, byte1;
-
-	byte0 = (addr >> 0u) & 0xffu;
-	byte1 = (addr >> 8u) & 0xffu;
-	ipv4_map[byte0][byte1] = 0;
+	mutex_lock(&state->route_lock);
+	lpm4_del(&state->ipv4_routes, addr, prefix);
+	mutex_unlock(&state->route_lock);
 }
 
 
-static inline int32_t get_ipv4_route_map(uint16_t (*ipv4_map)[0x100], uint32_t addr)
+/*
+ * Returns the session index the @addr is routed to, or -ENOENT.
+ */
+static __always_inline int32_t get_ipv4_route(struct srv_udp_state *state,
+					      uint32_t addr)
 {
-	uint16_t ret, byte0, byte1;
-
-	byte0 = (addr >> 0u) & 0xffu;
-	byte1 = (addr >> 8u) & 0xffu;
-	ret   = ipv4_map[byte0][byte1];
-
-	if (ret == 0)
-		/* Unmapped address. */
-		return -ENOENT;
-
-	return (int32_t)(ret - 1);
+	return lpm4_lookup(&state->ipv4_routes, addr);
 }
 
 #endif /* #ifndef TEAVPN2__SERVER__LINUX__UDP_H */
@@ -3,7 +3,6 @@
  * Copyright (C) 2021  Ammar Faizi
  */
 
-#include <poll.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
@@ -11,6 +10,14 @@
 #include <teavpn2/net/linux/iface.h>
 #include <teavpn2/server/linux/udp.h>
 
+/*
+ * Not from <netinet/ip_icmp.h>, its struct iphdr clashes with
+ * <linux/ip.h>.
+ */
+#define ICMP_ECHO		8u
+#define ICMP_DEST_UNREACH	3u
+#define ICMP_HOST_UNREACH	1u
+
 
 static __cold int create_epoll_fd(void)
 {
@@ -66,16 +73,26 @@ static __cold int init_epoll_fd_add(struct srv_udp_state *state,
 
 	memset(&data, 0, sizeof(data));
 
-	if (thread->idx == 0) {
+	if (srv_thread_recv_udp(state, thread->idx)) {
 		/*
-		 * Main thread is responsible to handle data
-		 * from UDP socket.
+		 * Main thread is responsible to handle data from
+		 * UDP socket. With SO_REUSEPORT, every thread reads
+		 * its own UDP socket. With EPOLLEXCLUSIVE, every
+		 * thread waits on the shared one (EPOLLPRI is not
+		 * allowed there).
 		 */
-		data.fd = state->udp_fd;
-		ret = epoll_add(thread, data.fd, events, data);
+		uint32_t udp_events = events;
+
+		if (state->udp_excl)
+			udp_events = EPOLLIN | EPOLLEXCLUSIVE;
+
+		data.fd = thread->udp_fd;
+		ret = epoll_add(thread, data.fd, udp_events, data);
 		if (unlikely(ret))
 			return ret;
+	}
 
+	if (thread->idx == 0) {
 		if (nn == 1) {
 			/*
 			 * If we are single-threaded, the main thread
@@ -109,30 +126,20 @@ static __cold int init_epoll_fd_add(struct srv_udp_state *state,
 }
 
 
-static int wait_for_fd_be_writable(int fd, int timeout)
+static int epoll_del(struct epl_thread *thread, int fd)
 {
 	int ret;
-	struct pollfd fds[1];
-	const nfds_t nfds = 1;
-
-	fds[0].fd = fd;
-	fds[0].events = POLLOUT;
-	fds[0].revents = 0;
-
-	ret = poll(fds, nfds, timeout);
-	if (ret <= 0) {
-
-		if (ret == 0)
-			return -ETIMEDOUT;
+	int epoll_fd = thread->epoll_fd;
 
+	ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	if (unlikely(ret < 0)) {
 		ret = errno;
-		if (ret != EINTR)
-			pr_err("poll(): " PRERF, PREAR(ret));
-
-		return -ret;
+		pr_err("epoll_ctl(%d, EPOLL_CTL_DEL, %d, NULL): " PRERF,
+			epoll_fd, fd, PREAR(ret));
+		ret = -ret;
 	}
 
-	return 0;
+	return ret;
 }
 
 
@@ -141,6 +148,13 @@ static __cold int init_epoll_thread(struct srv_udp_state *state,
 {
 	int ret;
 
+	/*
+	 * The io_uring event loop only uses the packet
+	 * processing part of the thread.
+	 */
+	if (state->evt_loop == EVTL_IO_URING)
+		return 0;
+
 	ret = create_epoll_fd();
 	if (unlikely(ret < 0))
 		return ret;
@@ -152,6 +166,189 @@ static __cold int init_epoll_thread(struct srv_udp_state *state,
 }
 
 
+static __cold uint16_t get_recv_batch(struct srv_udp_state *state)
+{
+	uint16_t nr = state->cfg->sock.recv_batch;
+
+	if (nr == 0)
+		return 1u;
+
+	if (nr > UDP_RECV_BATCH_MAX) {
+		pr_warn("recv_batch is too big (%hu), capping it to %u", nr,
+			UDP_RECV_BATCH_MAX);
+		return UDP_RECV_BATCH_MAX;
+	}
+
+	return nr;
+}
+
+
+static __cold int init_recv_batch(struct srv_udp_state *state,
+				  struct epl_thread *thread)
+{
+	int ret;
+	uint16_t i, nr;
+	char *gro_buf = NULL;
+	struct sc_pkt **pkts = thread->pkts;
+
+	/*
+	 * Besides the burst, the pool backs the packets parked in
+	 * the two tx queues (in flight on the ring with io_uring).
+	 */
+	nr = get_recv_batch(state);
+	ret = pkt_pool_init(&thread->pool, (uint32_t)nr +
+				       2u * state->cfg->sock.txq_len);
+	if (unlikely(ret))
+		return ret;
+
+	if (state->udp_gro) {
+		gro_buf = al4096_malloc_mmap((size_t)nr * UDP_GRO_BUF_SIZE);
+		if (unlikely(!gro_buf)) {
+			ret = errno;
+			pkt_pool_destroy(&thread->pool);
+			return -ret;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct msghdr *hdr = &thread->rx_msgs[i].msg_hdr;
+
+		pkts[i] = pkt_pool_get(&thread->pool);
+		if (gro_buf) {
+			thread->rx_iovs[i].iov_base = &gro_buf[(size_t)i *
+							       UDP_GRO_BUF_SIZE];
+			thread->rx_iovs[i].iov_len  = UDP_GRO_BUF_SIZE;
+		} else {
+			thread->rx_iovs[i].iov_base = pkts[i]->__raw;
+			thread->rx_iovs[i].iov_len  = sizeof(pkts[i]->__raw);
+		}
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name    = &thread->rx_saddrs[i];
+		hdr->msg_namelen = sizeof(thread->rx_saddrs[i]);
+		hdr->msg_iov     = &thread->rx_iovs[i];
+		hdr->msg_iovlen  = 1;
+		if (gro_buf)
+			hdr->msg_control = thread->rx_cmsg[i].buf;
+	}
+
+	thread->rx_gro_buf = gro_buf;
+
+	thread->pkt          = pkts[0];
+	thread->recv_batch   = nr;
+	thread->event_budget = state->cfg->sock.event_budget;
+	if (thread->event_budget < nr)
+		thread->event_budget = nr;
+	return 0;
+}
+
+
+static __cold int init_tun_offload(struct epl_thread *thread)
+{
+	uint8_t *buf;
+
+	buf = al4096_malloc_mmap(TUN_OFFLOAD_BUF_SIZE);
+	if (unlikely(!buf))
+		return -errno;
+
+	thread->tun_rx_buf = buf;
+
+	buf = al4096_malloc_mmap(TUN_OFFLOAD_BUF_SIZE);
+	if (unlikely(!buf))
+		return -errno;
+
+	thread->tun_gro.buf = buf;
+	tun_gro_reset(&thread->tun_gro);
+	return 0;
+}
+
+
+/*
+ * The io_uring event loop uses blocking fds, it never sees
+ * EAGAIN, so its queues stay disabled (@max is 0).
+ */
+static __cold int init_tx_queue(struct epl_thread *thread, struct tx_queue *q,
+				int fd)
+{
+	int ret;
+	struct srv_udp_state *state = thread->state;
+
+	memset(q, 0, sizeof(*q));
+	q->fd  = fd;
+	q->wfd = -1;
+	if (state->evt_loop == EVTL_IO_URING)
+		return 0;
+
+	q->wfd = dup(fd);
+	if (unlikely(q->wfd < 0)) {
+		ret = errno;
+		pr_err("dup(%d): " PRERF, fd, PREAR(ret));
+		return -ret;
+	}
+
+	q->max = state->cfg->sock.txq_len;
+	return 0;
+}
+
+
+/*
+ * Count a send that failed for one destination. Returns true
+ * if it should be logged (at most UDP_TX_ERR_LOG a second).
+ */
+__cold bool srv_tx_err_ratelimit(struct epl_thread *thread)
+{
+	time_t now = coarse_now();
+
+	thread->tx_errs++;
+
+	if (thread->tx_err_sec != now) {
+		thread->tx_err_sec = now;
+		thread->tx_err_log = 0;
+	}
+
+	if (thread->tx_err_log >= UDP_TX_ERR_LOG)
+		return false;
+
+	thread->tx_err_log++;
+	return true;
+}
+
+
+/*
+ * A send to @sess failed with @err. Returns @err if the socket
+ * is broken, or 0 if only this destination failed.
+ */
+static __cold int tx_dst_err(struct epl_thread *thread, struct udp_sess *sess,
+			     int err)
+{
+	if (unlikely(is_udp_fd_err(err))) {
+		pr_err("[thread=%hu] sendmmsg(udp_fd=%d): " PRERF,
+		       thread->idx, thread->udp_fd, PREAR(-err));
+		return err;
+	}
+
+	if (srv_tx_err_ratelimit(thread))
+		pr_err("[thread=%hu] sendmmsg() " PRWIU " " PRERF,
+		       thread->idx, W_IU(sess), PREAR(-err));
+
+	return 0;
+}
+
+
+static __cold void destroy_tx_queue(struct epl_thread *thread,
+				    struct tx_queue *q, const char *name)
+{
+	if (q->dropped)
+		prl_notice(2, "[thread=%hu] %s tx queue dropped %" PRIu64
+			   " packet(s)", thread->idx, name, q->dropped);
+
+	if (q->wfd != -1) {
+		close(q->wfd);
+		q->wfd = -1;
+	}
+}
+
+
 static __cold int init_epoll_thread_array(struct srv_udp_state *state)
 {
 	int ret = 0;
@@ -181,32 +378,47 @@ static __cold int init_epoll_thread_array(struct srv_udp_state *state)
 		threads[i].idx = i;
 		threads[i].state = state;
 		threads[i].epoll_fd = -1;
+		threads[i].udp_fd = state->reuseport ? state->udp_fds[i] :
+						       state->udp_fd;
+		threads[i].tun_fd = state->tun_fds[i];
+		threads[i].udp_txq.wfd = -1;
+		threads[i].tun_txq.wfd = -1;
 	}
 
 	for (i = 0; i < nn; i++) {
-		struct sc_pkt *pkt;
-
 		ret = init_epoll_thread(state, &threads[i]);
 		if (unlikely(ret))
 			return ret;
 
-		pkt = al4096_malloc_mmap(sizeof(*pkt));
-		if (unlikely(!pkt))
-			return -errno;
+		ret = init_recv_batch(state, &threads[i]);
+		if (unlikely(ret))
+			return ret;
 
-		threads[i].pkt = pkt;
+		ret = init_tx_queue(&threads[i], &threads[i].udp_txq,
+				    threads[i].udp_fd);
+		if (unlikely(ret))
+			return ret;
+
+		ret = init_tx_queue(&threads[i], &threads[i].tun_txq,
+				    threads[i].tun_fd);
+		if (unlikely(ret))
+			return ret;
+
+		if (state->tun_offload) {
+			ret = init_tun_offload(&threads[i]);
+			if (unlikely(ret))
+				return ret;
+		}
 	}
 
 	return 0;
 }
 
 
-static __hot ssize_t _send_to_client(struct srv_udp_state *state,
-				     const void *buf, size_t pkt_len,
-				     struct sockaddr *dst_addr)
+static __hot ssize_t _send_to_client(int udp_fd, const void *buf,
+				     size_t pkt_len, struct sockaddr *dst_addr)
 {
 	ssize_t send_ret;
-	int udp_fd = state->udp_fd;
 	const socklen_t addr_len = sizeof(struct sockaddr_in);
 
 	if (unlikely(pkt_len == 0))
@@ -228,63 +440,159 @@ static __hot ssize_t _send_to_client(struct srv_udp_state *state,
 }
 
 
-static int emergency_wait_for_tun_fd_be_writable(struct epl_thread *thread,
-						 int tun_fd)
+static __cold int txq_arm(struct epl_thread *thread, struct tx_queue *q)
 {
 	int ret;
-	const int timeout = 30000;
-	struct srv_udp_state *state = thread->state;
+	epoll_data_t data;
 
-	pr_emerg("[thread=%hu] write(tun_fd=%d) got EAGAIN", thread->idx,
-		 tun_fd);
+	memset(&data, 0, sizeof(data));
+	data.fd = q->wfd;
+	ret = epoll_add(thread, q->wfd, EPOLLOUT, data);
+	if (likely(!ret))
+		q->armed = true;
 
-	state->in_emergency = true;
-	if (state->stop)
-		goto give_up;
+	return ret;
+}
 
-	pr_emerg("[thread=%hu] Sleeping on poll(), waiting for tun_fd be "
-		 "writable...", thread->idx);
 
-	ret = wait_for_fd_be_writable(tun_fd, timeout);
-	if (ret == 0)
-		return ret;
+static __cold void txq_disarm(struct epl_thread *thread, struct tx_queue *q)
+{
+	if (!q->armed)
+		return;
+
+	epoll_del(thread, q->wfd);
+	q->armed = false;
+}
 
-	state->stop = true;
-	pr_err("wait_for_fd_be_writable(): " PRERF, PREAR(-ret));
 
-give_up:
-	pr_emerg("Giving up...");
-	return -ENETDOWN;
+static __hot struct pkt_buf *txq_pop(struct tx_queue *q)
+{
+	struct pkt_buf *pb = q->head;
+
+	q->head = pb->next;
+	if (!q->head)
+		q->tail = NULL;
+
+	q->nr--;
+	return pb;
 }
 
 
-static int emergency_wait_for_udp_fd_be_writable(struct epl_thread *thread)
+static __cold void txq_purge(struct epl_thread *thread, struct tx_queue *q)
 {
-	int ret;
-	const int timeout = 30000;
-	int udp_fd = thread->state->udp_fd;
-	struct srv_udp_state *state = thread->state;
+	while (q->head) {
+		q->dropped++;
+		pkt_pool_put(&thread->pool, &txq_pop(q)->pkt);
+	}
+	txq_disarm(thread, q);
+}
 
-	pr_emerg("[thread=%hu] sendto(udp_fd=%d) got EAGAIN", thread->idx,
-		 udp_fd);
 
-	state->in_emergency = true;
-	if (state->stop)
-		goto give_up;
+/*
+ * Park a copy of @buf at the tail of @q, to be written by
+ * txq_flush() once the fd is writable. For the UDP queue, the
+ * address of @sess is copied too, the session may be deleted
+ * and its slot reused before the packet goes out. @sess is
+ * NULL for the TUN queue.
+ *
+ * Returns false if the packet is dropped.
+ */
+static __hot bool txq_push(struct epl_thread *thread, struct tx_queue *q,
+			   struct udp_sess *sess, const void *buf, size_t len)
+{
+	struct pkt_buf *pb;
+	struct sc_pkt *pkt;
 
-	pr_emerg("[thread=%hu] Sleeping on poll(), waiting for udp_fd be "
-		 "writable...", thread->idx);
+	if (unlikely(q->max == 0 || len > sizeof(pkt->__raw)))
+		goto drop;
 
-	ret = wait_for_fd_be_writable(udp_fd, timeout);
-	if (ret == 0)
-		return ret;
+	if (q->nr == q->max) {
+		if (!thread->state->cfg->sock.txq_drop_head)
+			goto drop;
+
+		/*
+		 * Drop the oldest packet and reuse its buffer.
+		 */
+		q->dropped++;
+		pb = txq_pop(q);
+	} else {
+		pkt = pkt_pool_get(&thread->pool);
+		if (unlikely(!pkt))
+			goto drop;
+		pb = pkt_to_buf(pkt);
+	}
+
+	pkt = &pb->pkt;
+	memcpy(pkt->__raw, buf, len);
+	pkt->len = len;
+	if (sess)
+		pb->dst = sess->addr;
+	pb->next = NULL;
 
-	state->stop = true;
-	pr_err("wait_for_fd_be_writable(): " PRERF, PREAR(-ret));
+	if (q->tail)
+		q->tail->next = pb;
+	else
+		q->head = pb;
+
+	q->tail = pb;
+	q->nr++;
+
+	if (likely(q->armed))
+		return true;
 
-give_up:
-	pr_emerg("Giving up...");
-	return -ENETDOWN;
+	prl_notice(4, "[thread=%hu] fd=%d got EAGAIN, queueing packets...",
+		   thread->idx, q->fd);
+
+	if (unlikely(txq_arm(thread, q))) {
+		txq_purge(thread, q);
+		return false;
+	}
+
+	return true;
+
+drop:
+	q->dropped++;
+	return false;
+}
+
+
+/*
+ * Write the parked packets of @q in order. Stop at the first
+ * EAGAIN and keep waiting for EPOLLOUT. A packet that fails with
+ * another error is dropped.
+ */
+static __hot int txq_flush(struct epl_thread *thread, struct tx_queue *q)
+{
+	const bool is_udp = (q == &thread->udp_txq);
+
+	while (q->head) {
+		ssize_t ret;
+		struct pkt_buf *pb = q->head;
+		struct sc_pkt *pkt = &pb->pkt;
+
+		if (is_udp) {
+			ret = _send_to_client(q->fd, pkt->__raw, pkt->len,
+					      (struct sockaddr *)&pb->dst);
+		} else {
+			ret = __sys_write(q->fd, pkt->__raw, pkt->len);
+			if (unlikely(ret < 0 && ret != -EAGAIN))
+				pr_err("[thread=%hu] write(tun_fd=%d): " PRERF,
+				       thread->idx, q->fd, PREAR((int)-ret));
+		}
+
+		if (ret == -EAGAIN)
+			return 0;
+
+		if (unlikely(ret < 0))
+			q->dropped++;
+
+		pkt_pool_put(&thread->pool, &txq_pop(q)->pkt);
+	}
+
+	prl_notice(4, "[thread=%hu] fd=%d queue is drained", thread->idx,
+		   q->fd);
+	txq_disarm(thread, q);
+	return 0;
 }
 
 
@@ -295,93 +603,287 @@ static __hot ssize_t send_to_client(struct epl_thread *thread,
 	ssize_t send_ret;
 	struct sockaddr *dst_addr = (struct sockaddr *)&sess->addr;
 
-send_again:
-	send_ret = _send_to_client(thread->state, buf, pkt_len, dst_addr);
-	if (unlikely(send_ret < 0)) {
+#ifdef CONFIG_IO_URING
+	if (thread->iou && iou_tx_sendto(thread, buf, pkt_len, &sess, 1))
+		return (ssize_t)pkt_len;
+#endif
 
-		if (send_ret == -EAGAIN) {
-			int ret = emergency_wait_for_udp_fd_be_writable(thread);
-			if (ret == 0)
-				goto send_again;
+	/*
+	 * Don't overtake the parked packets.
+	 */
+	if (unlikely(thread->udp_txq.nr))
+		goto park;
 
-			return ret;
-		}
+	send_ret = _send_to_client(thread->udp_fd, buf, pkt_len, dst_addr);
+	if (unlikely(send_ret < 0)) {
+
+		if (send_ret == -EAGAIN)
+			goto park;
 
 		pr_err("[thread=%hu] send_to_client() " PRWIU " " PRERF,
 		       thread->idx, W_IU(sess), PREAR((int)send_ret));
 		return send_ret;
 	}
 
-	thread->state->in_emergency = false;
 	pr_debug("[thread=%hu] sendto(udp_fd=%d) %zd bytes to " PRWIU,
-		 thread->idx, thread->state->udp_fd, send_ret, W_IU(sess));
+		 thread->idx, thread->udp_fd, send_ret, W_IU(sess));
 
 	return send_ret;
+
+park:
+	txq_push(thread, &thread->udp_txq, sess, buf, pkt_len);
+	return (ssize_t)pkt_len;
+}
+
+
+/*
+ * Queue @buf to be sent to @sess on the next flush_tx_batch()
+ * call. The caller must make sure @buf stays valid until then
+ * and that the queue is not full.
+ */
+static __hot void tx_batch_add(struct epl_thread *thread, struct udp_sess *sess,
+			       void *buf, size_t len)
+{
+	uint16_t n = thread->tx_nr++;
+
+	thread->tx_iovs[n].iov_base = buf;
+	thread->tx_iovs[n].iov_len  = len;
+	thread->tx_sess[n]          = sess;
+}
+
+
+/*
+ * Build the sendmmsg() vector from the queued buffers in
+ * [@i, @nr). Returns the number of built messages.
+ */
+static __hot uint16_t tx_build_msgs(struct epl_thread *thread, uint16_t i,
+				    uint16_t nr)
+{
+	uint16_t n = 0;
+	const bool gso = thread->state->udp_gso && !thread->tx_no_gso;
+
+	while (i < nr) {
+		uint16_t j, cnt = 1;
+		struct udp_sess *sess = thread->tx_sess[i];
+		struct msghdr *hdr = &thread->tx_msgs[n].msg_hdr;
+
+		if (gso) {
+			for (j = i + 1; j < nr; j++) {
+				if (thread->tx_sess[j] != sess)
+					break;
+			}
+			cnt = udp_gso_count_segs(&thread->tx_iovs[i], j - i);
+		}
+
+		hdr->msg_name       = &sess->addr;
+		hdr->msg_namelen    = sizeof(sess->addr);
+		hdr->msg_iov        = &thread->tx_iovs[i];
+		hdr->msg_iovlen     = cnt;
+		hdr->msg_control    = NULL;
+		hdr->msg_controllen = 0;
+		hdr->msg_flags      = 0;
+
+		if (cnt > 1) {
+			uint16_t seg = (uint16_t)thread->tx_iovs[i].iov_len;
+			udp_gso_set_cmsg(hdr, &thread->tx_cmsg[n], seg);
+		}
+
+		i = (uint16_t)(i + cnt);
+		n++;
+	}
+
+	return n;
+}
+
+
+/*
+ * The kernel refused a GSO send. It may be one bad train (too
+ * many segments, odd size), so the batch is sent again without
+ * UDP_SEGMENT first. GSO is turned off only when it keeps
+ * failing.
+ */
+static __cold void udp_gso_fallback(struct epl_thread *thread, int err)
+{
+	struct srv_udp_state *state = thread->state;
+	uint32_t fails;
+
+	thread->tx_no_gso = true;
+	fails = atomic_fetch_add(&state->udp_gso_fails, 1u) + 1u;
+	pr_debug("[thread=%hu] UDP GSO send failed (%u in a row): " PRERF,
+		 thread->idx, fails, PREAR(-err));
+	if (fails < UDP_GSO_MAX_FAILS || !state->udp_gso)
+		return;
+
+	state->udp_gso = false;
+	pr_warn("[thread=%hu] UDP GSO send is rejected by the kernel: " PRERF,
+		thread->idx, PREAR(-err));
+	pr_warn("Disabling UDP GSO, falling back to plain sendmmsg()...");
+}
+
+
+/*
+ * A GSO send went through, the failures are not in a row
+ * anymore.
+ */
+static __hot void udp_gso_ok(struct epl_thread *thread,
+			     const struct mmsghdr *msgs, int nr)
+{
+	struct srv_udp_state *state = thread->state;
+	int i;
+
+	if (likely(!atomic_load_explicit(&state->udp_gso_fails,
+					 memory_order_relaxed)))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		if (udp_gso_msg_has_cmsg(&msgs[i].msg_hdr)) {
+			atomic_store(&state->udp_gso_fails, 0u);
+			return;
+		}
+	}
+}
+
+
+/*
+ * Send all queued packets with sendmmsg().
+ *
+ * A message that fails with an error other than EAGAIN is
+ * skipped, so one bad destination does not drop the rest of
+ * the burst. Only an error of the socket itself is returned.
+ *
+ * On EAGAIN (or if there are parked packets already), the rest
+ * of the batch is parked in @thread->udp_txq.
+ */
+static __hot int flush_tx_batch(struct epl_thread *thread)
+{
+	int ret, err = 0;
+	uint16_t i = 0, nr = thread->tx_nr;
+	int udp_fd = thread->udp_fd;
+	struct mmsghdr *msgs = thread->tx_msgs;
+
+#ifdef CONFIG_IO_URING
+	/*
+	 * Hand them to the ring, what it has no room for is sent
+	 * below.
+	 */
+	while (thread->iou && i < nr &&
+	       iou_tx_sendto(thread, thread->tx_iovs[i].iov_base,
+			     thread->tx_iovs[i].iov_len, &thread->tx_sess[i],
+			     1))
+		i++;
+#endif
+
+	if (unlikely(thread->udp_txq.nr))
+		goto park;
+
+	while (i < nr) {
+		uint16_t j, n_msgs;
+
+		n_msgs = tx_build_msgs(thread, i, nr);
+		ret = __sys_sendmmsg(udp_fd, msgs, n_msgs, 0);
+		if (likely(ret > 0)) {
+			pr_debug("[thread=%hu] sendmmsg(udp_fd=%d) %d message(s)",
+				 thread->idx, udp_fd, ret);
+			udp_gso_ok(thread, msgs, ret);
+			for (j = 0; j < (uint16_t)ret; j++)
+				i = (uint16_t)(i + msgs[j].msg_hdr.msg_iovlen);
+			continue;
+		}
+
+		if (ret == -EAGAIN)
+			goto park;
+
+		if ((ret == -EIO || ret == -EINVAL) &&
+		    udp_gso_msg_has_cmsg(&msgs[0].msg_hdr)) {
+			/*
+			 * The kernel (or the NIC) can't segment it.
+			 * Rebuild the rest without coalescing and
+			 * send again.
+			 */
+			udp_gso_fallback(thread, ret);
+			continue;
+		}
+
+		err = tx_dst_err(thread, thread->tx_sess[i], ret);
+		if (unlikely(err))
+			break;
+
+		i = (uint16_t)(i + msgs[0].msg_hdr.msg_iovlen);
+	}
+
+	thread->tx_nr = 0;
+	thread->tx_no_gso = false;
+	return err;
+
+park:
+	for (; i < nr; i++) {
+		struct iovec *iov = &thread->tx_iovs[i];
+
+		txq_push(thread, &thread->udp_txq, thread->tx_sess[i],
+			 iov->iov_base, iov->iov_len);
+	}
+
+	thread->tx_nr = 0;
+	thread->tx_no_gso = false;
+	return err;
 }
 
 
-static int close_udp_session(struct epl_thread *thread, struct udp_sess *sess)
+static int close_udp_session(struct epl_thread *thread, struct udp_sess *sess,
+			     uint32_t gen)
 {
 	size_t send_len;
 	struct srv_pkt *srv_pkt = &thread->pkt->srv;
 
 	prl_notice(2, "Closing connection from " PRWIU "...", W_IU(sess));
 
-	if (sess->ipv4_iff != 0)
-		del_ipv4_route_map(thread->state->ipv4_map, sess->ipv4_iff);
-
 	send_len = srv_pprep(srv_pkt, TSRV_PKT_CLOSE, 0, 0);
 	send_to_client(thread, sess, srv_pkt, send_len);
-	return delete_udp_session(thread->state, sess);
+	return delete_udp_session(thread->state, sess, gen);
 }
 
 
-static __hot ssize_t _do_recv_from(int udp_fd, char *buf, size_t recv_size,
-				   struct sockaddr *src_addr,
-				   socklen_t *saddr_len)
+/*
+ * Pull up to @thread->recv_batch datagrams from the UDP socket.
+ *
+ * Returns the number of received datagrams, 0 if there is
+ * nothing to read, or -errno on error.
+ */
+static __hot int do_recv_mmsg(struct epl_thread *thread, int udp_fd)
 {
-	ssize_t recv_ret;
+	int ret;
+	uint16_t i, nr = thread->recv_batch;
+	struct mmsghdr *msgs = thread->rx_msgs;
 
-	if (unlikely(recv_size == 0))
-		return 0;
+	for (i = 0; i < nr; i++) {
+		msgs[i].msg_hdr.msg_namelen = sizeof(thread->rx_saddrs[i]);
+		if (!thread->rx_gro_buf)
+			thread->rx_iovs[i].iov_base = thread->pkts[i]->__raw;
+		else
+			msgs[i].msg_hdr.msg_controllen =
+				sizeof(thread->rx_cmsg[i].buf);
+	}
 
-	recv_ret = __sys_recvfrom(udp_fd, buf, recv_size, 0, src_addr, saddr_len);
-	if (unlikely(recv_ret < 0)) {
+	ret = __sys_recvmmsg(udp_fd, msgs, nr, MSG_DONTWAIT, NULL);
+	if (unlikely(ret <= 0)) {
 
-		if (recv_ret == 0) {
+		if (ret == 0) {
 			pr_err("UDP socket has been disconnected!");
 			return -ENETDOWN;
 		}
 
-		if (recv_ret == -EAGAIN)
+		if (ret == -EAGAIN)
 			return 0;
 
-		pr_err("recvfrom(udp_fd) (fd=%d): " PRERF, udp_fd,
-		       PREAR((int)-recv_ret));
+		pr_err("recvmmsg(udp_fd) (fd=%d): " PRERF, udp_fd,
+		       PREAR(-ret));
+		return ret;
 	}
 
-	return recv_ret;
-}
-
-
-static __hot ssize_t do_recv_from(struct epl_thread *thread,
-				  int udp_fd, struct sockaddr_in *saddr,
-				  socklen_t *saddr_len)
-{
-	ssize_t recv_ret;
-	char *buf = thread->pkt->__raw;
-	struct sockaddr *src_addr = (struct sockaddr *)saddr;
-	const size_t recv_size = sizeof(thread->pkt->cli.__raw);
-
-	recv_ret = _do_recv_from(udp_fd, buf, recv_size, src_addr, saddr_len);
-	if (unlikely(recv_ret < 0))
-		return recv_ret;
+	pr_debug("[thread=%hu] recvmmsg(udp_fd=%d) %d packet(s)", thread->idx,
+		 udp_fd, ret);
 
-	thread->pkt->len = (size_t)recv_ret;
-	pr_debug("[thread=%hu] recvfrom(udp_fd=%d) %zd bytes", thread->idx,
-		 udp_fd, recv_ret);
-
-	return recv_ret;
+	return ret;
 }
 
 
@@ -505,7 +1007,7 @@ static __cold int _handle_new_client(struct epl_thread *thread,
 		/*
 		 * Handshake failed, drop the client session!
 		 */
-		close_udp_session(thread, sess);
+		close_udp_session(thread, sess, thread->sess_gen);
 
 		/*
 		 * If the handle_client_handshake() returns -EBADMSG,
@@ -541,7 +1043,7 @@ static __cold int handle_new_client(struct epl_thread *thread, uint32_t addr,
 	if (skip_session_creation(thread))
 		return 0;
 
-	sess = create_udp_sess(thread->state, addr, port);
+	sess = create_udp_sess(thread->state, addr, port, &thread->sess_gen);
 	if (unlikely(!sess)) {
 		ret = errno;
 		return (ret == EAGAIN) ? 0 : -ret;
@@ -549,11 +1051,16 @@ static __cold int handle_new_client(struct epl_thread *thread, uint32_t addr,
 	sess->addr = *saddr;
 
 #ifndef NDEBUG
-	/*
-	 * After calling create_udp_sess(), we must have it
-	 * on the map. If we don't have, then it's a bug!
-	 */
-	BUG_ON(lookup_udp_sess(thread->state, addr, port) != sess);
+	{
+		uint32_t gen;
+
+		/*
+		 * After calling create_udp_sess(), we must have it
+		 * on the map. If we don't have, then it's a bug!
+		 */
+		BUG_ON(lookup_udp_sess(thread->state, addr, port,
+				       &gen) != sess);
+	}
 #endif
 	return _handle_new_client(thread, sess);
 }
@@ -569,6 +1076,7 @@ static __cold int handle_clpkt_auth(struct epl_thread *thread,
 	struct cli_pkt *cli_pkt = &thread->pkt->cli;
 	struct pkt_auth_res *auth_res = &srv_pkt->auth_res;
 	struct pkt_auth auth = cli_pkt->auth;
+	struct auth_routes routes;
 
 	if (sess->is_authenticated) {
 		/*
@@ -585,7 +1093,8 @@ static __cold int handle_clpkt_auth(struct epl_thread *thread,
 	prl_notice(2, "Got auth packet from (user: %s) " PRWIU, auth.username,
 		   W_IU(sess));
 
-	if (!teavpn2_auth(auth.username, auth.password, &auth_res->iff))
+	if (!teavpn2_auth(auth.username, auth.password, &auth_res->iff,
+			  &routes))
 		goto reject;
 
 	/*
@@ -595,15 +1104,20 @@ static __cold int handle_clpkt_auth(struct epl_thread *thread,
 	send_ret = send_to_client(thread, sess, srv_pkt, send_len);
 	if (unlikely(send_ret < 0)) {
 		ret = (int)send_ret;
-		close_udp_session(thread, sess);
+		close_udp_session(thread, sess, thread->sess_gen);
 		goto out;
 	}
 
-	sess->ipv4_iff = ntohl(inet_addr(auth_res->iff.ipv4));
-	add_ipv4_route_map(thread->state->ipv4_map, sess->ipv4_iff, sess->idx);
+	ret = udp_sess_set_authenticated(thread->state, sess,
+					 thread->sess_gen, auth.username,
+					 ntohl(inet_addr(auth_res->iff.ipv4)),
+					 &routes);
+	if (unlikely(ret)) {
+		/* Deleted by another thread, nothing to do. */
+		ret = 0;
+		goto out;
+	}
 
-	sess->is_authenticated = true;
-	strncpy2(sess->username, auth.username, sizeof(sess->username));
 	prl_notice(2, "Assigning private IP %s to " PRWIU "...",
 		   auth_res->iff.ipv4, W_IU(sess));
 	goto out;
@@ -620,7 +1134,7 @@ reject:
 
 	prl_notice(2, "Authentication failed for username \"%s\" " PRWIU,
 		   auth.username, W_IU(sess));
-	close_udp_session(thread, sess);
+	close_udp_session(thread, sess, thread->sess_gen);
 
 
 out:
@@ -658,24 +1172,162 @@ static __hot ssize_t _handle_clpkt_tun_data(struct epl_thread *thread,
 }
 
 
+/*
+ * Length of the TUN data in @thread->pkt, capped to what was
+ * actually received.
+ */
+static __always_inline size_t clpkt_tun_data_len(struct epl_thread *thread)
+{
+	struct sc_pkt *pkt = thread->pkt;
+	size_t len = ntohs(pkt->cli.len);
+
+	if (unlikely(pkt->len < PKT_MIN_LEN))
+		return 0;
+	if (len > pkt->len - PKT_MIN_LEN)
+		len = pkt->len - PKT_MIN_LEN;
+	if (len > sizeof(pkt->cli.__raw))
+		len = sizeof(pkt->cli.__raw);
+
+	return len;
+}
+
+
+/*
+ * Park the frame finished in @thread->tun_gro (@len bytes) in
+ * @thread->tun_txq. A coalesced frame doesn't fit in a pool
+ * buffer, so it's split back into its segments, each with an
+ * empty virtio_net_hdr.
+ */
+static __cold void park_tun_gro(struct epl_thread *thread, size_t len)
+{
+	struct tun_gro *gro = &thread->tun_gro;
+	uint8_t seg[sizeof(thread->pkt->__raw)];
+	struct tun_gso_iter it;
+	ssize_t seg_len;
+
+	if (gro->nr_segs == 1 || tun_gso_init(&it, gro->buf, len)) {
+		txq_push(thread, &thread->tun_txq, NULL, gro->buf, len);
+		return;
+	}
+
+	memset(seg, 0, TUN_VNET_HDR_LEN);
+	while (true) {
+		seg_len = tun_gso_next(&it, &seg[TUN_VNET_HDR_LEN],
+				       sizeof(seg) - TUN_VNET_HDR_LEN);
+		if (seg_len <= 0)
+			break;
+
+		txq_push(thread, &thread->tun_txq, NULL, seg,
+			 TUN_VNET_HDR_LEN + (size_t)seg_len);
+	}
+}
+
+
+/*
+ * Write the coalesced packet queued in @thread->tun_gro to
+ * the TUN fd.
+ */
+static __hot int flush_tun_gro(struct epl_thread *thread)
+{
+	size_t len;
+	ssize_t write_ret;
+	struct tun_gro *gro = &thread->tun_gro;
+	int tun_fd = thread->tun_fd;
+
+	len = tun_gro_finish(gro);
+	if (len == 0)
+		return 0;
+
+	/*
+	 * Don't overtake the parked packets.
+	 */
+	if (unlikely(thread->tun_txq.nr))
+		goto park;
+
+	write_ret = __sys_write(tun_fd, gro->buf, len);
+	if (unlikely(write_ret <= 0)) {
+
+		if (write_ret == -EAGAIN)
+			goto park;
+
+		tun_gro_reset(gro);
+		if (write_ret == 0) {
+			pr_err("write() to TUN fd returned zero");
+			return -ENETDOWN;
+		}
+
+		pr_err("[thread=%hu] write(tun_fd=%d): " PRERF, thread->idx,
+		       tun_fd, PREAR((int)-write_ret));
+		return (int)write_ret;
+	}
+
+	pr_debug("[thread=%hu] write(tun_fd=%d) %zd bytes (%hu segment(s))",
+		 thread->idx, tun_fd, write_ret, gro->nr_segs);
+
+	tun_gro_reset(gro);
+	return 0;
+
+park:
+	park_tun_gro(thread, len);
+	tun_gro_reset(gro);
+	return 0;
+}
+
+
+/*
+ * With TUN offload, the packet is queued to @thread->tun_gro
+ * and written by flush_tun_gro() after the whole recvmmsg()
+ * batch has been processed.
+ */
+static __hot int queue_clpkt_tun_data(struct epl_thread *thread)
+{
+	int ret;
+	size_t data_len;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+	data_len = clpkt_tun_data_len(thread);
+	if (unlikely(data_len == 0))
+		return 0;
+
+	if (tun_gro_add(&thread->tun_gro, srv_pkt->__raw, data_len))
+		return 0;
+
+	ret = flush_tun_gro(thread);
+	if (unlikely(ret))
+		return ret;
+
+	tun_gro_add(&thread->tun_gro, srv_pkt->__raw, data_len);
+	return 0;
+}
+
+
 static __hot int handle_clpkt_tun_data(struct epl_thread *thread,
 				       struct udp_sess *sess)
 {	
 	ssize_t write_ret;
-	int tun_fd = thread->state->tun_fds[0];
+	int tun_fd = thread->tun_fd;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+	if (thread->state->tun_offload)
+		return queue_clpkt_tun_data(thread);
+
+#ifdef CONFIG_IO_URING
+	if (thread->iou && !iou_tx_write_tun(thread, srv_pkt->__raw,
+					     clpkt_tun_data_len(thread)))
+		return 0;
+#endif
+
+	/*
+	 * Don't overtake the parked packets.
+	 */
+	if (unlikely(thread->tun_txq.nr))
+		goto park;
 
-write_again:
 	write_ret = _handle_clpkt_tun_data(thread, tun_fd);
 	if (unlikely(write_ret < 0)) {
 
-		if (write_ret == -EAGAIN) {
-			int ret = emergency_wait_for_tun_fd_be_writable(thread,
-									tun_fd);
-			if (ret == 0)
-				goto write_again;
-
-			return ret;
-		}
+		if (write_ret == -EAGAIN)
+			goto park;
 
 		pr_err("[thread=%hu] write(tun_fd=%d) data from " PRWIU " "
 		       PRERF, thread->idx, tun_fd, W_IU(sess),
@@ -688,6 +1340,35 @@ write_again:
 		 tun_fd, write_ret);
 
 	return 0;
+
+park:
+	txq_push(thread, &thread->tun_txq, NULL, srv_pkt->__raw,
+		 ntohs(srv_pkt->len));
+	return 0;
+}
+
+
+static __always_inline bool clpkt_is_igmp(struct epl_thread *thread)
+{
+	const uint8_t *p = (const uint8_t *)thread->pkt->cli.__raw;
+
+	/*
+	 * Don't classify a short packet on the stale bytes of
+	 * the previous one.
+	 */
+	if (unlikely(clpkt_tun_data_len(thread) < 20))
+		return false;
+
+	return (p[0] >> 4u) == 4u && p[9] == IPPROTO_IGMP;
+}
+
+
+static __cold void snoop_clpkt_igmp(struct epl_thread *thread,
+				    struct udp_sess *sess)
+{
+	mcast_snoop_igmp(thread->state, sess,
+			 (const uint8_t *)thread->pkt->cli.__raw,
+			 clpkt_tun_data_len(thread));
 }
 
 
@@ -724,6 +1405,8 @@ static __hot int __handle_event_from_udp(struct epl_thread *thread,
 	case TCLI_PKT_AUTH:
 		return handle_clpkt_auth(thread, sess);
 	case TCLI_PKT_TUN_DATA:
+		if (unlikely(clpkt_is_igmp(thread)))
+			snoop_clpkt_igmp(thread, sess);
 		return handle_clpkt_tun_data(thread, sess);
 	case TCLI_PKT_REQSYNC:
 		ret = handle_clpkt_reqsync(thread, sess);
@@ -732,7 +1415,7 @@ static __hot int __handle_event_from_udp(struct epl_thread *thread,
 		udp_sess_update_last_act(sess);
 		return ret;
 	case TCLI_PKT_CLOSE:
-		close_udp_session(thread, sess);
+		close_udp_session(thread, sess, thread->sess_gen);
 		return 0;
 	default:
 		/* Bad packet! */
@@ -751,7 +1434,7 @@ static __hot int _handle_event_from_udp(struct epl_thread *thread,
 
 	port = ntohs(saddr->sin_port);
 	addr = ntohl(saddr->sin_addr.s_addr);
-	sess = lookup_udp_sess(thread->state, addr, port);
+	sess = lookup_udp_sess(thread->state, addr, port, &thread->sess_gen);
 	if (unlikely(!sess)) {
 		/*
 		 * It's a new client because we don't find it on
@@ -763,89 +1446,447 @@ static __hot int _handle_event_from_udp(struct epl_thread *thread,
 	ret = __handle_event_from_udp(thread, sess);
 	if (unlikely(ret < 0)) {
 		if (ret == -EBADMSG) {
-			close_udp_session(thread, sess);
+			close_udp_session(thread, sess, thread->sess_gen);
 			return 0;
 		}
-		return ret;
-	}
+		return ret;
+	}
+
+	if ((++sess->loop_c % 32) == 0) {
+		size_t send_len;
+		struct srv_pkt *srv_pkt = &thread->pkt->srv;
+
+		udp_sess_update_last_act(sess);
+		send_len = srv_pprep_sync(srv_pkt);
+		send_to_client(thread, sess, srv_pkt, send_len);
+		pr_debug("Syncing with " PRWIU, W_IU(sess));
+	}
+
+	return ret;
+}
+
+
+/*
+ * Split a GRO coalesced datagram at index @i back into the
+ * original packets and dispatch them one by one. All segments
+ * come from the same source address. The kernel may coalesce
+ * datagrams with an equal size, only the last one can be
+ * shorter.
+ */
+static __hot int handle_gro_datagram(struct epl_thread *thread, int i)
+{
+	int ret = 0;
+	size_t off, seg;
+	struct sc_pkt *pkt = thread->pkts[0];
+	struct mmsghdr *msg = &thread->rx_msgs[i];
+	const char *buf = thread->rx_iovs[i].iov_base;
+	size_t len = (size_t)msg->msg_len;
+
+	seg = (size_t)udp_gro_seg_size(&msg->msg_hdr);
+	if (seg == 0)
+		seg = len;
+
+	thread->pkt = pkt;
+	for (off = 0; off < len; off += seg) {
+		size_t cur = len - off;
+
+		if (cur > seg)
+			cur = seg;
+
+		/*
+		 * A valid TeaVPN2 packet always fits in @pkt,
+		 * truncate the garbage like recvfrom() would do.
+		 */
+		if (unlikely(cur > sizeof(pkt->__raw)))
+			cur = sizeof(pkt->__raw);
+
+		memcpy(pkt->__raw, &buf[off], cur);
+		pkt->len = cur;
+		ret = _handle_event_from_udp(thread, &thread->rx_saddrs[i]);
+		if (unlikely(ret))
+			break;
+	}
+
+	return ret;
+}
+
+
+/*
+ * Returns the number of received datagrams, 0 if there is
+ * nothing to read, or -errno on error.
+ */
+static __hot int handle_udp_burst(struct epl_thread *thread, int udp_fd)
+{
+	int i, nr, ret = 0;
+	struct sc_pkt **pkts = thread->pkts;
+	struct mmsghdr *msgs = thread->rx_msgs;
+
+	nr = do_recv_mmsg(thread, udp_fd);
+	if (unlikely(nr <= 0))
+		return nr;
+
+	for (i = 0; i < nr; i++) {
+		if (thread->rx_gro_buf) {
+			ret = handle_gro_datagram(thread, i);
+		} else {
+			thread->pkt = pkts[i];
+			thread->pkt->len = (size_t)msgs[i].msg_len;
+			ret = _handle_event_from_udp(thread,
+						     &thread->rx_saddrs[i]);
+		}
+
+		if (unlikely(ret))
+			break;
+	}
+
+	if (thread->state->tun_offload) {
+		int tmp = flush_tun_gro(thread);
+		if (!ret)
+			ret = tmp;
+	}
+
+	thread->pkt = pkts[0];
+	return ret ? ret : nr;
+}
+
+
+/*
+ * Drain the UDP socket until it runs out of datagrams (a short
+ * recvmmsg() batch) or until @thread->event_budget is used up.
+ */
+static __hot int handle_event_from_udp(struct epl_thread *thread, int udp_fd)
+{
+	int ret;
+	uint32_t done = 0;
+
+	do {
+		ret = handle_udp_burst(thread, udp_fd);
+		if (ret <= 0)
+			return ret;
+
+		done += (uint32_t)ret;
+	} while (ret == thread->recv_batch && done < thread->event_budget);
+
+	return 0;
+}
+
+
+/*
+ * return -ENOENT if cannot find the destination.
+ * return 0 if it finds the destination (the packet is queued
+ * and will be sent on the next flush_tx_batch() call).
+ */
+static __hot int route_ipv4_packet(struct epl_thread *thread, __be32 dst_addr,
+				   struct udp_sess *sess_arr, size_t send_len)
+{
+	uint32_t idx;
+	int32_t find;
+	struct udp_sess *dst_sess;
+
+	find = get_ipv4_route(thread->state, dst_addr);
+	if (unlikely(find < 0))
+		return (int)find;
+
+	idx      = (uint32_t)find;
+	dst_sess = &sess_arr[idx];
+	tx_batch_add(thread, dst_sess, &thread->pkt->srv, send_len);
+	return 0;
+}
+
+
+/*
+ * Send one batch of a broadcast, @thread->tx_msgs[0..@n) all
+ * point to the same payload. A destination that fails with an
+ * error other than EAGAIN is skipped. On EAGAIN (or if there
+ * are parked packets already), the rest is parked. Only an
+ * error of the socket itself is returned.
+ */
+static __hot int bcast_send_batch(struct epl_thread *thread, uint16_t n,
+				  const void *buf, size_t len)
+{
+	int ret;
+	uint16_t i = 0;
+	struct mmsghdr *msgs = thread->tx_msgs;
+
+#ifdef CONFIG_IO_URING
+	if (thread->iou)
+		i = (uint16_t)iou_tx_sendto(thread, buf, len, thread->tx_sess,
+					    n);
+#endif
+
+	if (unlikely(thread->udp_txq.nr))
+		goto park;
+
+	while (i < n) {
+		ret = __sys_sendmmsg(thread->udp_fd, &msgs[i], n - i, 0);
+		if (likely(ret > 0)) {
+			i = (uint16_t)(i + ret);
+			continue;
+		}
 
-	if ((++sess->loop_c % 32) == 0) {
-		size_t send_len;
-		struct srv_pkt *srv_pkt = &thread->pkt->srv;
+		if (ret == -EAGAIN)
+			goto park;
 
-		udp_sess_update_last_act(sess);
-		send_len = srv_pprep_sync(srv_pkt);
-		send_to_client(thread, sess, srv_pkt, send_len);
-		pr_debug("Syncing with " PRWIU, W_IU(sess));
+		ret = tx_dst_err(thread, thread->tx_sess[i], ret);
+		if (unlikely(ret))
+			return ret;
+		i++;
 	}
 
-	return ret;
+	return 0;
+
+park:
+	for (; i < n; i++)
+		txq_push(thread, &thread->udp_txq, thread->tx_sess[i], buf, len);
+
+	return 0;
 }
 
 
-static __hot int handle_event_from_udp(struct epl_thread *thread, int udp_fd)
+static __hot void bcast_add_msg(struct epl_thread *thread, uint16_t n,
+				 struct udp_sess *sess, struct iovec *iov)
+{
+	struct msghdr *hdr = &thread->tx_msgs[n].msg_hdr;
+
+	hdr->msg_name       = &sess->addr;
+	hdr->msg_namelen    = sizeof(sess->addr);
+	hdr->msg_iov        = iov;
+	hdr->msg_iovlen     = 1;
+	hdr->msg_control    = NULL;
+	hdr->msg_controllen = 0;
+	hdr->msg_flags      = 0;
+	thread->tx_sess[n]  = sess;
+}
+
+
+static __hot int broadcast_packet(struct epl_thread *thread, size_t send_len)
 {
-	ssize_t recv_ret;
-	struct sockaddr_in saddr;
-	socklen_t saddr_len = sizeof(saddr);
+	int ret;
+	uint16_t n = 0;
+	uint32_t i, nr_auth;
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+	struct srv_udp_state *state = thread->state;
+	struct udp_sess	*sess_arr = state->sess_arr;
+	struct iovec iov = { .iov_base = srv_pkt, .iov_len = send_len };
+
+	/*
+	 * Keep the packet order, send what we have queued
+	 * before broadcasting. This also frees @thread->tx_msgs
+	 * and @thread->tx_sess for us.
+	 */
+	ret = flush_tx_batch(thread);
+	if (unlikely(ret))
+		return ret;
+
+	/*
+	 * Broadcast this to all authenticated clients.
+	 */
+	nr_auth = atomic_load_explicit(&state->nr_auth, memory_order_acquire);
+	for (i = 0; i < nr_auth; i++) {
+		struct udp_sess *sess;
+		uint32_t idx;
+
+		idx  = atomic_load_explicit(&state->auth_list[i],
+					    memory_order_relaxed);
+		sess = &sess_arr[idx];
+		if (unlikely(!sess->is_authenticated))
+			continue;
+
+		bcast_add_msg(thread, n, sess, &iov);
+		if (++n < UDP_RECV_BATCH_MAX)
+			continue;
 
-	recv_ret = do_recv_from(thread, udp_fd, &saddr, &saddr_len);
-	if (unlikely(recv_ret <= 0))
-		return (int)recv_ret;
+		ret = bcast_send_batch(thread, n, srv_pkt, send_len);
+		if (unlikely(ret))
+			return ret;
+		n = 0;
+	}
+
+	if (n)
+		return bcast_send_batch(thread, n, srv_pkt, send_len);
 
-	return _handle_event_from_udp(thread, &saddr);
+	return 0;
 }
 
 
 /*
- * return -ENOENT if cannot find the destination.
- * return 0 if it finds the destination.
- * return -errno if it errors.
+ * Send the packet to the clients that joined @group only. A
+ * group nobody joined is dropped.
  */
-static __hot int route_ipv4_packet(struct epl_thread *thread, __be32 dst_addr,
-				   struct udp_sess *sess_arr, size_t send_len)
+static __hot int multicast_packet(struct epl_thread *thread, uint32_t group,
+				  size_t send_len)
 {
-	uint16_t idx;
-	int32_t find;
-	ssize_t send_ret;
-	struct udp_sess *dst_sess;
+	int ret, tmp;
+	uint32_t i, off = 0;
+	uint32_t idx[UDP_RECV_BATCH_MAX];
+	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+	struct srv_udp_state *state = thread->state;
+	struct udp_sess	*sess_arr = state->sess_arr;
+	struct iovec iov = { .iov_base = srv_pkt, .iov_len = send_len };
 
-	find = get_ipv4_route_map(thread->state->ipv4_map, dst_addr);
-	if (unlikely(find < 0))
-		return (int)find;
+	ret = mcast_get_members(state, group, 0, idx, UDP_RECV_BATCH_MAX);
+	if (unlikely(ret == -ENOSPC))
+		return broadcast_packet(thread, send_len);
+	if (ret <= 0)
+		return 0;
 
-	idx      = (uint16_t)find;
-	dst_sess = &sess_arr[idx];
-	send_ret = send_to_client(thread, dst_sess, &thread->pkt->srv, send_len);
-	if (send_ret < 0)
-		return (int)send_ret;
+	tmp = flush_tx_batch(thread);
+	if (unlikely(tmp))
+		return tmp;
+
+	while (ret > 0) {
+		uint16_t n = 0;
+
+		for (i = 0; i < (uint32_t)ret; i++) {
+			struct udp_sess *sess = &sess_arr[idx[i]];
+
+			if (likely(sess->is_authenticated))
+				bcast_add_msg(thread, n++, sess, &iov);
+		}
+
+		if (n) {
+			tmp = bcast_send_batch(thread, n, srv_pkt, send_len);
+			if (unlikely(tmp))
+				return tmp;
+		}
+
+		if ((uint32_t)ret < UDP_RECV_BATCH_MAX)
+			break;
+
+		off += (uint32_t)ret;
+		ret = mcast_get_members(state, group, off, idx,
+					UDP_RECV_BATCH_MAX);
+	}
 
 	return 0;
 }
 
 
-static __hot int broadcast_packet(struct epl_thread *thread, size_t send_len)
+/*
+ * Tell the sender that @thread->pkt can't be delivered, by
+ * writing an ICMP host unreachable to the TUN fd (or parking it
+ * in @thread->tun_txq like any other TUN write). It comes from
+ * the unreachable address itself, the kernel drops a packet from
+ * its own address coming in on the TUN.
+ */
+static __cold void send_icmp_unreach(struct epl_thread *thread,
+				     size_t send_len)
 {
-	struct srv_pkt *srv_pkt = &thread->pkt->srv;
+	uint8_t buf[TUN_VNET_HDR_LEN + 20 + 8 + 60 + 8];
 	struct srv_udp_state *state = thread->state;
-	struct udp_sess	*sess_arr = state->sess_arr;
-	uint16_t i, max_conn = state->cfg->sock.max_conn;
+	const uint8_t *org = (const uint8_t *)thread->pkt->srv.__raw;
+	size_t org_len = send_len - PKT_MIN_LEN, org_ihl, quote, off = 0;
+	uint32_t org_src;
+	time_t now = coarse_now();
+	uint16_t csum, tot_len;
+	uint8_t *ip, *icmp;
+	ssize_t ret;
+
+	org_ihl = (size_t)(org[0] & 0xfu) * 4u;
+	if (unlikely(org_len < 20 || org_ihl < 20 || org_len < org_ihl))
+		return;
 
 	/*
-	 * Broadcast this to all authenticated clients.
+	 * Never answer an ICMP error, a non-first fragment or a
+	 * packet without a unicast source (RFC 1122, 3.2.2).
 	 */
-	for (i = 0; i < max_conn; i++) {
-		ssize_t send_ret;
-		struct udp_sess	*sess = &sess_arr[i];
+	if (((org[6] << 8u) | org[7]) & 0x1fffu)
+		return;
+	if (org[9] == IPPROTO_ICMP &&
+	    (org_len == org_ihl || org[org_ihl] != ICMP_ECHO))
+		return;
 
-		if (!sess->is_authenticated)
-			continue;
+	memcpy(&org_src, &org[12], sizeof(org_src));
+	org_src = ntohl(org_src);
+	if (org_src == 0 || IN_MULTICAST(org_src) ||
+	    org_src == INADDR_BROADCAST)
+		return;
+
+	if (thread->icmp_sec != now) {
+		thread->icmp_sec    = now;
+		thread->icmp_tokens = UDP_ICMP_RATE;
+	}
+	if (!thread->icmp_tokens)
+		return;
+	thread->icmp_tokens--;
+
+	if (state->tun_offload) {
+		/* No GSO, no checksum offload. */
+		memset(buf, 0, TUN_VNET_HDR_LEN);
+		off = TUN_VNET_HDR_LEN;
+	}
+
+	quote   = (org_len < org_ihl + 8u) ? org_len : org_ihl + 8u;
+	tot_len = (uint16_t)(20u + 8u + quote);
+	ip      = &buf[off];
+	icmp    = &ip[20];
+
+	memset(ip, 0, 28);
+	ip[0] = 0x45;
+	ip[1] = 0xc0;
+	ip[2] = (uint8_t)(tot_len >> 8u);
+	ip[3] = (uint8_t)tot_len;
+	ip[8] = 64;
+	ip[9] = IPPROTO_ICMP;
+	memcpy(&ip[12], &org[16], 4);
+	memcpy(&ip[16], &org[12], 4);
+	csum = inet_csum(ip, 20);
+	memcpy(&ip[10], &csum, sizeof(csum));
+
+	icmp[0] = ICMP_DEST_UNREACH;
+	icmp[1] = ICMP_HOST_UNREACH;
+	memcpy(&icmp[8], org, quote);
+	csum = inet_csum(icmp, 8u + quote);
+	memcpy(&icmp[2], &csum, sizeof(csum));
+
+#ifdef CONFIG_IO_URING
+	if (thread->iou && !iou_tx_write_tun(thread, buf, off + tot_len))
+		return;
+#endif
+
+	/*
+	 * Don't overtake the parked packets.
+	 */
+	if (unlikely(thread->tun_txq.nr))
+		goto park;
+
+	ret = __sys_write(thread->tun_fd, buf, off + tot_len);
+	if (likely(ret >= 0))
+		return;
+
+	if (ret == -EAGAIN)
+		goto park;
+
+	pr_debug("[thread=%hu] write(tun_fd=%d) ICMP: " PRERF, thread->idx,
+		 thread->tun_fd, PREAR((int)-ret));
+	return;
+
+park:
+	txq_push(thread, &thread->tun_txq, NULL, buf, off + tot_len);
+}
+
+
+/*
+ * @dst_addr has no route. Multicast goes to the members of the
+ * group (224.0.0.0/24 to everyone), broadcast goes to everyone.
+ * Flooding an unassigned unicast address is pointless, drop it.
+ */
+static __hot int route_ipv4_unknown(struct epl_thread *thread,
+				    uint32_t dst_addr, size_t send_len)
+{
+	struct srv_udp_state *state = thread->state;
+
+	if (IN_MULTICAST(dst_addr)) {
+		if (mcast_is_local(dst_addr))
+			return broadcast_packet(thread, send_len);
 
-		send_ret = send_to_client(thread, sess, srv_pkt, send_len);
-		if (unlikely(send_ret < 0))
-			return (int)send_ret;
+		return multicast_packet(thread, dst_addr, send_len);
 	}
 
+	if (dst_addr == INADDR_BROADCAST || dst_addr == state->ipv4_bcast)
+		return broadcast_packet(thread, send_len);
+
+	send_icmp_unreach(thread, send_len);
 	return 0;
 }
 
@@ -863,6 +1904,8 @@ static __hot int _route_packet(struct epl_thread *thread, size_t send_len)
 		ret = route_ipv4_packet(thread, dst_addr, sess_arr, send_len);
 		if (likely(ret != -ENOENT))
 			return ret;
+
+		return route_ipv4_unknown(thread, dst_addr, send_len);
 	}
 
 	return broadcast_packet(thread, send_len);
@@ -879,7 +1922,11 @@ static __hot int route_packet(struct epl_thread *thread, ssize_t len)
 }
 
 
-static __hot int handle_event_from_tun(struct epl_thread *thread, int tun_fd)
+/*
+ * Returns the number of bytes read, 0 if there is nothing
+ * to read, or -errno on error.
+ */
+static __hot ssize_t read_from_tun(struct epl_thread *thread, int tun_fd)
 {
 	ssize_t read_ret;
 	char *buf = thread->pkt->srv.__raw;
@@ -894,14 +1941,148 @@ static __hot int handle_event_from_tun(struct epl_thread *thread, int tun_fd)
 		pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
 		       PREAR((int)-read_ret));
 
-		return (int) read_ret;
+		return read_ret;
 	}
 
 	thread->pkt->len = (size_t)read_ret;
 	pr_debug("[thread=%hu] read(tun_fd=%d) = %zd bytes", thread->idx,
 		 tun_fd, read_ret);
 
-	return route_packet(thread, read_ret);
+	return read_ret;
+}
+
+
+/*
+ * Read one (possibly TSO) frame into @thread->tun_rx_buf.
+ */
+static __hot ssize_t read_tun_frame(struct epl_thread *thread, int tun_fd)
+{
+	ssize_t read_ret;
+
+	read_ret = __sys_read(tun_fd, thread->tun_rx_buf, TUN_OFFLOAD_BUF_SIZE);
+	if (unlikely(read_ret < 0)) {
+
+		if (read_ret == -EAGAIN)
+			return 0;
+
+		pr_err("read(tun_fd) (fd=%d): " PRERF, tun_fd,
+		       PREAR((int)-read_ret));
+
+		return read_ret;
+	}
+
+	pr_debug("[thread=%hu] read(tun_fd=%d) = %zd bytes", thread->idx,
+		 tun_fd, read_ret);
+
+	return read_ret;
+}
+
+
+/*
+ * TUN offload variant of handle_event_from_tun(). Each frame
+ * may be a TSO super-packet, it is segmented into @thread->pkts
+ * and every segment is routed like a normal packet. The tx
+ * batch is flushed whenever we run out of @thread->pkts.
+ */
+static __hot int handle_event_from_tun_offload(struct epl_thread *thread,
+					       int tun_fd)
+{
+	int ret = 0, tmp;
+	uint16_t n, i = 0, nr = thread->recv_batch;
+	uint16_t budget = thread->event_budget;
+
+	for (n = 0; n < budget; n++) {
+		ssize_t read_ret;
+		struct tun_gso_iter it;
+
+		read_ret = read_tun_frame(thread, tun_fd);
+		if (read_ret <= 0) {
+			ret = (int)read_ret;
+			break;
+		}
+
+		ret = tun_gso_init(&it, thread->tun_rx_buf, (size_t)read_ret);
+		if (unlikely(ret)) {
+			pr_debug("[thread=%hu] dropping bad TUN frame: " PRERF,
+				 thread->idx, PREAR(-ret));
+			ret = 0;
+			continue;
+		}
+
+		while (true) {
+			ssize_t seg_len;
+			struct srv_pkt *srv_pkt;
+
+			if (i == nr) {
+				ret = flush_tx_batch(thread);
+				if (unlikely(ret))
+					goto out;
+				i = 0;
+			}
+
+			thread->pkt = thread->pkts[i];
+			srv_pkt = &thread->pkt->srv;
+			seg_len = tun_gso_next(&it, srv_pkt->__raw,
+					       sizeof(srv_pkt->__raw));
+			if (seg_len <= 0)
+				break;
+
+			i++;
+			thread->pkt->len = (size_t)seg_len;
+			ret = route_packet(thread, seg_len);
+			if (unlikely(ret))
+				goto out;
+		}
+	}
+
+out:
+	tmp = flush_tx_batch(thread);
+	thread->pkt = thread->pkts[0];
+	return ret ? ret : tmp;
+}
+
+
+/*
+ * Read a burst of up to @thread->event_budget packets from the
+ * TUN fd, resolve the destination of each of them and send
+ * them with sendmmsg(). The tx batch is flushed every
+ * @thread->recv_batch packets, since that's the number of
+ * @thread->pkts we have.
+ */
+static __hot int handle_event_from_tun(struct epl_thread *thread, int tun_fd)
+{
+	int ret = 0, tmp;
+	uint16_t n, i = 0, nr = thread->recv_batch;
+	uint16_t budget = thread->event_budget;
+
+	if (thread->state->tun_offload)
+		return handle_event_from_tun_offload(thread, tun_fd);
+
+	for (n = 0; n < budget; n++) {
+		ssize_t read_ret;
+
+		if (i == nr) {
+			ret = flush_tx_batch(thread);
+			if (unlikely(ret))
+				break;
+			i = 0;
+		}
+
+		thread->pkt = thread->pkts[i++];
+		read_ret = read_from_tun(thread, tun_fd);
+		if (read_ret <= 0) {
+			ret = (int)read_ret;
+			break;
+		}
+
+		ret = route_packet(thread, read_ret);
+		if (unlikely(ret))
+			break;
+	}
+
+	tmp = flush_tx_batch(thread);
+	thread->pkt = thread->pkts[0];
+	return ret ? ret : tmp;
 }
 
 
@@ -911,8 +2092,12 @@ static __hot int handle_event(struct epl_thread *thread,
 	int ret = 0;
 	int fd = event->data.fd;
 
-	if (fd == thread->state->udp_fd)
+	if (fd == thread->udp_fd)
 		ret = handle_event_from_udp(thread, fd);
+	else if (fd == thread->udp_txq.wfd)
+		ret = txq_flush(thread, &thread->udp_txq);
+	else if (fd == thread->tun_txq.wfd)
+		ret = txq_flush(thread, &thread->tun_txq);
 	else
 		ret = handle_event_from_tun(thread, fd);
 
@@ -939,6 +2124,8 @@ static __hot int do_epoll_wait(struct epl_thread *thread)
 		       PREAR(-ret));
 		return ret;
 	}
+
+	coarse_clock_update();
 	return ret;
 }
 
@@ -1021,7 +2208,13 @@ static __cold noinline void *server_udp_epoll_run_event_loop(void *thread_p)
 	thread_wait(thread, state);
 
 	while (likely(!state->stop)) {
-		ret = __run_event_loop(thread);
+#ifdef CONFIG_IO_URING
+		if (state->evt_loop == EVTL_IO_URING)
+			ret = iou_run_event_loop(thread);
+		else
+#endif
+			ret = __run_event_loop(thread);
+
 		if (unlikely(ret))
 			break;
 	}
@@ -1032,6 +2225,18 @@ static __cold noinline void *server_udp_epoll_run_event_loop(void *thread_p)
 }
 
 
+/*
+ * The zombie reaper runs on its own thread, it must not touch
+ * the tx queue of a worker. A packet that gets EAGAIN here is
+ * dropped, the next scan sends another one.
+ */
+static __cold void zr_send(struct srv_udp_state *state, struct udp_sess *sess,
+			   const void *buf, size_t len)
+{
+	_send_to_client(state->udp_fd, buf, len, (struct sockaddr *)&sess->addr);
+}
+
+
 static __cold void zr_send_reqsync(struct srv_udp_state *state,
 				   struct udp_sess *sess)
 {
@@ -1042,12 +2247,12 @@ static __cold void zr_send_reqsync(struct srv_udp_state *state,
 		   W_IU(sess));
 
 	send_len = srv_pprep(srv_pkt, TSRV_PKT_REQSYNC, 0, 0);
-	send_to_client(&state->epl_threads[0], sess, srv_pkt, send_len);
+	zr_send(state, sess, srv_pkt, send_len);
 }
 
 
 static __cold int zr_close_sess(struct srv_udp_state *state,
-				struct udp_sess *sess)
+				struct udp_sess *sess, uint32_t gen)
 {
 	size_t send_len;
 	struct srv_pkt *srv_pkt = &state->zr.pkt->srv;
@@ -1055,86 +2260,113 @@ static __cold int zr_close_sess(struct srv_udp_state *state,
 	prl_notice(2, "[zombie reaper] Closing session " PRWIU " (no activity)...",
 		   W_IU(sess));
 
-	if (sess->ipv4_iff != 0)
-		del_ipv4_route_map(state->ipv4_map, sess->ipv4_iff);
-
 	send_len = srv_pprep(srv_pkt, TSRV_PKT_CLOSE, 0, 0);
-	send_to_client(&state->epl_threads[0], sess, srv_pkt, send_len);
-	return delete_udp_session(state, sess);
+	zr_send(state, sess, srv_pkt, send_len);
+	return delete_udp_session(state, sess, gen);
 }
 
 
 static __cold void zr_chk_auth(struct srv_udp_state *state,
-			       struct udp_sess *sess, time_t time_diff)
+			       struct udp_sess *sess, uint32_t gen, time_t now)
 {
-	int i = 0;
+	int i;
+	time_t expire;
+	const time_t last_act = sess->last_act;
+	const time_t time_diff = now - last_act;
 	const time_t max_diff = UDP_SESS_TIMEOUT_AUTH;
 
 	if (time_diff > max_diff) {
-		zr_close_sess(state, sess);
+		zr_close_sess(state, sess, gen);
 		return;
 	}
 
-	if (time_diff > ((max_diff * 4) / 5)) {
-		i = 7;
-		goto send_reqsync;
-	}
-
-	if (time_diff > ((max_diff * 3) / 5)) {
-		i = 5;
-		goto send_reqsync;
-	}
-
-	if (time_diff > ((max_diff * 2) / 5)) {
-		i = 3;
-		goto send_reqsync;
-	}
-
-	if (time_diff > ((max_diff * 1) / 5)) {
-		i = 1;
-		goto send_reqsync;
+	/*
+	 * How many fifths of @max_diff have passed (strictly)?
+	 * Past the first one, keep sending 1, 3, 5 and then 7
+	 * REQSYNC every UDP_SESS_REQSYNC_IVAL seconds until the
+	 * client shows up.
+	 */
+	i = (int)(((time_diff - 1) * 5) / max_diff);
+	if (i == 0) {
+		udp_sess_arm_timer(state, sess, last_act + max_diff / 5 + 1);
+		return;
 	}
 
-	return;
+	expire = now + UDP_SESS_REQSYNC_IVAL;
+	if (expire > last_act + max_diff + 1)
+		expire = last_act + max_diff + 1;
+	udp_sess_arm_timer(state, sess, expire);
 
-send_reqsync:
+	i = i * 2 - 1;
 	while (i-- > 0)
 		zr_send_reqsync(state, sess);
 }
 
 
 static __cold void zr_chk_no_auth(struct srv_udp_state *state,
-				  struct udp_sess *sess, time_t time_diff)
+				  struct udp_sess *sess, uint32_t gen,
+				  time_t now)
 {
 	const time_t max_diff = UDP_SESS_TIMEOUT_NO_AUTH;
 
-	if (time_diff > max_diff)
-		zr_close_sess(state, sess);
+	if (now - sess->last_act > max_diff) {
+		zr_close_sess(state, sess, gen);
+		return;
+	}
+
+	udp_sess_arm_timer(state, sess, sess->last_act + max_diff + 1);
 }
 
 
-static __cold void zombie_reaper_do_scan(struct srv_udp_state *state)
+/*
+ * Ask every authenticated client which multicast groups it
+ * wants, the reports refresh the memberships.
+ */
+static __cold void zr_send_igmp_query(struct srv_udp_state *state)
 {
-	uint16_t i, j, max_conn = state->cfg->sock.max_conn;
-	struct udp_sess *sess, *sess_arr = state->sess_arr;
+	uint32_t i, nr_auth;
+	size_t send_len, len;
+	struct srv_pkt *srv_pkt = &state->zr.pkt->srv;
 
-	if (atomic_load(&state->n_on_sess) == 0)
-		return;
+	len = igmp_query_prep(state, (uint8_t *)srv_pkt->__raw);
+	send_len = srv_pprep(srv_pkt, TSRV_PKT_TUN_DATA, (uint16_t)len, 0);
 
-	for (i = j = 0; i < max_conn; i++) {
-		time_t time_diff = 0;
+	nr_auth = atomic_load_explicit(&state->nr_auth, memory_order_acquire);
+	for (i = 0; i < nr_auth; i++) {
+		struct udp_sess *sess;
+		uint32_t idx;
 
-		sess = &sess_arr[i];
-		if (!atomic_load(&sess->is_connected))
-			continue;
+		idx  = atomic_load_explicit(&state->auth_list[i],
+					    memory_order_relaxed);
+		sess = &state->sess_arr[idx];
+		if (sess->is_authenticated)
+			zr_send(state, sess, srv_pkt, send_len);
+	}
+}
+
+
+static __cold void zombie_reaper_do_scan(struct srv_udp_state *state)
+{
+	struct udp_sess *sess;
+	uint32_t gen;
+	time_t now;
 
-		get_unix_time(&time_diff);
-		time_diff -= sess->last_act;
+	coarse_clock_update();
+	now = coarse_now();
+	while ((sess = pop_expired_udp_sess(state, now, &gen))) {
+		if (!(gen & 1u) || !atomic_load(&sess->is_connected))
+			continue;
 
 		if (sess->is_authenticated)
-			zr_chk_auth(state, sess, time_diff);
+			zr_chk_auth(state, sess, gen, now);
 		else
-			zr_chk_no_auth(state, sess, time_diff);
+			zr_chk_no_auth(state, sess, gen, now);
+	}
+
+	if (now >= state->mcast.next_query) {
+		state->mcast.next_query = now + MCAST_QUERY_IVAL;
+		mcast_expire(state, (uint32_t)now);
+		zr_send_igmp_query(state);
 	}
 }
 
@@ -1155,11 +2387,9 @@ static __cold void *run_zombie_reaper_thread(void *arg)
 		state->stop = true;
 
 	while (likely(!state->stop)) {
-		sleep(5);
-		if (!state->in_emergency) {
-			pr_debug("[zombie reaper] Scanning...");
-			zombie_reaper_do_scan(state);
-		}
+		sleep(1);
+		pr_debug("[zombie reaper] Scanning...");
+		zombie_reaper_do_scan(state);
 	}
 
 	al64_free(state->zr.pkt);
@@ -1343,6 +2573,13 @@ static __cold void close_epoll_fds(struct srv_udp_state *state)
 	for (i = 0; i < nn; i++) {
 		int epoll_fd = threads[i].epoll_fd;
 
+		if (threads[i].tx_errs)
+			prl_notice(2, "[thread=%hu] %" PRIu64 " send(s) failed "
+				   "for their destination", threads[i].idx,
+				   threads[i].tx_errs);
+		destroy_tx_queue(&threads[i], &threads[i].udp_txq, "UDP");
+		destroy_tx_queue(&threads[i], &threads[i].tun_txq, "TUN");
+
 		if (epoll_fd == -1)
 			continue;
 
@@ -1355,17 +2592,18 @@ static __cold void close_epoll_fds(struct srv_udp_state *state)
 static __cold void close_client_sess(struct srv_udp_state *state)
 {
 	struct udp_sess *sess_arr = state->sess_arr;
-	uint16_t i, max_conn = state->cfg->sock.max_conn;
+	uint32_t i, gen, max_conn = state->cfg->sock.max_conn;
 
 	if (unlikely(!sess_arr))
 		return;
 
 	for (i = 0; i < max_conn; i++) {
 
-		if (!atomic_load(&sess_arr[i].is_connected))
+		gen = atomic_load(&sess_arr[i].gen);
+		if (!(gen & 1u) || !atomic_load(&sess_arr[i].is_connected))
 			continue;
 
-		close_udp_session(&state->epl_threads[0], &sess_arr[i]);
+		close_udp_session(&state->epl_threads[0], &sess_arr[i], gen);
 	}
 }
 
@@ -1378,8 +2616,24 @@ static __cold void free_pkt_buffer(struct srv_udp_state *state)
 	if (unlikely(!threads))
 		return;
 
-	for (i = 0; i < nn; i++)
-		al4096_free_munmap(threads[i].pkt, sizeof(*threads[i].pkt));
+	for (i = 0; i < nn; i++) {
+		size_t len;
+
+		pkt_pool_destroy(&threads[i].pool);
+
+		if (threads[i].rx_gro_buf) {
+			len = (size_t)threads[i].recv_batch * UDP_GRO_BUF_SIZE;
+			al4096_free_munmap(threads[i].rx_gro_buf, len);
+		}
+
+		if (threads[i].tun_rx_buf)
+			al4096_free_munmap(threads[i].tun_rx_buf,
+					   TUN_OFFLOAD_BUF_SIZE);
+
+		if (threads[i].tun_gro.buf)
+			al4096_free_munmap(threads[i].tun_gro.buf,
+					   TUN_OFFLOAD_BUF_SIZE);
+	}
 }
 
 
@@ -1401,6 +2655,58 @@ static __cold void destroy_epoll(struct srv_udp_state *state)
 }
 
 
+int srv_udp_handle_pkt(struct epl_thread *thread, struct sockaddr_in *saddr)
+{
+	return _handle_event_from_udp(thread, saddr);
+}
+
+
+int srv_tun_route_pkt(struct epl_thread *thread, ssize_t len)
+{
+	/*
+	 * Keep room in the tx batch for this packet.
+	 */
+	if (unlikely(thread->tx_nr == UDP_RECV_BATCH_MAX)) {
+		int ret = flush_tx_batch(thread);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	thread->pkt->len = (size_t)len;
+	return route_packet(thread, len);
+}
+
+
+int srv_udp_flush(struct epl_thread *thread)
+{
+	int ret, tmp = 0;
+
+	ret = flush_tx_batch(thread);
+	if (thread->state->tun_offload)
+		tmp = flush_tun_gro(thread);
+
+	return ret ? ret : tmp;
+}
+
+
+__cold int srv_udp_init_threads(struct srv_udp_state *state)
+{
+	return init_epoll_thread_array(state);
+}
+
+
+__cold int srv_udp_run_threads(struct srv_udp_state *state)
+{
+	return run_event_loop(state);
+}
+
+
+__cold void srv_udp_destroy_threads(struct srv_udp_state *state)
+{
+	destroy_epoll(state);
+}
+
+
 int teavpn2_udp_server_epoll(struct srv_udp_state *state)
 {
 	int ret;
@@ -0,0 +1,973 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ */
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <teavpn2/server/common.h>
+#include <teavpn2/server/linux/udp.h>
+
+
+enum {
+	IOU_SLOT_UDP_RECV	= 1,
+	IOU_SLOT_TUN_READ	= 2,
+	IOU_TX_UDP_SEND		= 3,
+	IOU_TX_TUN_WRITE	= 4,
+};
+
+/*
+ * user_data of the multishot recvmsg() SQE. The sends carry
+ * IOU_UD_TX | their index in @iou->tx, the others carry the
+ * slot index.
+ */
+#define IOU_UD_RX_MSHOT		((uint64_t)-1)
+#define IOU_UD_TX		((uint64_t)1u << 32u)
+
+#define IOU_RX_BGID		0u
+
+/*
+ * Registered buffer index of the thread's packet pool (index
+ * 0 is @iou->bufs).
+ */
+#define IOU_BUF_POOL		1u
+
+/*
+ * Max number of sends in flight per ring, @tx_free is
+ * IOU_TX_NONE when all of them are.
+ */
+#define IOU_TX_MAX		4096u
+#define IOU_TX_NONE		UINT32_MAX
+
+
+/*
+ * The fds serviced by a thread are the same as the epoll
+ * event loop ones, see init_epoll_fd_add() in udp_epoll.c.
+ */
+static __cold uint8_t iou_get_tun_fds(struct srv_udp_state *state,
+				      uint16_t idx, int fds[2])
+{
+	uint8_t nn = state->cfg->sys.thread_num;
+
+	if (idx == 0) {
+		if (nn == 1) {
+			fds[0] = state->tun_fds[0];
+			return 1;
+		}
+		return 0;
+	}
+
+	fds[0] = state->tun_fds[idx];
+	if (idx == 1) {
+		fds[1] = state->tun_fds[0];
+		return 2;
+	}
+	return 1;
+}
+
+
+static __cold void iou_init_slot(struct iou_thread *iou, uint16_t i, int fd,
+				 uint8_t fidx, uint8_t type)
+{
+	struct iou_slot *slot = &iou->slots[i];
+	struct sc_pkt *pkt = &iou->bufs[i];
+
+	slot->fd   = fd;
+	slot->fidx = fidx;
+	slot->type = type;
+
+	if (type == IOU_SLOT_UDP_RECV) {
+		slot->iov.iov_base = pkt->__raw;
+		slot->iov.iov_len  = sizeof(pkt->__raw);
+
+		memset(&slot->msg, 0, sizeof(slot->msg));
+		slot->msg.msg_name    = &slot->saddr;
+		slot->msg.msg_namelen = sizeof(slot->saddr);
+		slot->msg.msg_iov     = &slot->iov;
+		slot->msg.msg_iovlen  = 1;
+	} else {
+		slot->iov.iov_base = pkt->srv.__raw;
+		slot->iov.iov_len  = sizeof(pkt->srv.__raw);
+	}
+}
+
+
+static __hot void iou_sqe_set_file(struct iou_thread *iou,
+				    struct io_uring_sqe *sqe, uint8_t fidx)
+{
+	if (iou->fixed_files) {
+		sqe->fd     = fidx;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+}
+
+
+/*
+ * The sends share the SQ ring with the slots. When it's full,
+ * submit what is there to make room (with SQPOLL, wait for the
+ * SQ thread to take them).
+ */
+static __hot struct io_uring_sqe *iou_get_sqe(struct iou_thread *iou)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&iou->ring);
+	if (likely(sqe))
+		return sqe;
+
+	io_uring_submit(&iou->ring);
+	if (iou->ring.flags & IORING_SETUP_SQPOLL)
+		io_uring_sqring_wait(&iou->ring);
+
+	return io_uring_get_sqe(&iou->ring);
+}
+
+
+static __hot int iou_arm_slot(struct iou_thread *iou, uint16_t i)
+{
+	struct io_uring_sqe *sqe;
+	struct iou_slot *slot = &iou->slots[i];
+
+	sqe = iou_get_sqe(iou);
+	if (unlikely(!sqe)) {
+		pr_err("[thread=%hu] io_uring SQ ring is full",
+		       iou->thread->idx);
+		return -EAGAIN;
+	}
+
+	if (slot->type == IOU_SLOT_UDP_RECV) {
+		slot->msg.msg_namelen = sizeof(slot->saddr);
+		io_uring_prep_recvmsg(sqe, slot->fd, &slot->msg, 0);
+	} else if (iou->fixed_bufs) {
+		io_uring_prep_read_fixed(sqe, slot->fd, slot->iov.iov_base,
+					 (unsigned)slot->iov.iov_len, 0, 0);
+	} else {
+		io_uring_prep_read(sqe, slot->fd, slot->iov.iov_base,
+				   (unsigned)slot->iov.iov_len, 0);
+	}
+
+	iou_sqe_set_file(iou, sqe, slot->fidx);
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+	return 0;
+}
+
+
+static __hot int iou_arm_rx_mshot(struct iou_thread *iou)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = iou_get_sqe(iou);
+	if (unlikely(!sqe)) {
+		pr_err("[thread=%hu] io_uring SQ ring is full",
+		       iou->thread->idx);
+		return -EAGAIN;
+	}
+
+	io_uring_prep_recvmsg(sqe, iou->thread->udp_fd, &iou->rx_msg, 0);
+	sqe->flags     |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group  = IOU_RX_BGID;
+	sqe->ioprio    |= IOU_RECV_MULTISHOT;
+	iou_sqe_set_file(iou, sqe, 0);
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)IOU_UD_RX_MSHOT);
+	iou->rx_mshot_armed = true;
+	return 0;
+}
+
+
+/*
+ * Take a free @iou->tx and an SQE for it. Returns NULL if the
+ * ring has no room for another send.
+ */
+static __hot struct iou_tx *iou_tx_get(struct iou_thread *iou,
+				       struct io_uring_sqe **sqe)
+{
+	struct iou_tx *tx;
+	uint32_t i = iou->tx_free;
+
+	if (unlikely(i == IOU_TX_NONE))
+		return NULL;
+
+	*sqe = iou_get_sqe(iou);
+	if (unlikely(!*sqe))
+		return NULL;
+
+	tx = &iou->tx[i];
+	iou->tx_free = tx->next;
+	return tx;
+}
+
+
+static __hot void iou_tx_put(struct iou_thread *iou, struct iou_tx *tx)
+{
+	struct pkt_pool *pool = &iou->thread->pool;
+	struct pkt_buf *pb = tx->pb;
+
+	if (!--iou->tx_ref[pb - pool->bufs])
+		pkt_pool_put(pool, &pb->pkt);
+
+	tx->pb = NULL;
+	tx->next = iou->tx_free;
+	iou->tx_free = (uint32_t)(tx - iou->tx);
+}
+
+
+/*
+ * Copy @len bytes at @buf into a pool buffer, so the caller's
+ * buffer can be reused before the send completes.
+ */
+static __hot struct pkt_buf *iou_tx_copy(struct iou_thread *iou,
+					 const void *buf, size_t len)
+{
+	struct sc_pkt *pkt;
+
+	if (unlikely(len > sizeof(pkt->__raw)))
+		return NULL;
+
+	pkt = pkt_pool_get(&iou->thread->pool);
+	if (unlikely(!pkt))
+		return NULL;
+
+	memcpy(pkt->__raw, buf, len);
+	pkt->len = len;
+	return pkt_to_buf(pkt);
+}
+
+
+/*
+ * Queue a send of @len bytes at @buf to each of @sess[0..@nr).
+ * They all share one copy of the payload. Returns how many were
+ * queued, the caller sends the rest itself.
+ */
+__hot uint32_t iou_tx_sendto(struct epl_thread *thread, const void *buf,
+			     size_t len, struct udp_sess *const *sess,
+			     uint32_t nr)
+{
+	struct iou_thread *iou = thread->iou;
+	struct io_uring_sqe *sqe;
+	struct pkt_buf *pb;
+	struct iou_tx *tx;
+	uint32_t i, *ref;
+
+	if (unlikely(!len))
+		return nr;
+
+	pb = iou_tx_copy(iou, buf, len);
+	if (unlikely(!pb))
+		return 0;
+
+	ref = &iou->tx_ref[pb - thread->pool.bufs];
+	for (i = 0; i < nr; i++) {
+		tx = iou_tx_get(iou, &sqe);
+		if (unlikely(!tx))
+			break;
+
+		tx->pb   = pb;
+		tx->type = IOU_TX_UDP_SEND;
+		tx->dst  = sess[i]->addr;
+		tx->iov.iov_base = pb->pkt.__raw;
+		tx->iov.iov_len  = len;
+		io_uring_prep_sendmsg(sqe, thread->udp_fd, &tx->msg, 0);
+		iou_sqe_set_file(iou, sqe, iou->udp_fidx);
+		sqe->user_data = IOU_UD_TX | (uint64_t)(tx - iou->tx);
+		(*ref)++;
+	}
+
+	if (unlikely(!*ref))
+		pkt_pool_put(&thread->pool, &pb->pkt);
+
+	return i;
+}
+
+
+/*
+ * Queue a write of @len bytes at @buf to the thread's TUN fd.
+ * Returns 0 if it was queued, or -ENOBUFS if the caller must
+ * write it itself.
+ */
+__hot int iou_tx_write_tun(struct epl_thread *thread, const void *buf,
+			   size_t len)
+{
+	struct iou_thread *iou = thread->iou;
+	struct io_uring_sqe *sqe;
+	struct pkt_buf *pb;
+	struct iou_tx *tx;
+
+	if (unlikely(!len))
+		return 0;
+
+	pb = iou_tx_copy(iou, buf, len);
+	if (unlikely(!pb))
+		return -ENOBUFS;
+
+	tx = iou_tx_get(iou, &sqe);
+	if (unlikely(!tx)) {
+		pkt_pool_put(&thread->pool, &pb->pkt);
+		return -ENOBUFS;
+	}
+
+	tx->pb   = pb;
+	tx->type = IOU_TX_TUN_WRITE;
+	if (iou->fixed_bufs)
+		io_uring_prep_write_fixed(sqe, thread->tun_fd, pb->pkt.__raw,
+					  (unsigned)len, 0, IOU_BUF_POOL);
+	else
+		io_uring_prep_write(sqe, thread->tun_fd, pb->pkt.__raw,
+				    (unsigned)len, 0);
+	iou_sqe_set_file(iou, sqe, iou->tun_fidx);
+	sqe->user_data = IOU_UD_TX | (uint64_t)(tx - iou->tx);
+	iou->tx_ref[pb - thread->pool.bufs] = 1;
+	return 0;
+}
+
+
+static __cold int iou_tx_err(struct iou_thread *iou, struct iou_tx *tx,
+			     int res)
+{
+	struct epl_thread *thread = iou->thread;
+	char addr[INET_ADDRSTRLEN];
+
+	if (unlikely(is_udp_fd_err(res))) {
+		pr_err("[thread=%hu] io_uring %s: " PRERF, thread->idx,
+		       (tx->type == IOU_TX_UDP_SEND) ? "sendmsg" : "write",
+		       PREAR(-res));
+		return res;
+	}
+
+	if (!srv_tx_err_ratelimit(thread))
+		return 0;
+
+	if (tx->type == IOU_TX_TUN_WRITE) {
+		pr_err("[thread=%hu] io_uring write(tun_fd=%d): " PRERF,
+		       thread->idx, thread->tun_fd, PREAR(-res));
+		return 0;
+	}
+
+	inet_ntop(AF_INET, &tx->dst.sin_addr, addr, sizeof(addr));
+	pr_err("[thread=%hu] io_uring sendmsg() %s:%hu " PRERF, thread->idx,
+	       addr, ntohs(tx->dst.sin_port), PREAR(-res));
+	return 0;
+}
+
+
+/*
+ * A send completed, its buffer can be reused.
+ */
+static __hot int iou_handle_tx(struct iou_thread *iou,
+			       struct io_uring_cqe *cqe)
+{
+	struct iou_tx *tx = &iou->tx[(uint32_t)cqe->user_data];
+	int ret = 0;
+
+	if (unlikely(cqe->res < 0))
+		ret = iou_tx_err(iou, tx, cqe->res);
+
+	iou_tx_put(iou, tx);
+	return ret;
+}
+
+
+static __cold int init_iou_tx(struct iou_thread *iou)
+{
+	struct epl_thread *thread = iou->thread;
+	struct iou_tx *tx;
+	uint32_t i, nr;
+
+	/*
+	 * Every send holds a pool buffer, except for the extra
+	 * destinations of a broadcast.
+	 */
+	nr = thread->pool.nr * 2u;
+	if (nr > IOU_TX_MAX)
+		nr = IOU_TX_MAX;
+
+	iou->tx = calloc_wrp((size_t)nr, sizeof(*iou->tx));
+	if (unlikely(!iou->tx))
+		return -errno;
+
+	iou->tx_ref = calloc_wrp((size_t)thread->pool.nr,
+				 sizeof(*iou->tx_ref));
+	if (unlikely(!iou->tx_ref))
+		return -errno;
+
+	iou->nr_tx   = nr;
+	iou->tx_free = IOU_TX_NONE;
+	for (i = nr; i--;) {
+		tx = &iou->tx[i];
+		tx->msg.msg_name    = &tx->dst;
+		tx->msg.msg_namelen = sizeof(tx->dst);
+		tx->msg.msg_iov     = &tx->iov;
+		tx->msg.msg_iovlen  = 1;
+		tx->next     = iou->tx_free;
+		iou->tx_free = i;
+	}
+
+	return 0;
+}
+
+
+static __hot void iou_rx_buf_give(struct iou_thread *iou, uint16_t bid)
+{
+	struct iou_rx_buf *buf = &iou->rx_bufs[bid];
+	char *hdr = iou_rx_buf_hdr(buf);
+
+	iou_buf_ring_add(iou->rx_br, IOU_RX_BUFS - 1u, iou->rx_br_tail++, hdr,
+			 (uint32_t)((char *)(buf + 1) - hdr), bid);
+}
+
+
+static __cold void iou_free_rx_mshot(struct iou_thread *iou)
+{
+	if (iou->rx_br) {
+		al4096_free_munmap(iou->rx_br, IOU_RX_BUFS *
+				   sizeof(struct iou_buf));
+		iou->rx_br = NULL;
+	}
+
+	if (iou->rx_bufs) {
+		al4096_free_munmap(iou->rx_bufs, IOU_RX_BUFS *
+				   sizeof(*iou->rx_bufs));
+		iou->rx_bufs = NULL;
+	}
+}
+
+
+/*
+ * Register the provided buffer ring for the multishot
+ * recvmsg() on the UDP fd. Not being able to do it is not
+ * an error, we then use the per slot recvmsg().
+ */
+static __cold int init_rx_mshot(struct iou_thread *iou)
+{
+	int ret;
+	uint16_t i;
+
+	iou->rx_br = al4096_malloc_mmap(IOU_RX_BUFS * sizeof(struct iou_buf));
+	if (unlikely(!iou->rx_br))
+		return -errno;
+
+	iou->rx_bufs = al4096_malloc_mmap(IOU_RX_BUFS * sizeof(*iou->rx_bufs));
+	if (unlikely(!iou->rx_bufs))
+		return -errno;
+
+	ret = iou_register_buf_ring(&iou->ring, iou->rx_br, IOU_RX_BUFS,
+				    IOU_RX_BGID);
+	if (ret) {
+		prl_notice(2, "Provided buffer ring is not supported (" PRERF
+			   "), using per packet recvmsg()", PREAR(-ret));
+		iou_free_rx_mshot(iou);
+		return 0;
+	}
+
+	iou->rx_br_tail = 0;
+	for (i = 0; i < IOU_RX_BUFS; i++)
+		iou_rx_buf_give(iou, i);
+	iou_buf_ring_advance(iou->rx_br, iou->rx_br_tail);
+
+	memset(&iou->rx_msg, 0, sizeof(iou->rx_msg));
+	iou->rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+	iou->rx_mshot = true;
+	return 0;
+}
+
+
+static __cold void iou_fill_params(struct iou_thread *iou,
+				   struct io_uring_params *p, unsigned entries,
+				   bool sqpoll)
+{
+	struct srv_udp_state *state = iou->state;
+	struct iou_thread *iou0 = &state->iou_threads[0];
+
+	/*
+	 * Leave enough CQ room for a completion per provided
+	 * buffer and per send on top of the slots.
+	 */
+	memset(p, 0, sizeof(*p));
+	p->flags      = IORING_SETUP_CQSIZE;
+	p->cq_entries = (entries + IOU_RX_BUFS + iou->nr_tx) * 2u;
+
+	if (!sqpoll)
+		return;
+
+	p->flags         |= IORING_SETUP_SQPOLL;
+	p->sq_thread_idle = state->cfg->sock.iouring_sqpoll_idle;
+
+	/*
+	 * All rings share the SQ thread of the first ring, so
+	 * SQPOLL costs one core, not one per thread.
+	 */
+	if (iou != iou0 && iou0->ring_init &&
+	    (iou0->ring.flags & IORING_SETUP_SQPOLL)) {
+		p->flags |= IORING_SETUP_ATTACH_WQ;
+		p->wq_fd  = (uint32_t)iou0->ring.ring_fd;
+	}
+}
+
+
+static __cold int iou_queue_init(struct iou_thread *iou, unsigned entries)
+{
+	int ret;
+	struct io_uring_params p;
+	uint16_t idx = iou->thread->idx;
+
+	if (iou->state->cfg->sock.iouring_sqpoll) {
+		iou_fill_params(iou, &p, entries, true);
+		ret = io_uring_queue_init_params(entries, &iou->ring, &p);
+		if (!ret) {
+			prl_notice(4, "[thread=%hu] io_uring SQPOLL is enabled "
+				   "(idle=%u ms)", idx, p.sq_thread_idle);
+			goto out;
+		}
+
+		pr_warn("[thread=%hu] Cannot set up io_uring SQPOLL (" PRERF
+			"), not using it", idx, PREAR(-ret));
+	}
+
+	iou_fill_params(iou, &p, entries, false);
+	ret = io_uring_queue_init_params(entries, &iou->ring, &p);
+	if (unlikely(ret)) {
+		pr_err("io_uring_queue_init_params(): " PRERF, PREAR(-ret));
+		return ret;
+	}
+out:
+	iou->ring_init = true;
+	return 0;
+}
+
+
+/*
+ * Register the fds and the packet buffers, so the kernel
+ * doesn't need to look them up and map the pages on every
+ * operation. Both are optional, failing is not an error.
+ */
+static __cold void iou_register_fixed(struct iou_thread *iou, const int *fds,
+				      unsigned nr_fds)
+{
+	int ret;
+	struct iovec iov[2];
+	struct pkt_pool *pool = &iou->thread->pool;
+	uint16_t idx = iou->thread->idx;
+
+	ret = io_uring_register_files(&iou->ring, fds, nr_fds);
+	if (unlikely(ret))
+		prl_notice(2, "[thread=%hu] Cannot register fixed files ("
+			   PRERF ")", idx, PREAR(-ret));
+	else
+		iou->fixed_files = true;
+
+	iov[0].iov_base = iou->bufs;
+	iov[0].iov_len  = (size_t)iou->nr_slots * sizeof(*iou->bufs);
+	iov[IOU_BUF_POOL].iov_base = pool->bufs;
+	iov[IOU_BUF_POOL].iov_len  = (size_t)pool->nr * sizeof(*pool->bufs);
+	ret = io_uring_register_buffers(&iou->ring, iov, 2);
+	if (unlikely(ret))
+		prl_notice(2, "[thread=%hu] Cannot register fixed buffers ("
+			   PRERF ")", idx, PREAR(-ret));
+	else
+		iou->fixed_bufs = true;
+}
+
+
+/*
+ * Index of @fd in the registered file table @fds, appending
+ * it if it's not there yet.
+ */
+static __cold uint8_t iou_fidx(int *fds, uint8_t *nr_fds, int fd)
+{
+	uint8_t i;
+
+	for (i = 0; i < *nr_fds; i++) {
+		if (fds[i] == fd)
+			return i;
+	}
+
+	fds[(*nr_fds)++] = fd;
+	return i;
+}
+
+
+static __cold int init_iou_thread(struct srv_udp_state *state,
+				  struct iou_thread *iou,
+				  struct epl_thread *thread)
+{
+	int ret;
+	int fds[5];
+	uint8_t j, nr_tun, nr_fds = 0;
+	uint16_t i, n, nr = thread->recv_batch;
+	unsigned entries = 32;
+
+	iou->state  = state;
+	iou->thread = thread;
+	thread->iou = iou;
+
+	/*
+	 * The registered file table is the UDP fd (thread 0
+	 * only, unless SO_REUSEPORT) followed by the TUN fds,
+	 * then the fds the thread only writes to.
+	 */
+	if (srv_thread_recv_udp(state, thread->idx))
+		fds[nr_fds++] = thread->udp_fd;
+
+	nr_tun = iou_get_tun_fds(state, thread->idx, &fds[nr_fds]);
+	n = (uint16_t)(nr * nr_tun);
+	if (srv_thread_recv_udp(state, thread->idx))
+		n = (uint16_t)(n + nr);
+
+	iou->nr_slots = n;
+	iou->bufs = al4096_malloc_mmap((size_t)n * sizeof(*iou->bufs));
+	if (unlikely(!iou->bufs))
+		return -errno;
+
+	iou->slots = calloc_wrp((size_t)n, sizeof(*iou->slots));
+	if (unlikely(!iou->slots))
+		return -errno;
+
+	iou->rearm = calloc_wrp((size_t)n, sizeof(*iou->rearm));
+	if (unlikely(!iou->rearm))
+		return -errno;
+
+	i = 0;
+	if (srv_thread_recv_udp(state, thread->idx)) {
+		for (; i < nr; i++)
+			iou_init_slot(iou, i, thread->udp_fd, 0,
+				      IOU_SLOT_UDP_RECV);
+	}
+
+	for (j = 0; j < nr_tun; j++) {
+		uint16_t k;
+		uint8_t fidx = (uint8_t)(nr_fds + j);
+
+		for (k = 0; k < nr; k++)
+			iou_init_slot(iou, i++, fds[fidx], fidx,
+				      IOU_SLOT_TUN_READ);
+	}
+	nr_fds = (uint8_t)(nr_fds + nr_tun);
+	iou->udp_fidx = iou_fidx(fds, &nr_fds, thread->udp_fd);
+	iou->tun_fidx = iou_fidx(fds, &nr_fds, thread->tun_fd);
+
+	ret = init_iou_tx(iou);
+	if (unlikely(ret))
+		return ret;
+
+	while (entries < n)
+		entries <<= 1u;
+
+	ret = iou_queue_init(iou, entries);
+	if (unlikely(ret))
+		return ret;
+
+	iou_register_fixed(iou, fds, nr_fds);
+
+	if (srv_thread_recv_udp(state, thread->idx)) {
+		ret = init_rx_mshot(iou);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (iou->rx_mshot && iou->slots[i].type == IOU_SLOT_UDP_RECV)
+			continue;
+
+		ret = iou_arm_slot(iou, i);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	if (iou->rx_mshot) {
+		ret = iou_arm_rx_mshot(iou);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	prl_notice(4, "[thread=%hu] io_uring is ready with %hu slot(s)",
+		   thread->idx, n);
+	return 0;
+}
+
+
+static __cold int init_iou_thread_array(struct srv_udp_state *state)
+{
+	int ret;
+	struct iou_thread *iou;
+	uint8_t i, nn = state->cfg->sys.thread_num;
+
+	iou = calloc_wrp((size_t)nn, sizeof(*iou));
+	if (unlikely(!iou))
+		return -errno;
+
+	state->iou_threads = iou;
+	for (i = 0; i < nn; i++) {
+		ret = init_iou_thread(state, &iou[i], &state->epl_threads[i]);
+		if (unlikely(ret))
+			return ret;
+	}
+
+	return 0;
+}
+
+
+/*
+ * The kernel can't do multishot recvmsg(), arm the per slot
+ * recvmsg() instead.
+ */
+static __cold int iou_rx_mshot_fallback(struct iou_thread *iou, int err)
+{
+	int ret;
+	uint16_t i;
+
+	pr_warn("Multishot recvmsg() is not supported (" PRERF "), "
+		"using per packet recvmsg()", PREAR(-err));
+
+	iou->rx_mshot = false;
+	for (i = 0; i < iou->nr_slots; i++) {
+		if (iou->slots[i].type != IOU_SLOT_UDP_RECV)
+			continue;
+
+		ret = iou_arm_slot(iou, i);
+		if (unlikely(ret))
+			return ret;
+	}
+	return 0;
+}
+
+
+static __hot int iou_handle_rx_mshot(struct iou_thread *iou,
+				     struct io_uring_cqe *cqe)
+{
+	uint16_t bid;
+	int res = cqe->res;
+	struct sockaddr_in saddr;
+	struct iou_rx_buf *buf;
+	struct iou_recvmsg_out out;
+	char *hdr;
+	struct epl_thread *thread = iou->thread;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		iou->rx_mshot_armed = false;
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		/*
+		 * -ENOBUFS: we ran out of provided buffers, the
+		 * multishot is armed again after the used ones
+		 * are given back.
+		 */
+		if (res == -EINVAL && iou->rx_mshot)
+			return iou_rx_mshot_fallback(iou, res);
+
+		if (res < 0 && res != -ENOBUFS && res != -EINTR &&
+		    res != -EAGAIN) {
+			pr_err("[thread=%hu] io_uring recvmsg (multishot): "
+			       PRERF, thread->idx, PREAR(-res));
+			return res;
+		}
+		return 0;
+	}
+
+	bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	buf = &iou->rx_bufs[bid];
+	iou->recycle[iou->nr_recycle++] = bid;
+
+	if (unlikely(res < (int)IOU_RX_HDR_LEN))
+		return 0;
+
+	hdr = iou_rx_buf_hdr(buf);
+	memcpy(&out, hdr, sizeof(out));
+	if (unlikely(out.flags & MSG_TRUNC))
+		/* Not a valid TeaVPN2 packet, drop it. */
+		return 0;
+
+	/*
+	 * Copy the address out before writing @pkt.len, they
+	 * may share the same bytes.
+	 */
+	memcpy(&saddr, hdr + sizeof(out), sizeof(saddr));
+	buf->pkt.len = out.payloadlen;
+	thread->pkt  = &buf->pkt;
+	return srv_udp_handle_pkt(thread, &saddr);
+}
+
+
+static __hot int iou_handle_cqe(struct iou_thread *iou,
+				struct io_uring_cqe *cqe)
+{
+	int ret = 0;
+	int res = cqe->res;
+	uint16_t i;
+	struct iou_slot *slot;
+	struct epl_thread *thread = iou->thread;
+
+	if (cqe->user_data == IOU_UD_RX_MSHOT)
+		return iou_handle_rx_mshot(iou, cqe);
+
+	if (cqe->user_data & IOU_UD_TX)
+		return iou_handle_tx(iou, cqe);
+
+	i    = (uint16_t)cqe->user_data;
+	slot = &iou->slots[i];
+	iou->rearm[iou->nr_rearm++] = i;
+
+	if (unlikely(res <= 0)) {
+		if (res == 0 || res == -EAGAIN || res == -EINTR)
+			return 0;
+
+		pr_err("[thread=%hu] io_uring %s (fd=%d): " PRERF, thread->idx,
+		       (slot->type == IOU_SLOT_UDP_RECV) ? "recvmsg" : "read",
+		       slot->fd, PREAR(-res));
+		return res;
+	}
+
+	thread->pkt = &iou->bufs[i];
+	if (slot->type == IOU_SLOT_UDP_RECV) {
+		thread->pkt->len = (size_t)res;
+		ret = srv_udp_handle_pkt(thread, &slot->saddr);
+	} else {
+		ret = srv_tun_route_pkt(thread, (ssize_t)res);
+	}
+
+	return ret;
+}
+
+
+/*
+ * Process the completed operations. The completed slots are
+ * armed again only after the tx batch is flushed, because the
+ * queued packets still point to their buffers.
+ *
+ * The flush (and every other send) queues SQEs on this ring,
+ * see iou_tx_sendto() and iou_tx_write_tun(). They are
+ * submitted with the re-armed slots, so with SQPOLL the data
+ * path makes no syscall while the SQ thread is awake.
+ */
+static __hot int iou_handle_completions(struct iou_thread *iou)
+{
+	int ret = 0, tmp;
+	unsigned head, n = 0;
+	uint16_t i;
+	struct io_uring_cqe *cqe;
+	struct epl_thread *thread = iou->thread;
+
+	io_uring_for_each_cqe(&iou->ring, head, cqe) {
+		n++;
+		tmp = iou_handle_cqe(iou, cqe);
+		if (unlikely(tmp && !ret))
+			ret = tmp;
+	}
+	io_uring_cq_advance(&iou->ring, n);
+
+	tmp = srv_udp_flush(thread);
+	if (!ret)
+		ret = tmp;
+
+	thread->pkt = thread->pkts[0];
+
+	for (i = 0; i < iou->nr_rearm; i++) {
+		tmp = iou_arm_slot(iou, iou->rearm[i]);
+		if (unlikely(tmp && !ret))
+			ret = tmp;
+	}
+	iou->nr_rearm = 0;
+
+	if (iou->nr_recycle) {
+		for (i = 0; i < iou->nr_recycle; i++)
+			iou_rx_buf_give(iou, iou->recycle[i]);
+		iou_buf_ring_advance(iou->rx_br, iou->rx_br_tail);
+		iou->nr_recycle = 0;
+	}
+
+	if (iou->rx_mshot && !iou->rx_mshot_armed) {
+		tmp = iou_arm_rx_mshot(iou);
+		if (unlikely(tmp && !ret))
+			ret = tmp;
+	}
+
+	return ret;
+}
+
+
+__hot int iou_run_event_loop(struct epl_thread *thread)
+{
+	int ret;
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec ts = {
+		.tv_sec  = EPOLL_TIMEOUT / 1000,
+		.tv_nsec = 0
+	};
+	struct iou_thread *iou = &thread->state->iou_threads[thread->idx];
+
+	ret = io_uring_submit(&iou->ring);
+	if (unlikely(ret < 0)) {
+		if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY)
+			return 0;
+
+		pr_err("[thread=%hu] io_uring_submit(): " PRERF, thread->idx,
+		       PREAR(-ret));
+		return ret;
+	}
+
+	ret = io_uring_wait_cqe_timeout(&iou->ring, &cqe, &ts);
+	if (unlikely(ret)) {
+		if (ret == -ETIME || ret == -EAGAIN)
+			return 0;
+
+		if (ret == -EINTR) {
+			prl_notice(2, "[thread=%hu] Interrupted!", thread->idx);
+			return 0;
+		}
+
+		pr_err("[thread=%hu] io_uring_wait_cqe_timeout(): " PRERF,
+		       thread->idx, PREAR(-ret));
+		return ret;
+	}
+
+	coarse_clock_update();
+	return iou_handle_completions(iou);
+}
+
+
+static __cold void destroy_iou_thread_array(struct srv_udp_state *state)
+{
+	uint8_t i, nn = state->cfg->sys.thread_num;
+	struct iou_thread *iou = state->iou_threads;
+
+	if (unlikely(!iou))
+		return;
+
+	for (i = 0; i < nn; i++) {
+		if (iou[i].ring_init)
+			io_uring_queue_exit(&iou[i].ring);
+
+		if (iou[i].bufs)
+			al4096_free_munmap(iou[i].bufs, (size_t)iou[i].nr_slots *
+					   sizeof(*iou[i].bufs));
+
+		iou_free_rx_mshot(&iou[i]);
+		al64_free(iou[i].slots);
+		al64_free(iou[i].rearm);
+		al64_free(iou[i].tx);
+		al64_free(iou[i].tx_ref);
+	}
+
+	al64_free(iou);
+	state->iou_threads = NULL;
+}
+
+
+int teavpn2_udp_server_io_uring(struct srv_udp_state *state)
+{
+	int ret;
+
+	ret = srv_udp_init_threads(state);
+	if (unlikely(ret))
+		goto out;
+
+	ret = init_iou_thread_array(state);
+	if (unlikely(ret))
+		goto out;
+
+	state->stop = false;
+	ret = srv_udp_run_threads(state);
+out:
+	srv_udp_destroy_threads(state);
+	if (!state->threads_wont_exit)
+		destroy_iou_thread_array(state);
+	return ret;
+}
@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2021  Ammar Faizi
+ *
+ * IGMP snooping, multicast is only delivered to the clients
+ * that joined the group.
+ */
+
+#include <netinet/in.h>
+#include <teavpn2/server/linux/udp.h>
+
+#define IGMP_QUERY		0x11u
+#define IGMPV1_REPORT		0x12u
+#define IGMPV2_REPORT		0x16u
+#define IGMPV2_LEAVE		0x17u
+#define IGMPV3_REPORT		0x22u
+
+/*
+ * IGMPv3 group record types (RFC 3376, section 4.2.12).
+ */
+#define IGMPV3_MODE_IS_INCLUDE	1u
+#define IGMPV3_CHANGE_TO_INCLUDE 3u
+#define IGMPV3_BLOCK_OLD	6u
+
+#define IGMP_QUERY_IP_LEN	24u
+#define IGMP_QUERY_LEN		12u
+
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24u) | ((uint32_t)p[1] << 16u) |
+	       ((uint32_t)p[2] << 8u) | (uint32_t)p[3];
+}
+
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+	return (uint16_t)((p[0] << 8u) | p[1]);
+}
+
+
+static inline bool mcast_snoopable(uint32_t group)
+{
+	return IN_MULTICAST(group) && !mcast_is_local(group);
+}
+
+
+static struct mcast_group *mcast_find(struct mcast_table *mc, uint32_t group)
+{
+	uint32_t i;
+
+	for (i = 0; i < mc->nr; i++) {
+		if (mc->grp[i].addr == group)
+			return &mc->grp[i];
+	}
+
+	return NULL;
+}
+
+
+static void mcast_group_free(struct mcast_table *mc, struct mcast_group *g)
+{
+	if (g->mbr)
+		al64_free(g->mbr);
+
+	*g = mc->grp[--mc->nr];
+	memset(&mc->grp[mc->nr], 0, sizeof(mc->grp[mc->nr]));
+}
+
+
+static void mcast_member_remove(struct mcast_table *mc, struct mcast_group *g,
+				uint32_t i)
+{
+	g->mbr[i] = g->mbr[--g->nr];
+	if (g->nr == 0)
+		mcast_group_free(mc, g);
+}
+
+
+static int mcast_group_grow(struct mcast_group *g)
+{
+	uint32_t cap = g->cap ? g->cap * 2u : 4u;
+	struct mcast_member *mbr;
+
+	mbr = calloc_wrp((size_t)cap, sizeof(*mbr));
+	if (unlikely(!mbr))
+		return -errno;
+
+	if (g->mbr) {
+		memcpy(mbr, g->mbr, (size_t)g->nr * sizeof(*mbr));
+		al64_free(g->mbr);
+	}
+
+	g->mbr = mbr;
+	g->cap = cap;
+	return 0;
+}
+
+
+static void mcast_join(struct srv_udp_state *state, struct udp_sess *sess,
+		       uint32_t group, uint32_t now)
+	__acquires(&state->mcast.lock)
+	__releases(&state->mcast.lock)
+{
+	struct mcast_table *mc = &state->mcast;
+	struct mcast_group *g;
+	uint32_t i;
+
+	mutex_lock(&mc->lock);
+	g = mcast_find(mc, group);
+	if (!g) {
+		if (unlikely(mc->nr == MCAST_MAX_GROUPS)) {
+			mc->full_until = now + MCAST_MEMBER_TTL;
+			goto full;
+		}
+
+		g = &mc->grp[mc->nr++];
+		g->addr = group;
+	}
+
+	for (i = 0; i < g->nr; i++) {
+		if (g->mbr[i].idx == sess->idx) {
+			g->mbr[i].expire = now + MCAST_MEMBER_TTL;
+			goto out;
+		}
+	}
+
+	if (g->nr == g->cap && unlikely(mcast_group_grow(g))) {
+		if (g->nr == 0)
+			mcast_group_free(mc, g);
+		mc->full_until = now + MCAST_MEMBER_TTL;
+		goto full;
+	}
+
+	g->mbr[g->nr].idx    = sess->idx;
+	g->mbr[g->nr].expire = now + MCAST_MEMBER_TTL;
+	g->nr++;
+	mutex_unlock(&mc->lock);
+	prl_notice(4, PRWIU " joined multicast group %u.%u.%u.%u",
+		   W_IU(sess), group >> 24u, (group >> 16u) & 0xffu,
+		   (group >> 8u) & 0xffu, group & 0xffu);
+	return;
+
+full:
+	mutex_unlock(&mc->lock);
+	prl_notice(2, "Multicast group table is full, flooding unknown "
+		   "groups for %d seconds", MCAST_MEMBER_TTL);
+	return;
+out:
+	mutex_unlock(&mc->lock);
+}
+
+
+static void mcast_leave(struct srv_udp_state *state, struct udp_sess *sess,
+			uint32_t group)
+	__acquires(&state->mcast.lock)
+	__releases(&state->mcast.lock)
+{
+	struct mcast_table *mc = &state->mcast;
+	struct mcast_group *g;
+	uint32_t i;
+
+	mutex_lock(&mc->lock);
+	g = mcast_find(mc, group);
+	if (!g)
+		goto out;
+
+	/*
+	 * Every session is its own port, so a leave is taken
+	 * right away (no last member query).
+	 */
+	for (i = 0; i < g->nr; i++) {
+		if (g->mbr[i].idx == sess->idx) {
+			mcast_member_remove(mc, g, i);
+			break;
+		}
+	}
+out:
+	mutex_unlock(&mc->lock);
+}
+
+
+static void mcast_snoop_v3(struct srv_udp_state *state, struct udp_sess *sess,
+			   const uint8_t *igmp, size_t len, uint32_t now)
+{
+	uint16_t nr_rec = get_be16(&igmp[6]);
+	size_t off = 8;
+
+	while (nr_rec--) {
+		const uint8_t *rec = &igmp[off];
+		uint8_t type;
+		uint16_t nr_src;
+		uint32_t group;
+
+		if (off + 8 > len)
+			return;
+
+		type   = rec[0];
+		nr_src = get_be16(&rec[2]);
+		group  = get_be32(&rec[4]);
+		off   += 8u + (size_t)nr_src * 4u + (size_t)rec[1] * 4u;
+		if (!mcast_snoopable(group))
+			continue;
+
+		/*
+		 * INCLUDE with an empty source list is a leave. Any
+		 * other record means the client wants (some of) the
+		 * group, source filtering is not tracked.
+		 */
+		if ((type == IGMPV3_MODE_IS_INCLUDE ||
+		     type == IGMPV3_CHANGE_TO_INCLUDE) && nr_src == 0)
+			mcast_leave(state, sess, group);
+		else if (type >= IGMPV3_MODE_IS_INCLUDE && type < IGMPV3_BLOCK_OLD)
+			mcast_join(state, sess, group, now);
+	}
+}
+
+
+/*
+ * Learn the group membership of @sess from the IGMP packet
+ * it sent to the tunnel. @pkt is the IPv4 packet.
+ */
+void mcast_snoop_igmp(struct srv_udp_state *state, struct udp_sess *sess,
+		      const uint8_t *pkt, size_t len)
+{
+	uint32_t now = (uint32_t)coarse_now();
+	const uint8_t *igmp;
+	size_t ihl, tot_len;
+	uint32_t group;
+
+	if (unlikely(!sess->is_authenticated || len < 20))
+		return;
+
+	ihl = (size_t)(pkt[0] & 0xfu) * 4u;
+	tot_len = get_be16(&pkt[2]);
+	if (tot_len < len)
+		len = tot_len;
+	if (ihl < 20 || len < ihl + 8)
+		return;
+
+	igmp = &pkt[ihl];
+	len -= ihl;
+	group = get_be32(&igmp[4]);
+
+	switch (igmp[0]) {
+	case IGMPV1_REPORT:
+	case IGMPV2_REPORT:
+		if (mcast_snoopable(group))
+			mcast_join(state, sess, group, now);
+		break;
+	case IGMPV2_LEAVE:
+		if (mcast_snoopable(group))
+			mcast_leave(state, sess, group);
+		break;
+	case IGMPV3_REPORT:
+		mcast_snoop_v3(state, sess, igmp, len, now);
+		break;
+	}
+}
+
+
+/*
+ * Copy up to @max member session indexes of @group, starting
+ * from the @off-th member, to @idx. Returns the number of
+ * copied indexes, -ENOENT if nobody joined @group, or -ENOSPC
+ * if we don't know because the group table overflowed.
+ */
+int mcast_get_members(struct srv_udp_state *state, uint32_t group,
+		      uint32_t off, uint32_t *idx, uint32_t max)
+	__acquires(&state->mcast.lock)
+	__releases(&state->mcast.lock)
+{
+	struct mcast_table *mc = &state->mcast;
+	struct mcast_group *g;
+	int ret;
+
+	mutex_lock(&mc->lock);
+	g = mcast_find(mc, group);
+	if (!g) {
+		ret = -ENOENT;
+		if ((int32_t)(mc->full_until - (uint32_t)coarse_now()) > 0)
+			ret = -ENOSPC;
+		goto out;
+	}
+
+	ret = 0;
+	while (off < g->nr && (uint32_t)ret < max)
+		idx[ret++] = g->mbr[off++].idx;
+out:
+	mutex_unlock(&mc->lock);
+	return ret;
+}
+
+
+/*
+ * Drop all memberships of the session @idx.
+ */
+void mcast_del_sess(struct srv_udp_state *state, uint32_t idx)
+	__acquires(&state->mcast.lock)
+	__releases(&state->mcast.lock)
+{
+	struct mcast_table *mc = &state->mcast;
+	uint32_t i, j;
+
+	mutex_lock(&mc->lock);
+	for (i = mc->nr; i--;) {
+		struct mcast_group *g = &mc->grp[i];
+
+		for (j = 0; j < g->nr; j++) {
+			if (g->mbr[j].idx == idx) {
+				mcast_member_remove(mc, g, j);
+				break;
+			}
+		}
+	}
+	mutex_unlock(&mc->lock);
+}
+
+
+void mcast_expire(struct srv_udp_state *state, uint32_t now)
+	__acquires(&state->mcast.lock)
+	__releases(&state->mcast.lock)
+{
+	struct mcast_table *mc = &state->mcast;
+	uint32_t i, j;
+
+	mutex_lock(&mc->lock);
+	for (i = mc->nr; i--;) {
+		struct mcast_group *g = &mc->grp[i];
+
+		for (j = g->nr; j--;) {
+			bool last = (g->nr == 1);
+
+			if ((int32_t)(g->mbr[j].expire - now) > 0)
+				continue;
+
+			/*
+			 * Removing the last member frees the group, its
+			 * slot is taken by a group we have seen already.
+			 */
+			mcast_member_remove(mc, g, j);
+			if (last)
+				break;
+		}
+	}
+	mutex_unlock(&mc->lock);
+}
+
+
+/*
+ * Build an IGMPv3 general query from the server to the
+ * all-hosts group in @buf. Returns the IP packet length.
+ */
+size_t igmp_query_prep(struct srv_udp_state *state, uint8_t *buf)
+{
+	uint8_t *igmp = &buf[IGMP_QUERY_IP_LEN];
+	uint32_t src = htonl(state->ipv4_addr);
+	uint32_t dst = htonl(INADDR_ALLHOSTS_GROUP);
+	uint16_t csum, tot_len = IGMP_QUERY_IP_LEN + IGMP_QUERY_LEN;
+
+	memset(buf, 0, tot_len);
+	buf[0] = 0x46;		/* IPv4, 24 bytes header. */
+	buf[1] = 0xc0;		/* Internetwork control. */
+	buf[2] = (uint8_t)(tot_len >> 8u);
+	buf[3] = (uint8_t)tot_len;
+	buf[8] = 1;		/* TTL */
+	buf[9] = IPPROTO_IGMP;
+	memcpy(&buf[12], &src, sizeof(src));
+	memcpy(&buf[16], &dst, sizeof(dst));
+	buf[20] = 0x94;		/* Router alert. */
+	buf[21] = 0x04;
+	csum = inet_csum(buf, IGMP_QUERY_IP_LEN);
+	memcpy(&buf[10], &csum, sizeof(csum));
+
+	igmp[0] = IGMP_QUERY;
+	igmp[1] = 100;		/* Max resp time, 10 seconds. */
+	igmp[8] = 2;		/* QRV */
+	igmp[9] = MCAST_QUERY_IVAL;
+	csum = inet_csum(igmp, IGMP_QUERY_LEN);
+	memcpy(&igmp[2], &csum, sizeof(csum));
+	return tot_len;
+}
+
+
+int init_udp_mcast(struct srv_udp_state *state)
+{
+	int ret;
+
+	prl_notice(4, "Initializing multicast group table...");
+	ret = mutex_init(&state->mcast.lock, NULL);
+	if (unlikely(ret))
+		return -ret;
+
+	return 0;
+}
+
+
+void destroy_udp_mcast(struct srv_udp_state *state)
+{
+	struct mcast_table *mc = &state->mcast;
+	uint32_t i;
+
+	for (i = 0; i < mc->nr; i++) {
+		if (mc->grp[i].mbr)
+			al64_free(mc->grp[i].mbr);
+	}
+	mc->nr = 0;
+}
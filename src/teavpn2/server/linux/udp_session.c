@@ -8,61 +8,291 @@
 #include <teavpn2/server/linux/udp.h>
 
 
-static __always_inline struct udp_map_bucket *addr_to_bkt(
-	struct udp_map_bucket (*sess_map)[0x100u], uint32_t addr)
+/*
+ * Fibonacci hashing of the (addr, port) tuple, the top bits of
+ * the product are the home slot.
+ */
+static __always_inline uint32_t sess_map_home(struct srv_udp_state *state,
+					      uint32_t addr, uint16_t port)
+{
+	uint64_t key = ((uint64_t)addr << 16u) | (uint64_t)port;
+
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> state->sess_map_shift);
+}
+
+
+/*
+ * How far is the slot at @pos from its home slot?
+ */
+static __always_inline uint32_t sess_map_dist(struct srv_udp_state *state,
+					      struct udp_map_slot *slot,
+					      uint32_t pos)
+{
+	uint32_t home = sess_map_home(state, slot->addr, slot->port);
+
+	return (pos - home) & state->sess_map_mask;
+}
+
+
+static __always_inline struct udp_map_slot slot_load(struct udp_map_slot *slot)
+{
+	struct udp_map_slot ret;
+
+	ret.raw[0] = __atomic_load_n(&slot->raw[0], __ATOMIC_RELAXED);
+	ret.raw[1] = __atomic_load_n(&slot->raw[1], __ATOMIC_RELAXED);
+	return ret;
+}
+
+
+static __always_inline void slot_store(struct udp_map_slot *slot,
+				       struct udp_map_slot val)
+{
+	__atomic_store_n(&slot->raw[0], val.raw[0], __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->raw[1], val.raw[1], __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Must be called with @state->sess_map_lock held.
+ */
+static __always_inline void sess_map_write_begin(struct srv_udp_state *state)
+{
+	uint32_t seq = atomic_load_explicit(&state->sess_map_seq,
+					    memory_order_relaxed);
+
+	atomic_store_explicit(&state->sess_map_seq, seq + 1u,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+
+static __always_inline void sess_map_write_end(struct srv_udp_state *state)
 {
-	size_t idx1, idx2;
-	idx1 = (addr >> 0u) & 0xffu;
-	idx2 = (addr >> 8u) & 0xffu;
-	return &(sess_map[idx1][idx2]);
+	uint32_t seq = atomic_load_explicit(&state->sess_map_seq,
+					    memory_order_relaxed);
+
+	atomic_store_explicit(&state->sess_map_seq, seq + 1u,
+			      memory_order_release);
 }
 
 
-static struct udp_sess *map_insert_udp_sess(struct srv_udp_state *state,
-					    uint32_t addr,
-					    struct udp_sess *sess)
+static __always_inline uint32_t sess_map_read_begin(struct srv_udp_state *state)
+{
+	uint32_t seq;
+
+	while (true) {
+		seq = atomic_load_explicit(&state->sess_map_seq,
+					   memory_order_acquire);
+		if (likely(!(seq & 1u)))
+			return seq;
+
+		__asm__ volatile("":::"memory");
+	}
+}
+
+
+static __always_inline bool sess_map_read_retry(struct srv_udp_state *state,
+						uint32_t seq)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&state->sess_map_seq,
+				    memory_order_relaxed) != seq;
+}
+
+
+static void map_insert_udp_sess(struct srv_udp_state *state, uint32_t addr,
+			       struct udp_sess *sess)
 	__acquires(&state->sess_map_lock)
 	__releases(&state->sess_map_lock)
 {
-	struct udp_sess *ret = sess;
-	struct udp_map_bucket *bkt, *new_bkt;
+	uint32_t pos, dist = 0;
+	struct udp_map_slot *map = state->sess_map;
+	struct udp_map_slot cur = {
+		.addr = addr,
+		.port = sess->src_port,
+		.idx  = sess->idx + 1u
+	};
 
-	bkt = addr_to_bkt(state->sess_map, addr);
 	mutex_lock(&state->sess_map_lock);
-	if (!bkt->sess) {
-		bkt->sess = sess;
-		/* If first entry is empty, there should be no next! */
-		if (WARN_ON(bkt->next != NULL))
-			bkt->next = NULL;
-		goto out;
+	sess_map_write_begin(state);
+	pos = sess_map_home(state, addr, cur.port);
+	while (map[pos].idx) {
+		uint32_t slot_dist = sess_map_dist(state, &map[pos], pos);
+
+		/*
+		 * Robin Hood: take the slot from an entry that is
+		 * closer to its home than we are, and carry on
+		 * inserting that entry instead.
+		 */
+		if (slot_dist < dist) {
+			struct udp_map_slot tmp = map[pos];
+
+			slot_store(&map[pos], cur);
+			cur  = tmp;
+			dist = slot_dist;
+		}
+
+		pos = (pos + 1u) & state->sess_map_mask;
+		dist++;
 	}
+	slot_store(&map[pos], cur);
+	sess_map_write_end(state);
+	mutex_unlock(&state->sess_map_lock);
+}
 
-	new_bkt = malloc(sizeof(*new_bkt));
-	if (unlikely(!new_bkt)) {
-		ret = NULL;
-		goto out;
+
+static void tw_link_slot(struct srv_udp_state *state, struct udp_sess *sess,
+			 uint8_t lvl, uint8_t slot)
+{
+	struct udp_sess_info *info = sess->info;
+	uint32_t *head = &state->zr.tw.slots[lvl][slot];
+
+	info->tw_prev = 0;
+	info->tw_next = *head;
+	if (*head)
+		state->sess_info[*head - 1u].tw_prev = sess->idx + 1u;
+
+	*head = sess->idx + 1u;
+	info->tw_lvl   = lvl;
+	info->tw_slot  = slot;
+	info->tw_armed = true;
+}
+
+
+static void tw_unlink(struct srv_udp_state *state, struct udp_sess *sess)
+{
+	struct udp_sess_info *info = sess->info;
+
+	if (info->tw_prev)
+		state->sess_info[info->tw_prev - 1u].tw_next = info->tw_next;
+	else
+		state->zr.tw.slots[info->tw_lvl][info->tw_slot] = info->tw_next;
+
+	if (info->tw_next)
+		state->sess_info[info->tw_next - 1u].tw_prev = info->tw_prev;
+
+	info->tw_armed = false;
+}
+
+
+static void tw_link(struct srv_udp_state *state, struct udp_sess *sess,
+		    uint32_t expire)
+{
+	uint32_t now = state->zr.tw.now;
+
+	/*
+	 * Never arm on the slot being expired, and a deadline
+	 * beyond the range of level 1 just fires early and gets
+	 * re-armed.
+	 */
+	if (expire <= now)
+		expire = now + 1u;
+	if (expire - now >= TW_SIZE * (TW_SIZE - 1u))
+		expire = now + TW_SIZE * (TW_SIZE - 1u);
+
+	sess->info->tw_expire = expire;
+	if (expire - now < TW_SIZE)
+		tw_link_slot(state, sess, 0, (uint8_t)(expire & TW_MASK));
+	else
+		tw_link_slot(state, sess, 1,
+			     (uint8_t)((expire >> TW_BITS) & TW_MASK));
+}
+
+
+/*
+ * Move the level 1 slot of the block that starts at
+ * @state->zr.tw.now down to level 0.
+ */
+static void tw_cascade(struct srv_udp_state *state)
+{
+	struct timer_wheel *tw = &state->zr.tw;
+	uint32_t *head = &tw->slots[1][(tw->now >> TW_BITS) & TW_MASK];
+	uint32_t idx = *head;
+
+	*head = 0;
+	while (idx) {
+		struct udp_sess *sess = &state->sess_arr[idx - 1u];
+		uint32_t expire = sess->info->tw_expire;
+
+		idx = sess->info->tw_next;
+		tw_link_slot(state, sess, 0, (uint8_t)(expire & TW_MASK));
 	}
+}
 
-	new_bkt->next = NULL;
-	new_bkt->sess = sess;
 
-	while (bkt->next)
-		bkt = bkt->next;
+/*
+ * (Re-)arm the timer of @sess to fire at @expire (coarse clock).
+ */
+void udp_sess_arm_timer(struct srv_udp_state *state, struct udp_sess *sess,
+			time_t expire)
+	__acquires(&state->zr.tw_lock)
+	__releases(&state->zr.tw_lock)
+{
+	mutex_lock(&state->zr.tw_lock);
+	if (sess->info->tw_armed)
+		tw_unlink(state, sess);
+	tw_link(state, sess, (uint32_t)expire);
+	mutex_unlock(&state->zr.tw_lock);
+}
 
-	bkt->next = new_bkt;
-out:
-	mutex_unlock(&state->sess_map_lock);
-	return ret;
+
+/*
+ * Take one session whose deadline is at or before @now off
+ * the wheel, returns NULL when there is none left. The caller
+ * re-arms the session if it stays alive. @gen is set to the
+ * generation of the session, for delete_udp_session().
+ */
+struct udp_sess *pop_expired_udp_sess(struct srv_udp_state *state, time_t now,
+				      uint32_t *gen)
+	__acquires(&state->zr.tw_lock)
+	__releases(&state->zr.tw_lock)
+{
+	struct timer_wheel *tw = &state->zr.tw;
+	struct udp_sess *sess = NULL;
+	uint32_t idx;
+
+	mutex_lock(&state->zr.tw_lock);
+	while (true) {
+		idx = tw->slots[0][tw->now & TW_MASK];
+		if (idx) {
+			sess = &state->sess_arr[idx - 1u];
+			*gen = atomic_load_explicit(&sess->gen,
+						    memory_order_acquire);
+			tw_unlink(state, sess);
+			break;
+		}
+
+		if (tw->now >= (uint32_t)now)
+			break;
+
+		tw->now++;
+		if (!(tw->now & TW_MASK))
+			tw_cascade(state);
+	}
+	mutex_unlock(&state->zr.tw_lock);
+	return sess;
+}
+
+
+static void disarm_udp_sess_timer(struct srv_udp_state *state,
+				  struct udp_sess *sess)
+	__acquires(&state->zr.tw_lock)
+	__releases(&state->zr.tw_lock)
+{
+	mutex_lock(&state->zr.tw_lock);
+	if (sess->info->tw_armed)
+		tw_unlink(state, sess);
+	mutex_unlock(&state->zr.tw_lock);
 }
 
 
 struct udp_sess *create_udp_sess(struct srv_udp_state *state, uint32_t addr,
-				 uint16_t port)
+				 uint16_t port, uint32_t *gen)
 	__acquires(&state->sess_map_lock)
 	__releases(&state->sess_map_lock)
 {
 	int err = 0;
-	uint16_t idx;
+	uint32_t idx;
 	int32_t stk_ret;
 	struct udp_sess *sess, *ret = NULL;
 
@@ -74,23 +304,22 @@ struct udp_sess *create_udp_sess(struct srv_udp_state *state, uint32_t addr,
 		goto out;
 	}
 
-	idx = (uint16_t)stk_ret;
+	idx = (uint32_t)stk_ret;
 	sess = &state->sess_arr[idx];
 	sess->src_addr = addr;
 	sess->src_port = port;
-	ret = map_insert_udp_sess(state, addr, sess);
-	if (unlikely(!ret)) {
-		BUG_ON(bt_stack_push(&state->sess_stk, idx) == -1);
-		pr_err("Cannot allocate memory on map_insert_udp_sess()!");
-		err = ENOMEM;
-		goto out;
-	}
+	*gen = atomic_fetch_add_explicit(&sess->gen, 1u,
+					 memory_order_release) + 1u;
+	map_insert_udp_sess(state, addr, sess);
+	ret = sess;
 
 	addr = htonl(addr);
-	WARN_ON(!inet_ntop(AF_INET, &addr, sess->str_src_addr,
-			   sizeof(sess->str_src_addr)));
+	WARN_ON(!inet_ntop(AF_INET, &addr, sess->info->str_src_addr,
+			   sizeof(sess->info->str_src_addr)));
 
 	udp_sess_update_last_act(sess);
+	udp_sess_arm_timer(state, sess,
+			   sess->last_act + UDP_SESS_TIMEOUT_NO_AUTH + 1);
 	atomic_store(&sess->is_connected, true);
 	atomic_fetch_add(&state->n_on_sess, 1);
 out:
@@ -100,96 +329,263 @@ out:
 }
 
 
-struct udp_sess * __hot lookup_udp_sess(struct srv_udp_state *state,
+/*
+ * Returns the session index plus one, or 0 if not found.
+ *
+ * The map may be modified under us, but the loop always ends:
+ * the table is never more than half full, so there's always an
+ * empty slot to stop at.
+ */
+static __hot uint32_t map_find_udp_sess(struct srv_udp_state *state,
 					uint32_t addr, uint16_t port)
-	__acquires(&state->sess_map_lock)
-	__releases(&state->sess_map_lock)
 {
-	struct udp_sess *ret;
-	struct udp_map_bucket *bkt;
+	uint32_t pos, dist = 0;
+	struct udp_map_slot *map = state->sess_map;
+
+	pos = sess_map_home(state, addr, port);
+	while (true) {
+		struct udp_map_slot slot = slot_load(&map[pos]);
+
+		if (!slot.idx)
+			return 0;
+
+		if (slot.addr == addr && slot.port == port)
+			return slot.idx;
+
+		/*
+		 * Our key would have displaced this entry, so it
+		 * is not in the table.
+		 */
+		if (sess_map_dist(state, &slot, pos) < dist)
+			return 0;
+
+		pos = (pos + 1u) & state->sess_map_mask;
+		dist++;
+	}
+}
+
+
+/*
+ * @gen is set to the generation of the returned session. The
+ * session may still be deleted while the caller uses it, the
+ * caller must pass @gen to delete_udp_session().
+ */
+struct udp_sess * __hot lookup_udp_sess(struct srv_udp_state *state,
+					uint32_t addr, uint16_t port,
+					uint32_t *gen)
+{
+	uint32_t seq, idx;
+	struct udp_sess *sess;
 
-	bkt = addr_to_bkt(state->sess_map, addr);
-	mutex_lock(&state->sess_map_lock);
 	do {
-		ret = bkt->sess;
-		if (ret) {
-			if ((ret->src_addr == addr) && (ret->src_port == port))
-				goto out;
-			else
-				ret = NULL;
-		}
+		seq = sess_map_read_begin(state);
+		idx = map_find_udp_sess(state, addr, port);
+	} while (unlikely(sess_map_read_retry(state, seq)));
 
-		bkt = bkt->next;
-	} while (bkt);
-out:
-	mutex_unlock(&state->sess_map_lock);
-	return ret;
+	if (!idx)
+		return NULL;
+
+	/*
+	 * The seqlock only covers the map. The session may have
+	 * been deleted, and its slot taken by another client,
+	 * since we read it.
+	 */
+	sess = &state->sess_arr[idx - 1u];
+	*gen = atomic_load_explicit(&sess->gen, memory_order_acquire);
+	if (unlikely(!(*gen & 1u) || sess->src_addr != addr ||
+		     sess->src_port != port))
+		return NULL;
+
+	return sess;
 }
 
 
-static int remove_sess_from_bkt(struct srv_udp_state *state,
-				struct udp_sess *cur_sess)
+static int map_remove_udp_sess(struct srv_udp_state *state,
+			       struct udp_sess *cur_sess)
 	__acquires(&state->sess_map_lock)
 	__releases(&state->sess_map_lock)
 {
-	int ret = 0;
-	struct udp_sess *sess;
-	struct udp_map_bucket *prev = NULL, *cur, *tmp;
+	uint32_t pos, next, dist = 0;
+	struct udp_map_slot *map = state->sess_map;
+	uint32_t mask = state->sess_map_mask;
+	uint32_t idx = cur_sess->idx + 1u;
 
-	cur = addr_to_bkt(state->sess_map, cur_sess->src_addr);
+	pos = sess_map_home(state, cur_sess->src_addr, cur_sess->src_port);
 	mutex_lock(&state->sess_map_lock);
-	do {
-		sess = cur->sess;
-		if (sess == cur_sess)
-			goto do_remove;
+	while (map[pos].idx != idx) {
+		if (!map[pos].idx || sess_map_dist(state, &map[pos], pos) < dist) {
+			mutex_unlock(&state->sess_map_lock);
+			errno = ENOENT;
+			return -ENOENT;
+		}
 
-		prev = cur;
-		cur  = cur->next;
-	} while (cur);
+		pos = (pos + 1u) & mask;
+		dist++;
+	}
 
-	ret = -ENOENT;
-	goto out;
+	/*
+	 * Backward shift deletion: pull the following entries
+	 * one slot closer to their home until we hit an empty
+	 * slot or an entry that already sits at its home.
+	 */
+	sess_map_write_begin(state);
+	while (true) {
+		next = (pos + 1u) & mask;
+		if (!map[next].idx || !sess_map_dist(state, &map[next], next))
+			break;
 
-do_remove:
-	cur->sess = NULL;
-	if (prev == NULL) {
-		/*
-		 * WARNING!!!
-		 * It is illegal to `free(cur)` when `prev == NULL`.
-		 */
-		if (cur->next) {
-			tmp = cur->next->next;
-			cur->sess = cur->next->sess;
-			free(cur->next);
-			cur->next = tmp;
-			pr_debug("put case 0");
-		} else {
-			/* Pass! */
-			pr_debug("put case 1");
-		}
+		slot_store(&map[pos], map[next]);
+		pos = next;
+	}
+	slot_store(&map[pos], (struct udp_map_slot){ .idx = 0 });
+	sess_map_write_end(state);
+	mutex_unlock(&state->sess_map_lock);
+	return 0;
+}
+
+
+/*
+ * Load the routes of an authenticated session. A route that can't
+ * be loaded (e.g. another session already has it) is not fatal,
+ * the session just won't get the packets for it.
+ */
+static __cold void add_sess_routes(struct srv_udp_state *state,
+				   struct udp_sess *sess, uint32_t ipv4_iff,
+				   const struct auth_routes *routes)
+{
+	struct udp_sess_info *info = sess->info;
+	char str_addr[IPV4_L];
+	struct in_addr in;
+	uint8_t i;
+	int ret;
+
+	ret = add_ipv4_route(state, ipv4_iff, 32, sess->idx);
+	if (likely(!ret)) {
+		sess->ipv4_iff = ipv4_iff;
 	} else {
-		pr_debug("put case 2");
-		tmp = cur->next;
-		free(cur);
-		prev->next = tmp;
+		in.s_addr = htonl(ipv4_iff);
+		inet_ntop(AF_INET, &in, str_addr, sizeof(str_addr));
+		pr_warn("Cannot route private IP %s to " PRWIU ": " PRERF,
+			str_addr, W_IU(sess), PREAR(-ret));
 	}
+
+	for (i = 0; i < routes->nr; i++) {
+		const struct auth_route *r = &routes->arr[i];
+
+		in.s_addr = htonl(r->addr);
+		inet_ntop(AF_INET, &in, str_addr, sizeof(str_addr));
+		ret = add_ipv4_route(state, r->addr, r->prefix, sess->idx);
+		if (unlikely(ret)) {
+			pr_warn("Cannot route %s/%u to " PRWIU ": " PRERF,
+				str_addr, r->prefix, W_IU(sess), PREAR(-ret));
+			continue;
+		}
+
+		prl_notice(2, "Routing %s/%u to " PRWIU "...", str_addr,
+			   r->prefix, W_IU(sess));
+		info->routes.arr[info->routes.nr++] = *r;
+	}
+}
+
+
+/*
+ * Must be called with @state->sess_stk_lock held.
+ */
+static void auth_list_remove(struct srv_udp_state *state, struct udp_sess *sess)
+{
+	uint32_t pos = sess->info->auth_pos;
+	uint32_t last = atomic_load_explicit(&state->nr_auth,
+					     memory_order_relaxed) - 1u;
+	uint32_t moved = atomic_load_explicit(&state->auth_list[last],
+					      memory_order_relaxed);
+
+	atomic_store_explicit(&state->auth_list[pos], moved,
+			      memory_order_relaxed);
+	state->sess_info[moved].auth_pos = pos;
+	atomic_store_explicit(&state->nr_auth, last, memory_order_release);
+}
+
+
+/*
+ * Mark @sess authenticated and load its routes, unless it has
+ * been deleted (see delete_udp_session()) since @gen was taken.
+ * The check and the setup are done under @state->sess_stk_lock,
+ * so a racing delete sees either nothing or all of it.
+ */
+int udp_sess_set_authenticated(struct srv_udp_state *state,
+			       struct udp_sess *sess, uint32_t gen,
+			       const char *username, uint32_t ipv4_iff,
+			       const struct auth_routes *routes)
+	__acquires(&state->sess_stk_lock)
+	__releases(&state->sess_stk_lock)
+{
+	int ret = 0;
+	uint32_t pos;
+
+	mutex_lock(&state->sess_stk_lock);
+	if (unlikely(atomic_load_explicit(&sess->gen,
+					  memory_order_relaxed) != gen)) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	if (sess->is_authenticated)
+		goto out;
+
+	pos = atomic_load_explicit(&state->nr_auth, memory_order_relaxed);
+	atomic_store_explicit(&state->auth_list[pos], sess->idx,
+			      memory_order_relaxed);
+	sess->info->auth_pos = pos;
+	sess->is_authenticated = true;
+	atomic_store_explicit(&state->nr_auth, pos + 1u, memory_order_release);
+
+	strncpy2(sess->info->username, username, sizeof(sess->info->username));
+	add_sess_routes(state, sess, ipv4_iff, routes);
 out:
-	mutex_unlock(&state->sess_map_lock);
-	if (ret)
-		errno = -ret;
+	mutex_unlock(&state->sess_stk_lock);
 	return ret;
 }
 
 
-int delete_udp_session(struct srv_udp_state *state, struct udp_sess *sess)
+/*
+ * Delete @sess if it's still at generation @gen. Returns
+ * -ENOENT if it has already been deleted (or deleted and
+ * reused) by another thread.
+ */
+int delete_udp_session(struct srv_udp_state *state, struct udp_sess *sess,
+		       uint32_t gen)
 	__acquires(&state->sess_stk_lock)
 	__releases(&state->sess_stk_lock)
 {
 	int ret = 0;
+	uint8_t i;
+
 	mutex_lock(&state->sess_stk_lock);
+	if (unlikely(!(gen & 1u) ||
+		     atomic_load_explicit(&sess->gen,
+					  memory_order_relaxed) != gen)) {
+		mutex_unlock(&state->sess_stk_lock);
+		return -ENOENT;
+	}
+	atomic_store_explicit(&sess->gen, gen + 1u, memory_order_release);
+
+	/*
+	 * Drop the routes and the multicast memberships before
+	 * the index can be reused.
+	 */
+	if (sess->ipv4_iff != 0)
+		del_ipv4_route(state, sess->ipv4_iff, 32);
+	for (i = 0; i < sess->info->routes.nr; i++)
+		del_ipv4_route(state, sess->info->routes.arr[i].addr,
+			       sess->info->routes.arr[i].prefix);
+	if (sess->is_authenticated) {
+		mcast_del_sess(state, sess->idx);
+		auth_list_remove(state, sess);
+	}
 	BUG_ON(bt_stack_push(&state->sess_stk, sess->idx) == -1);
 	if (state->sess_map)
-		ret = remove_sess_from_bkt(state, sess);
+		ret = map_remove_udp_sess(state, sess);
+	disarm_udp_sess_timer(state, sess);
 	reset_udp_session(sess, sess->idx);
 	mutex_unlock(&state->sess_stk_lock);
 	atomic_fetch_sub(&state->n_on_sess, 1);
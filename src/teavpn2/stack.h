@@ -9,17 +9,21 @@
 #include <teavpn2/common.h>
 
 
+/*
+ * The capacity must not exceed INT32_MAX, so a popped value
+ * always fits in the int32_t return value.
+ */
 struct bt_stack {
-	uint16_t		sp;
-	uint16_t		max_sp;
-	uint16_t		*arr;
+	uint32_t		sp;
+	uint32_t		max_sp;
+	uint32_t		*arr;
 };
 
 
 static inline int32_t bt_stack_pop(struct bt_stack *stk)
 {
 	int32_t ret;
-	uint16_t sp = stk->sp;
+	uint32_t sp = stk->sp;
 
 	if (sp == stk->max_sp)
 		/* Stack is empty. */
@@ -31,9 +35,9 @@ static inline int32_t bt_stack_pop(struct bt_stack *stk)
 }
 
 
-static inline int32_t bt_stack_push(struct bt_stack *stk, uint16_t n)
+static inline int32_t bt_stack_push(struct bt_stack *stk, uint32_t n)
 {
-	uint16_t sp = stk->sp;
+	uint32_t sp = stk->sp;
 
 	if (sp == 0)
 		/* Stack is full. */
@@ -46,7 +50,7 @@ static inline int32_t bt_stack_push(struct bt_stack *stk, uint16_t n)
 
 
 static inline struct bt_stack *bt_stack_init(struct bt_stack *stk,
-					     uint16_t capacity)
+					     uint32_t capacity)
 {
 	if (unlikely(!stk)) {
 		errno = -EINVAL;
@@ -73,7 +77,7 @@ static inline void bt_stack_destroy(struct bt_stack *stk)
 static inline void bt_stack_test(__maybe_unused struct bt_stack * stk)
 {
 #ifndef NDEBUG
-	uint16_t i, j, capacity = stk->max_sp;
+	uint32_t i, j, capacity = stk->max_sp;
 
 	assert(capacity > 0);
 
@@ -105,7 +109,7 @@ static inline void bt_stack_test(__maybe_unused struct bt_stack * stk)
 		/*
 		 * Test stack is FIFO.
 		 */
-		assert(bt_stack_pop(stk) == j);
+		assert(bt_stack_pop(stk) == (int32_t)j);
 		__asm__ volatile("":"+r"(stk)::"memory");
 	}
 